@@ -0,0 +1,1237 @@
+#include "provided.h"
+#include "support.h"
+#include "ExpandableHashMap.h"
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <list>
+#include <random>
+#include <chrono>
+#include <algorithm>
+#include <utility>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <atomic>
+#include <unordered_map>
+#include <fstream>
+#include <unistd.h> // For mkstemp and sysconf
+#ifdef __GLIBC__
+#include <malloc.h> // For malloc_trim
+#endif
+using namespace std;
+
+// Benchmarks are run with: GooberEats -bench mapdata.txt [-sizes 1,10,100,1000] [benchmark names...]
+//
+// The load, astar, optimizer and plan benchmarks make up the suite: they run on a seeded random
+// workload drawn from the map's own nodes. Every benchmark prints one JSON object per line, e.g.
+//   {"benchmark":"plan","batch":100,"runs":12,"p50_ms":..,"p95_ms":..,"p99_ms":..,"runs_per_second":..,"items_per_second":..}
+// and nothing else on cout, so results can be compared between builds by a script. -sizes sets the
+// batch sizes (deliveries per run, 1 to 1000) of the optimizer, plan and allocations benchmarks.
+
+static double secondsSince(chrono::steady_clock::time_point start)
+{
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+#ifdef GOOBEREATS_STATS
+// Count every heap allocation so the allocations benchmark can report them
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete" // GCC pairs the inlined library new with this free
+#endif
+static atomic<long long> allocationCount(0), allocationBytes(0);
+
+void* operator new(size_t size)
+{
+    allocationCount++;
+    allocationBytes += size;
+    if (void* p = malloc(size == 0 ? 1 : size))
+        return p;
+    throw bad_alloc();
+}
+
+void operator delete(void* p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+    free(p);
+}
+#endif
+
+const unsigned int WORKLOAD_SEED = 20200311; // Same workload every run
+const int DEFAULT_BATCH_SIZES[] = { 1, 10, 100, 1000 };
+const int MAX_BATCH_SIZE = 1000;
+static vector<int> batchSizes; // Set by runBenchmarks from -sizes
+
+// Nodes of the largest connected piece of the map, so every random workload can actually be routed
+static vector<int> connectedNodes(const StreetGraph& graph)
+{
+    vector<int> component(graph.numNodes(), -1);
+    vector<int> best, current;
+    for (int root = 0; root < graph.numNodes(); root++)
+    {
+        if (component[root] != -1)
+            continue;
+        current.assign(1, root); // Breadth first search, using current as the queue
+        component[root] = root;
+        for (size_t i = 0; i < current.size(); i++)
+            for (int j = graph.adjStart[current[i]]; j < graph.adjStart[current[i]+1]; j++)
+            {
+                StreetEdge e = graph.edge(graph.adjEdges[j]);
+                if (e.usable() && component[e.to] == -1)
+                {
+                    component[e.to] = root;
+                    current.push_back(e.to);
+                }
+            }
+        if (current.size() > best.size())
+            best.swap(current);
+    }
+    return best;
+}
+
+// count deliveries at random nodes out of nodes
+static vector<DeliveryRequest> randomDeliveries(const StreetGraph& graph, const vector<int>& nodes, int count, mt19937& rng)
+{
+    uniform_int_distribution<size_t> pickNode(0, nodes.size() - 1);
+    vector<DeliveryRequest> deliveries;
+    deliveries.reserve(count);
+    for (int i = 0; i < count; i++)
+        deliveries.push_back(DeliveryRequest("item " + to_string(i), graph.coord(nodes[pickNode(rng)])));
+    return deliveries;
+}
+
+// Calls run() at least minRuns times, and more until budget seconds have gone by (up to maxRuns),
+// returning how long each call took
+template <typename Run>
+static vector<double> timeRuns(Run run, int minRuns, int maxRuns, double budget)
+{
+    vector<double> seconds;
+    auto start = chrono::steady_clock::now();
+    while ((int)seconds.size() < maxRuns && ((int)seconds.size() < minRuns || secondsSince(start) < budget))
+    {
+        auto runStart = chrono::steady_clock::now();
+        run();
+        seconds.push_back(secondsSince(runStart));
+    }
+    return seconds;
+}
+
+// Value below which p percent of the (sorted) samples fall, by nearest rank
+static double percentile(const vector<double>& sorted, double p)
+{
+    size_t rank = (size_t)ceil(p / 100 * sorted.size());
+    return sorted[rank == 0 ? 0 : rank - 1];
+}
+
+// Prints one JSON line of percentiles and throughput. Each run handled batch items.
+static void report(const char* name, int batch, vector<double> seconds)
+{
+    sort(seconds.begin(), seconds.end());
+    double total = 0;
+    for (double t : seconds)
+        total += t;
+    char line[512];
+    snprintf(line, sizeof(line),
+             "{\"benchmark\":\"%s\",\"batch\":%d,\"runs\":%d,\"p50_ms\":%.4f,\"p95_ms\":%.4f,\"p99_ms\":%.4f,"
+             "\"mean_ms\":%.4f,\"runs_per_second\":%.2f,\"items_per_second\":%.2f}",
+             name, batch, (int)seconds.size(), percentile(seconds, 50) * 1000, percentile(seconds, 95) * 1000,
+             percentile(seconds, 99) * 1000, total / seconds.size() * 1000, seconds.size() / total, batch * seconds.size() / total);
+    cout << line << endl;
+}
+
+// Picks count node pairs out of a larger random sample, keeping the ones farthest apart
+static vector<pair<GeoCoord, GeoCoord>> longRoutes(const StreetGraph& graph, int count, unsigned int seed)
+{
+    mt19937 rng(seed);
+    uniform_int_distribution<int> pickNode(0, graph.numNodes() - 1);
+    vector<pair<double, pair<int, int>>> candidates;
+    for (int i = 0; i < count * 10; i++)
+    {
+        int a = pickNode(rng), b = pickNode(rng);
+        candidates.push_back(make_pair(coordDistance(graph.points[a], graph.points[b]), make_pair(a, b)));
+    }
+    sort(candidates.rbegin(), candidates.rend());
+    vector<pair<GeoCoord, GeoCoord>> routes;
+    for (int i = 0; i < count && i < (int)candidates.size(); i++)
+        routes.push_back(make_pair(graph.coord(candidates[i].second.first), graph.coord(candidates[i].second.second)));
+    return routes;
+}
+
+// Times A Star over long routes on the map in file order and after reorderForLocality
+static bool benchLayout(const string& mapFile)
+{
+    StreetMap fileOrder, curveOrder;
+    if (!fileOrder.load(mapFile) || !curveOrder.load(mapFile))
+        return false;
+    curveOrder.reorderForLocality();
+    vector<pair<GeoCoord, GeoCoord>> routes = longRoutes(fileOrder.graph(), 200, 1);
+    
+    const StreetMap* maps[2] = { &fileOrder, &curveOrder };
+    double seconds[2], miles[2];
+    for (int m = 0; m < 2; m++)
+    {
+        PointToPointRouter router(maps[m]);
+        miles[m] = 0;
+        auto start = chrono::steady_clock::now();
+        for (int rep = 0; rep < 3; rep++)
+            for (const auto& r : routes)
+            {
+                list<StreetSegment> route;
+                router.generatePointToPointRoute(r.first, r.second, route, miles[m]);
+            }
+        seconds[m] = secondsSince(start);
+    }
+    
+    char line[256];
+    snprintf(line, sizeof(line), "{\"benchmark\":\"layout\",\"routes\":%d,\"reps\":3,\"file_order_ms\":%.2f,\"hilbert_order_ms\":%.2f,\"speedup\":%.2f}",
+             (int)routes.size(), seconds[0] * 1000, seconds[1] * 1000, seconds[0] / seconds[1]);
+    cout << line << endl;
+    if (miles[0] - miles[1] > 1e-6 || miles[1] - miles[0] > 1e-6)
+        cerr << "layout: total route length differs (" << miles[0] << " vs " << miles[1] << ")" << endl;
+    return true;
+}
+
+// Times turning already routed tours into commands, the part of planning after routing
+static bool benchCommands(const string& mapFile)
+{
+    StreetMap map;
+    if (!map.load(mapFile))
+        return false;
+    const StreetGraph& graph = map.graph();
+    PointToPointRouter router(&map);
+    
+    // Route 200 tours of 10 random stops, each starting and ending at a random depot
+    const int numTours = 200, stopsPerTour = 10;
+    mt19937 rng(2);
+    uniform_int_distribution<int> pickNode(0, graph.numNodes() - 1);
+    vector<RoutePath> routes;
+    vector<int> depots;
+    vector<vector<int>> stops;
+    vector<int> order;
+    for (int i = 0; i < stopsPerTour; i++)
+        order.push_back(i);
+    size_t totalEdges = 0;
+    while ((int)routes.size() < numTours)
+    {
+        vector<int> tour(1, pickNode(rng)); // Depot, stops, depot
+        for (int i = 0; i < stopsPerTour; i++)
+            tour.push_back(pickNode(rng));
+        tour.push_back(tour[0]);
+        RoutePath path;
+        bool ok = true;
+        for (size_t i = 1; i < tour.size() && ok; i++)
+            ok = router.generatePointToPointPath(graph.coord(tour[i-1]), graph.coord(tour[i]), path) == DELIVERY_SUCCESS;
+        if (!ok)
+            continue;
+        totalEdges += path.size();
+        routes.push_back(path);
+        depots.push_back(tour[0]);
+        stops.push_back(vector<int>(tour.begin() + 1, tour.end() - 1));
+    }
+    
+    const int reps = 20;
+    vector<PlanCommand> commands;
+    size_t totalCommands = 0;
+    auto start = chrono::steady_clock::now();
+    for (int rep = 0; rep < reps; rep++)
+        for (size_t i = 0; i < routes.size(); i++)
+        {
+            commands.clear();
+            generateCommands(graph, routes[i], depots[i], stops[i], order, commands);
+            totalCommands += commands.size();
+        }
+    double seconds = secondsSince(start);
+    
+    char line[256];
+    snprintf(line, sizeof(line), "{\"benchmark\":\"commands\",\"tours\":%d,\"stops_per_tour\":%d,\"reps\":%d,\"edges_per_tour\":%zu,"
+             "\"commands_per_tour\":%zu,\"ms\":%.2f,\"routes_per_second\":%.0f,\"edges_per_second\":%.0f}",
+             (int)routes.size(), stopsPerTour, reps, totalEdges / routes.size(), totalCommands / (routes.size() * reps),
+             seconds * 1000, routes.size() * reps / seconds, totalEdges * reps / seconds);
+    cout << line << endl;
+    return true;
+}
+
+// Route geometry for a UI to draw, got three ways from the same tours: coords written out from the
+// StreetSegments of each route (what a caller had to do before), and buildRouteGeometry straight from
+// the edges, encoded as a polyline or in binary. Reports the time for all tours and bytes per tour.
+static bool benchGeometry(const string& mapFile)
+{
+    StreetMap map;
+    if (!map.load(mapFile))
+        return false;
+    const StreetGraph& graph = map.graph();
+    PointToPointRouter router(&map);
+    vector<int> nodes = connectedNodes(graph);
+
+    // 200 tours of 10 stops, each starting and ending at a depot
+    const int numTours = 200, stopsPerTour = 10;
+    mt19937 rng(WORKLOAD_SEED);
+    vector<RoutePath> routes(numTours);
+    vector<vector<size_t>> legEdges(numTours);
+    vector<int> depots(numTours);
+    size_t totalEdges = 0;
+    for (int t = 0; t < numTours; t++)
+    {
+        vector<DeliveryRequest> tour = randomDeliveries(graph, nodes, stopsPerTour + 1, rng);
+        tour.push_back(tour[0]); // Back to the depot
+        depots[t] = map.nodeAt(tour[0].location);
+        for (size_t i = 1; i < tour.size(); i++)
+        {
+            router.generatePointToPointPath(tour[i-1].location, tour[i].location, routes[t]);
+            legEdges[t].push_back(routes[t].size());
+        }
+        totalEdges += routes[t].size();
+    }
+
+    size_t textBytes = 0, polylineBytes = 0, binaryBytes = 0;
+    vector<double> segments = timeRuns([&] {
+        textBytes = 0;
+        for (const RoutePath& route : routes)
+        {
+            list<StreetSegment> segs;
+            appendSegments(graph, route, segs);
+            string text;
+            for (const StreetSegment& seg : segs)
+                text += seg.start.latitudeText + "," + seg.start.longitudeText + " ";
+            if (!segs.empty())
+                text += segs.back().end.latitudeText + "," + segs.back().end.longitudeText;
+            textBytes += text.size();
+        }
+    }, 3, 50, 2.0);
+    RouteGeometry geometry;
+    string out;
+    vector<double> polyline = timeRuns([&] {
+        polylineBytes = 0;
+        for (int t = 0; t < numTours; t++)
+        {
+            buildRouteGeometry(graph, routes[t], depots[t], legEdges[t], geometry);
+            out.clear();
+            encodePolyline(geometry, 5, out);
+            polylineBytes += out.size();
+        }
+    }, 3, 200, 2.0);
+    vector<double> binary = timeRuns([&] {
+        binaryBytes = 0;
+        for (int t = 0; t < numTours; t++)
+        {
+            buildRouteGeometry(graph, routes[t], depots[t], legEdges[t], geometry);
+            out.clear();
+            encodeBinaryGeometry(geometry, out);
+            binaryBytes += out.size();
+        }
+    }, 3, 200, 2.0);
+
+    const struct { const char* mode; vector<double>* seconds; size_t bytes; } modes[] = {
+        { "segments_text", &segments, textBytes }, { "polyline", &polyline, polylineBytes }, { "binary", &binary, binaryBytes } };
+    for (const auto& mode : modes)
+    {
+        vector<double>& seconds = *mode.seconds;
+        sort(seconds.begin(), seconds.end());
+        char line[512];
+        snprintf(line, sizeof(line), "{\"benchmark\":\"geometry\",\"mode\":\"%s\",\"tours\":%d,\"edges_per_tour\":%zu,\"runs\":%d,"
+                 "\"p50_ms\":%.3f,\"bytes_per_tour\":%zu,\"speedup\":%.2f}",
+                 mode.mode, numTours, totalEdges / numTours, (int)seconds.size(), percentile(seconds, 50) * 1000,
+                 mode.bytes / numTours, percentile(segments, 50) / percentile(seconds, 50));
+        cout << line << endl;
+    }
+    return true;
+}
+
+// Time to load the whole map file
+// Whether two loads of the same file came out exactly the same, ids and all
+static bool sameGraph(const StreetGraph& a, const StreetGraph& b)
+{
+    if (a.numNodes() != b.numNodes() || a.numEdges() != b.numEdges() || a.streetNames != b.streetNames ||
+        a.nodes != b.nodes || a.adjStart != b.adjStart || a.adjEdges != b.adjEdges)
+        return false;
+    for (int n = 0; n < a.numNodes(); n++)
+        if (a.points[n].latitude != b.points[n].latitude || a.points[n].longitude != b.points[n].longitude)
+            return false;
+    for (int e = 0; e < a.numEdges(); e++)
+        if (a.edge(e).from != b.edge(e).from || a.edge(e).to != b.edge(e).to || a.edge(e).street != b.edge(e).street ||
+            a.edge(e).weight != b.edge(e).weight || a.angle(e) != b.angle(e))
+            return false;
+    return true;
+}
+
+// Load with the default thread count, then with 1, 2 and 4 threads, checking each gives the same map
+static bool benchLoad(const string& mapFile)
+{
+    bool ok = true;
+    vector<double> seconds = timeRuns([&] {
+        StreetMap map;
+        ok = map.load(mapFile) && ok;
+    }, 5, 50, 2.0);
+    if (!ok)
+        return false;
+    report("load", 1, seconds);
+    
+    StreetMap reference;
+    reference.setLoadThreads(1);
+    if (!reference.load(mapFile))
+        return false;
+    const int threadCounts[] = { 1, 2, 4 };
+    for (int threads : threadCounts)
+    {
+        StreetMap map;
+        map.setLoadThreads(threads);
+        seconds = timeRuns([&] {
+            StreetMap timed;
+            timed.setLoadThreads(threads);
+            timed.load(mapFile);
+        }, 5, 50, 2.0);
+        bool same = map.load(mapFile) && sameGraph(map.graph(), reference.graph());
+        sort(seconds.begin(), seconds.end());
+        char json[256];
+        snprintf(json, sizeof(json), "{\"benchmark\":\"load\",\"threads\":%d,\"hardware_threads\":%d,\"p50_ms\":%.4f,\"same_graph\":%s}",
+                 threads, hardwareThreads(), percentile(seconds, 50) * 1000, same ? "true" : "false");
+        cout << json << endl;
+        ok = same && ok;
+    }
+    return ok;
+}
+
+// std::unordered_map behind ExpandableHashMap's interface, as a reference point
+template<typename KeyType, typename ValueType, typename Hash>
+struct StdMapAdapter
+{
+    std::unordered_map<KeyType, ValueType, Hash> map;
+    void associate(const KeyType& key, const ValueType& value) { map[key] = value; }
+    const ValueType* find(const KeyType& key) const
+    {
+        auto it = map.find(key);
+        return it == map.end() ? nullptr : &it->second;
+    }
+    int probeLength(const KeyType&) const { return 1; }
+};
+
+// Nanoseconds per insert, per lookup of a key that's there and of one that isn't, and the mean
+// entries compared per hit, for one specialization of a hash map
+template<typename Map, typename KeyType>
+static void timeHashMap(const char* name, const vector<KeyType>& keys, const vector<KeyType>& missing)
+{
+    const int reps = max(1, 2000000 / (int)keys.size()); // Enough lookups to time
+    double insertSeconds = 0;
+    Map* map = nullptr;
+    for (int r = 0; r < 5; r++) // Best of a few fresh maps
+    {
+        delete map;
+        map = new Map();
+        auto start = chrono::steady_clock::now();
+        for (size_t i = 0; i < keys.size(); i++)
+            map->associate(keys[i], (int)i);
+        double seconds = secondsSince(start);
+        insertSeconds = r == 0 ? seconds : min(insertSeconds, seconds);
+    }
+    long long found = 0; // Used so the lookups aren't optimized away
+    auto start = chrono::steady_clock::now();
+    for (int r = 0; r < reps; r++)
+        for (const KeyType& key : keys)
+            found += map->find(key) != nullptr;
+    double hitSeconds = secondsSince(start);
+    start = chrono::steady_clock::now();
+    for (int r = 0; r < reps; r++)
+        for (const KeyType& key : missing)
+            found += map->find(key) != nullptr;
+    double missSeconds = secondsSince(start);
+    long long probes = 0;
+    for (const KeyType& key : keys)
+        probes += map->probeLength(key);
+    delete map;
+    if (found != (long long)reps * (long long)keys.size())
+        cerr << "hashmap: " << name << " lookups are wrong" << endl;
+
+    char line[512];
+    snprintf(line, sizeof(line), "{\"benchmark\":\"hashmap\",\"map\":\"%s\",\"keys\":%d,\"insert_ns\":%.1f,\"hit_ns\":%.1f,\"miss_ns\":%.1f,\"mean_probes\":%.3f}",
+             name, (int)keys.size(), insertSeconds / keys.size() * 1e9, hitSeconds / ((double)reps * keys.size()) * 1e9,
+             missSeconds / ((double)reps * missing.size()) * 1e9, (double)probes / keys.size());
+    cout << line << endl;
+}
+
+// ExpandableHashMap with each hasher, probing and growth policy, on keys taken from the map: node ids,
+// node coords and street names. Misses are looked up with keys just like them that aren't in the map.
+static bool benchHashMap(const string& mapFile)
+{
+    StreetMap map;
+    if (!map.load(mapFile))
+        return false;
+    const StreetGraph& graph = map.graph();
+    mt19937 rng(WORKLOAD_SEED);
+
+    vector<int> ids, missingIds;
+    for (int n = 0; n < graph.numNodes(); n++)
+    {
+        ids.push_back(n);
+        missingIds.push_back(graph.numNodes() + n);
+    }
+    shuffle(ids.begin(), ids.end(), rng);
+    timeHashMap<ExpandableHashMap<int, int, IntHasher, equal_to<int>, LinearProbing>>("int/IntHasher/linear", ids, missingIds);
+    timeHashMap<ExpandableHashMap<int, int, IntHasher, equal_to<int>, QuadraticProbing>>("int/IntHasher/quadratic", ids, missingIds);
+    timeHashMap<ExpandableHashMap<int, int, IntHasher, equal_to<int>, LinearProbing, QuadruplingGrowth>>("int/IntHasher/linear/x4", ids, missingIds);
+    timeHashMap<ExpandableHashMap<int, int, StdHasher<int>, equal_to<int>, LinearProbing>>("int/StdHasher/linear", ids, missingIds);
+    timeHashMap<StdMapAdapter<int, int, hash<int>>>("int/unordered_map", ids, missingIds);
+
+    vector<GeoCoord> coords, missingCoords;
+    for (int n : ids)
+    {
+        coords.push_back(graph.coord(n));
+        missingCoords.push_back(makeGeoCoord(graph.points[n].latitude + 1e-6, graph.points[n].longitude));
+    }
+    timeHashMap<ExpandableHashMap<GeoCoord, int>>("GeoCoord/hasher/linear", coords, missingCoords);
+    timeHashMap<ExpandableHashMap<GeoCoord, int, FreeFunctionHasher<GeoCoord>, equal_to<GeoCoord>, QuadraticProbing>>("GeoCoord/hasher/quadratic", coords, missingCoords);
+
+    vector<string> names = graph.streetNames, missingNames;
+    shuffle(names.begin(), names.end(), rng);
+    for (const string& name : names)
+        missingNames.push_back(name + " Annex");
+    timeHashMap<ExpandableHashMap<string, int>>("string/hasher/linear", names, missingNames);
+    timeHashMap<ExpandableHashMap<string, int, FreeFunctionHasher<string>, equal_to<string>, QuadraticProbing>>("string/hasher/quadratic", names, missingNames);
+    timeHashMap<ExpandableHashMap<string, int, StdHasher<string>, equal_to<string>, LinearProbing>>("string/StdHasher/linear", names, missingNames);
+    timeHashMap<StdMapAdapter<string, int, hash<string>>>("string/unordered_map", names, missingNames);
+    return true;
+}
+
+// Latency of single A Star queries between random nodes
+static bool benchAStar(const string& mapFile)
+{
+    StreetMap map;
+    if (!map.load(mapFile))
+        return false;
+    const StreetGraph& graph = map.graph();
+    vector<int> nodes = connectedNodes(graph);
+    PointToPointRouter router(&map);
+    mt19937 rng(WORKLOAD_SEED);
+    uniform_int_distribution<size_t> pickNode(0, nodes.size() - 1);
+    vector<double> seconds = timeRuns([&] {
+        RoutePath path;
+        router.generatePointToPointPath(graph.coord(nodes[pickNode(rng)]), graph.coord(nodes[pickNode(rng)]), path);
+    }, 500, 500, 0);
+    report("astar", 1, seconds);
+    return true;
+}
+
+// Weighted A Star at a range of bounds against exact A Star on the same random routes: one JSON line
+// per bound with latency percentiles, the route length error in miles, and the suboptimality factor
+// the router guaranteed. The guarantee is on the router's cost (see StreetEdge::weight), so the cost
+// ratio is reported too; it never passes the guaranteed factor, though the miles error can.
+static bool benchApprox(const string& mapFile)
+{
+    StreetMap map;
+    if (!map.load(mapFile))
+        return false;
+    const StreetGraph& graph = map.graph();
+    vector<int> nodes = connectedNodes(graph);
+    PointToPointRouter router(&map);
+    mt19937 rng(WORKLOAD_SEED);
+    uniform_int_distribution<size_t> pickNode(0, nodes.size() - 1);
+    vector<pair<GeoCoord, GeoCoord>> routes;
+    vector<double> exactMiles, exactCost;
+    auto cost = [&](const RoutePath& path) {
+        double total = 0;
+        for (int e : path.edges)
+            total += graph.edge(e).weight;
+        return total;
+    };
+    for (int i = 0; i < 300; i++)
+    {
+        routes.push_back(make_pair(graph.coord(nodes[pickNode(rng)]), graph.coord(nodes[pickNode(rng)])));
+        RoutePath path;
+        router.generatePointToPointPath(routes.back().first, routes.back().second, path);
+        exactMiles.push_back(path.miles());
+        exactCost.push_back(cost(path));
+    }
+
+    const double bounds[] = { 1, 1.05, 1.1, 1.25, 1.5, 2, 3 };
+    for (double bound : bounds)
+    {
+        vector<double> seconds;
+        double totalError = 0, maxError = 0, totalFactor = 0, maxFactor = 0, maxCostRatio = 1;
+        int broken = 0; // Routes costing more than their guarantee allows
+        RoutePath path;
+        for (size_t i = 0; i < routes.size(); i++)
+        {
+            path.clear();
+            double factor;
+            auto start = chrono::steady_clock::now();
+            router.generateApproximatePath(routes[i].first, routes[i].second, bound, path, factor);
+            seconds.push_back(secondsSince(start));
+            double error = exactMiles[i] > 0 ? path.miles() / exactMiles[i] - 1 : 0; // Relative extra distance
+            totalError += error;
+            maxError = max(maxError, error);
+            totalFactor += factor;
+            maxFactor = max(maxFactor, factor);
+            double costRatio = exactCost[i] > 0 ? cost(path) / exactCost[i] : 1;
+            maxCostRatio = max(maxCostRatio, costRatio);
+            broken += costRatio > factor * (1 + 1e-9);
+        }
+        sort(seconds.begin(), seconds.end());
+        char line[512];
+        snprintf(line, sizeof(line),
+                 "{\"benchmark\":\"approx\",\"bound\":%.2f,\"routes\":%d,\"p50_ms\":%.4f,\"p99_ms\":%.4f,"
+                 "\"mean_error_pct\":%.3f,\"max_error_pct\":%.3f,\"max_cost_ratio\":%.4f,\"mean_guaranteed\":%.4f,\"max_guaranteed\":%.4f}",
+                 bound, (int)routes.size(), percentile(seconds, 50) * 1000, percentile(seconds, 99) * 1000,
+                 totalError / routes.size() * 100, maxError * 100, maxCostRatio, totalFactor / routes.size(), maxFactor);
+        cout << line << endl;
+        if (broken > 0)
+            cerr << "approx: " << broken << " routes broke their guarantee at bound " << bound << endl;
+    }
+    return true;
+}
+
+// Routes with and without turn costs on the same random routes: latency, miles and turns per route.
+// Also times building the map's turn graph, which happens once.
+static bool benchTurns(const string& mapFile)
+{
+    StreetMap map;
+    if (!map.load(mapFile))
+        return false;
+    const StreetGraph& graph = map.graph();
+    auto buildStart = chrono::steady_clock::now();
+    map.buildTurnGraph();
+    double buildSeconds = secondsSince(buildStart);
+    cout << "{\"benchmark\":\"turns\",\"turn_graph_ms\":" << buildSeconds * 1000 << ",\"turn_graph_bytes\":"
+         << map.turnGraph()->memoryUsage() << "}" << endl;
+
+    vector<int> nodes = connectedNodes(graph);
+    mt19937 rng(WORKLOAD_SEED);
+    uniform_int_distribution<size_t> pickNode(0, nodes.size() - 1);
+    vector<pair<GeoCoord, GeoCoord>> routes;
+    for (int i = 0; i < 300; i++)
+        routes.push_back(make_pair(graph.coord(nodes[pickNode(rng)]), graph.coord(nodes[pickNode(rng)])));
+
+    TurnCosts off, on, leftHeavy;
+    on.leftTurn = 0.05; // A left turn is worth about a block of driving, a right turn less, a U-turn more
+    on.rightTurn = 0.02;
+    on.uTurn = 0.2;
+    leftHeavy.leftTurn = 0.2; // Left turns avoided hard, U-turns at their default price
+    leftHeavy.rightTurn = 0.02;
+    const pair<const char*, TurnCosts> modes[] = { make_pair("off", off), make_pair("on", on), make_pair("left_heavy", leftHeavy) };
+    for (const auto& mode : modes)
+    {
+        PointToPointRouter router(&map);
+        router.setTurnCosts(mode.second);
+        vector<double> seconds;
+        double miles = 0;
+        long long turns = 0, uTurns = 0;
+        for (const auto& route : routes)
+        {
+            RoutePath path;
+            auto start = chrono::steady_clock::now();
+            router.generatePointToPointPath(route.first, route.second, path);
+            seconds.push_back(secondsSince(start));
+            miles += path.miles();
+            for (size_t i = 1; i < path.size(); i++)
+            {
+                double angle = graph.angle(path.edges[i]) - graph.angle(path.edges[i-1]);
+                if (angle < 0)
+                    angle += 360;
+                turns += angle >= on.minTurnAngle && angle <= 360 - on.minTurnAngle;
+                uTurns += path.edges[i] == (path.edges[i-1] ^ 1);
+            }
+        }
+        sort(seconds.begin(), seconds.end());
+        char line[512];
+        snprintf(line, sizeof(line), "{\"benchmark\":\"turns\",\"turn_costs\":\"%s\",\"routes\":%d,\"p50_ms\":%.4f,\"p99_ms\":%.4f,"
+                 "\"mean_miles\":%.3f,\"mean_turns\":%.2f,\"u_turns\":%lld}",
+                 mode.first, (int)routes.size(), percentile(seconds, 50) * 1000, percentile(seconds, 99) * 1000,
+                 miles / routes.size(), (double)turns / routes.size(), uTurns);
+        cout << line << endl;
+    }
+    return true;
+}
+
+// A Star over the map's chain graph against a search of every node, on the same random routes: latency,
+// nodes expanded (GOOBEREATS_STATS builds only) and how many routes came out differently, which should
+// be none. Also times building the chain graph, which load does once, and adding segments to the map.
+static bool benchChains(const string& mapFile)
+{
+    StreetMap map;
+    if (!map.load(mapFile))
+        return false;
+    const StreetGraph& graph = map.graph();
+    ChainGraph chains;
+    auto buildStart = chrono::steady_clock::now();
+    chains.build(graph);
+    double buildSeconds = secondsSince(buildStart);
+    int ends = 0;
+    for (int n = 0; n < graph.numNodes(); n++)
+        ends += !chains.interior(n);
+    cout << "{\"benchmark\":\"chains\",\"chain_graph_ms\":" << buildSeconds * 1000 << ",\"chain_graph_bytes\":"
+         << chains.memoryUsage() << ",\"nodes\":" << graph.numNodes() << ",\"chain_ends\":" << ends
+         << ",\"shortcuts\":" << chains.shortcuts.size() << "}" << endl;
+
+    vector<int> nodes = connectedNodes(graph);
+    mt19937 rng(WORKLOAD_SEED);
+    uniform_int_distribution<size_t> pickNode(0, nodes.size() - 1);
+    vector<pair<GeoCoord, GeoCoord>> routes;
+    for (int i = 0; i < 500; i++)
+        routes.push_back(make_pair(graph.coord(nodes[pickNode(rng)]), graph.coord(nodes[pickNode(rng)])));
+
+    vector<RoutePath> fullPaths(routes.size());
+    for (int shortcuts = 0; shortcuts < 2; shortcuts++)
+    {
+        PointToPointRouter router(&map);
+        router.setChainShortcuts(shortcuts == 1);
+        vector<double> seconds;
+        double expanded = 0;
+        int differ = 0;
+        for (size_t i = 0; i < routes.size(); i++)
+        {
+            RoutePath path;
+            auto start = chrono::steady_clock::now();
+            router.generatePointToPointPath(routes[i].first, routes[i].second, path);
+            seconds.push_back(secondsSince(start));
+            expanded += router.stats().nodesExpanded;
+            if (shortcuts == 0)
+                fullPaths[i] = path;
+            else
+                differ += path.edges != fullPaths[i].edges;
+        }
+        sort(seconds.begin(), seconds.end());
+        char line[512];
+        snprintf(line, sizeof(line), "{\"benchmark\":\"chains\",\"shortcuts\":%s,\"routes\":%d,\"p50_ms\":%.4f,\"p99_ms\":%.4f,"
+                 "\"mean_expanded\":%.1f,\"routes_differing\":%d}",
+                 shortcuts == 1 ? "true" : "false", (int)routes.size(), percentile(seconds, 50) * 1000,
+                 percentile(seconds, 99) * 1000, STATS_ENABLED ? expanded / routes.size() : -1.0, differ);
+        cout << line << endl;
+    }
+
+    // Segments added at runtime, which patch the chain and turn graphs around their ends
+    map.buildTurnGraph();
+    vector<double> seconds;
+    for (int i = 0; i < 200; i++)
+    {
+        GeoCoord a = graph.coord(nodes[pickNode(rng)]), b = graph.coord(nodes[pickNode(rng)]);
+        auto start = chrono::steady_clock::now();
+        map.addSegment(a, b, "Benchmark Street");
+        seconds.push_back(secondsSince(start));
+    }
+    sort(seconds.begin(), seconds.end());
+    char line[256];
+    snprintf(line, sizeof(line), "{\"benchmark\":\"chains\",\"added_segments\":%d,\"add_p50_ms\":%.4f,\"add_p99_ms\":%.4f}",
+             (int)seconds.size(), percentile(seconds, 50) * 1000, percentile(seconds, 99) * 1000);
+    cout << line << endl;
+    return true;
+}
+
+// A tour of 40 deliveries that then has 100 deliveries added or cancelled one at a time, kept up to
+// date by a DeliverySession and, for comparison, planned again from scratch after every change.
+// Reports the time per change, how many legs each one routed and the final tour length both ways.
+static bool benchSession(const string& mapFile)
+{
+    StreetMap map;
+    if (!map.load(mapFile))
+        return false;
+    const StreetGraph& graph = map.graph();
+    vector<int> nodes = connectedNodes(graph);
+    mt19937 rng(WORKLOAD_SEED);
+    GeoCoord depot = graph.coord(nodes[uniform_int_distribution<size_t>(0, nodes.size() - 1)(rng)]);
+    vector<DeliveryRequest> extra = randomDeliveries(graph, nodes, 100, rng);
+    DeliverySession session(&map);
+    if (session.start(depot, randomDeliveries(graph, nodes, 40, rng)) != DELIVERY_SUCCESS)
+        return false;
+
+    DeliveryPlanner planner(&map);
+    vector<double> incremental, scratch;
+    long long legsRouted = 0;
+    double scratchMiles = 0;
+    for (size_t i = 0; i < extra.size(); i++)
+    {
+        auto start = chrono::steady_clock::now();
+        if (i % 2 == 0) // Add
+        {
+            int id;
+            if (session.addDelivery(extra[i], id) != DELIVERY_SUCCESS)
+                return false;
+        }
+        else // Cancel one of the deliveries left
+        {
+            const vector<int>& left = session.remainingDeliveries();
+            session.cancelDelivery(left[uniform_int_distribution<size_t>(0, left.size() - 1)(rng)]);
+        }
+        incremental.push_back(secondsSince(start));
+        legsRouted += session.legsRouted();
+
+        vector<int> ids = session.remainingDeliveries(); // In the order they were given, not the session's tour order
+        sort(ids.begin(), ids.end());
+        vector<DeliveryRequest> left;
+        for (int id : ids)
+            left.push_back(session.deliveries()[id]);
+        vector<PlanCommand> commands;
+        start = chrono::steady_clock::now();
+        planner.generateCompactPlan(depot, left, commands, scratchMiles);
+        scratch.push_back(secondsSince(start));
+    }
+
+    vector<PlanCommand> commands;
+    double sessionMiles;
+    session.currentCompactPlan(commands, sessionMiles);
+    sort(incremental.begin(), incremental.end());
+    sort(scratch.begin(), scratch.end());
+    char line[512];
+    snprintf(line, sizeof(line), "{\"benchmark\":\"session\",\"changes\":%d,\"stops\":%d,\"incremental_p50_ms\":%.4f,\"incremental_p99_ms\":%.4f,"
+             "\"legs_routed_per_change\":%.2f,\"scratch_p50_ms\":%.4f,\"scratch_p99_ms\":%.4f,\"session_miles\":%.3f,\"scratch_miles\":%.3f}",
+             (int)extra.size(), (int)session.remainingDeliveries().size(), percentile(incremental, 50) * 1000, percentile(incremental, 99) * 1000,
+             (double)legsRouted / extra.size(), percentile(scratch, 50) * 1000, percentile(scratch, 99) * 1000, sessionMiles, scratchMiles);
+    cout << line << endl;
+    return true;
+}
+
+// Delivery order optimization for each batch size
+static bool benchOptimizer(const string& mapFile)
+{
+    StreetMap map;
+    if (!map.load(mapFile))
+        return false;
+    vector<int> nodes = connectedNodes(map.graph());
+    DeliveryOptimizer optimizer(&map);
+    for (int batch : batchSizes)
+    {
+        mt19937 rng(WORKLOAD_SEED + batch);
+        vector<DeliveryRequest> deliveries = randomDeliveries(map.graph(), nodes, batch + 1, rng);
+        GeoCoord depot = deliveries.back().location; // One extra random node for the depot
+        deliveries.pop_back();
+        vector<double> seconds = timeRuns([&] {
+            vector<int> order;
+            double oldDist, newDist;
+            optimizer.optimizeDeliveryOrder(depot, deliveries, order, oldDist, newDist);
+        }, 20, 10000, 1.0);
+        report("optimizer", batch, seconds);
+    }
+    return true;
+}
+
+// Big batches ordered the one by one way and by zones (on one thread and on every core): time and the
+// crow's distance of the order found. At 10000 stops a whole plan is timed with zones too.
+static bool benchZones(const string& mapFile)
+{
+    StreetMap map;
+    if (!map.load(mapFile))
+        return false;
+    vector<int> nodes = connectedNodes(map.graph());
+    const int maxZoneStops = 100;
+    for (int batch : { 1000, 10000 })
+    {
+        mt19937 rng(WORKLOAD_SEED + batch);
+        vector<DeliveryRequest> deliveries = randomDeliveries(map.graph(), nodes, batch + 1, rng);
+        GeoCoord depot = deliveries.back().location;
+        deliveries.pop_back();
+        const pair<const char*, int> modes[] = { make_pair("greedy", -1), make_pair("zones", 1), make_pair("zones", 0) };
+        for (const auto& mode : modes)
+        {
+            DeliveryOptimizer optimizer(&map);
+            if (mode.second >= 0)
+                optimizer.setZones(maxZoneStops, mode.second);
+            vector<int> order;
+            double oldDist, newDist;
+            vector<double> seconds = timeRuns([&] {
+                optimizer.optimizeDeliveryOrder(depot, deliveries, order, oldDist, newDist);
+            }, 1, 20, 1.0);
+            vector<int> sorted(order); // Every delivery exactly once
+            sort(sorted.begin(), sorted.end());
+            bool valid = (int)sorted.size() == batch;
+            for (int i = 0; valid && i < batch; i++)
+                valid = sorted[i] == i;
+            sort(seconds.begin(), seconds.end());
+            char line[512];
+            snprintf(line, sizeof(line), "{\"benchmark\":\"zones\",\"mode\":\"%s\",\"threads\":%d,\"batch\":%d,\"runs\":%d,"
+                     "\"p50_ms\":%.3f,\"crow_miles\":%.2f,\"valid\":%s}",
+                     mode.first, mode.second > 0 ? mode.second : mode.second < 0 ? 1 : hardwareThreads(), batch,
+                     (int)seconds.size(), percentile(seconds, 50) * 1000, newDist, valid ? "true" : "false");
+            cout << line << endl;
+        }
+        if (batch == 10000)
+        {
+            DeliveryPlanner planner(&map);
+            planner.setZones(maxZoneStops);
+            vector<PlanCommand> commands;
+            double miles;
+            auto start = chrono::steady_clock::now();
+            DeliveryResult result = planner.generateCompactPlan(depot, deliveries, commands, miles);
+            cout << "{\"benchmark\":\"zones\",\"mode\":\"plan\",\"batch\":" << batch << ",\"ms\":" << secondsSince(start) * 1000
+                 << ",\"miles\":" << miles << ",\"ok\":" << (result == DELIVERY_SUCCESS ? "true" : "false") << "}" << endl;
+        }
+    }
+    return true;
+}
+
+// Reads a deliveries file of a million random lines the line by line way (getline and parseDelivery
+// into DeliveryRequests) and with DeliveryFile: parsing alone, then with findNodes checking every
+// coord against the map, then building the same DeliveryRequests
+static bool benchDeliveryFile(const string& mapFile)
+{
+    StreetMap map;
+    if (!map.load(mapFile))
+        return false;
+    const StreetGraph& graph = map.graph();
+    const int lines = 1000000;
+    char fileName[] = "/tmp/goobereats_benchXXXXXX";
+    int fd = mkstemp(fileName);
+    if (fd == -1)
+    {
+        cerr << "deliveryfile: can't make a temporary file" << endl;
+        return true;
+    }
+    close(fd);
+    {
+        mt19937 rng(WORKLOAD_SEED);
+        uniform_int_distribution<int> pickNode(0, graph.numNodes() - 1);
+        ofstream out(fileName);
+        GeoCoord depot = graph.coord(0);
+        out << depot.latitudeText << " " << depot.longitudeText << "\n";
+        for (int i = 0; i < lines; i++)
+        {
+            GeoCoord at = graph.coord(pickNode(rng));
+            out << at.latitudeText << " " << at.longitudeText << ":item " << i << "\n";
+        }
+    }
+
+    size_t count = 0;
+    vector<double> byLine = timeRuns([&] {
+        ifstream inf(fileName);
+        string lat, lon, item, line;
+        inf >> lat >> lon;
+        inf.ignore(10000, '\n');
+        vector<DeliveryRequest> requests;
+        while (getline(inf, line))
+            if (parseDelivery(line, lat, lon, item))
+                requests.push_back(DeliveryRequest(item, GeoCoord(lat, lon)));
+        count = requests.size();
+    }, 3, 10, 3.0);
+    int offMap = 0;
+    vector<double> parseOnly = timeRuns([&] {
+        DeliveryFile file;
+        file.open(fileName);
+        count = min(count, file.deliveries().size());
+    }, 3, 20, 2.0);
+    vector<double> withNodes = timeRuns([&] {
+        DeliveryFile file;
+        file.open(fileName);
+        vector<int> nodes;
+        offMap = file.findNodes(map, nodes);
+    }, 3, 20, 2.0);
+    vector<double> withRequests = timeRuns([&] {
+        DeliveryFile file;
+        file.open(fileName);
+        vector<DeliveryRequest> requests;
+        file.toRequests(requests);
+    }, 3, 20, 2.0);
+    remove(fileName);
+
+    const pair<const char*, vector<double>*> modes[] = { make_pair("getline", &byLine), make_pair("mapped", &parseOnly),
+        make_pair("mapped_find_nodes", &withNodes), make_pair("mapped_requests", &withRequests) };
+    for (const auto& mode : modes)
+    {
+        vector<double>& seconds = *mode.second;
+        sort(seconds.begin(), seconds.end());
+        char line[512];
+        snprintf(line, sizeof(line), "{\"benchmark\":\"deliveryfile\",\"mode\":\"%s\",\"lines\":%d,\"runs\":%d,\"p50_ms\":%.2f,"
+                 "\"lines_per_second\":%.0f,\"speedup\":%.2f}",
+                 mode.first, lines, (int)seconds.size(), percentile(seconds, 50) * 1000, lines / percentile(seconds, 50),
+                 percentile(byLine, 50) / percentile(seconds, 50));
+        cout << line << endl;
+    }
+    if ((int)count != lines || offMap != 0)
+        cerr << "deliveryfile: read " << count << " deliveries of " << lines << ", " << offMap << " off the map" << endl;
+    return true;
+}
+
+// Whole delivery plans (optimize, route every leg, generate commands) for each batch size,
+// with a new random set of deliveries for every run
+static bool benchPlans(const string& mapFile)
+{
+    StreetMap map;
+    if (!map.load(mapFile))
+        return false;
+    vector<int> nodes = connectedNodes(map.graph());
+    DeliveryPlanner planner(&map);
+    for (int batch : batchSizes)
+    {
+        mt19937 rng(WORKLOAD_SEED + batch);
+        vector<GeoCoord> depots; // Generated up front so it isn't timed
+        vector<vector<DeliveryRequest>> workload;
+        for (int i = 0; i < 200; i++)
+        {
+            workload.push_back(randomDeliveries(map.graph(), nodes, batch + 1, rng));
+            depots.push_back(workload.back().back().location); // One extra random node for the depot
+            workload.back().pop_back();
+        }
+        size_t next = 0;
+        bool ok = true;
+        vector<double> seconds = timeRuns([&] {
+            vector<PlanCommand> commands;
+            double miles;
+            ok = planner.generateCompactPlan(depots[next], workload[next], commands, miles) == DELIVERY_SUCCESS && ok;
+            next = (next + 1) % workload.size();
+        }, 3, 200, 2.0);
+        report("plan", batch, seconds);
+        if (!ok)
+            cerr << "plan: some plans failed, timings are not representative" << endl;
+    }
+    return true;
+}
+
+// Runs a small workload and prints the loader, router and optimizer stats as JSON lines
+static bool benchStats(const string& mapFile)
+{
+    if (!STATS_ENABLED)
+    {
+        cout << "{\"benchmark\":\"stats\",\"skipped\":\"build with -DGOOBEREATS_STATS\"}" << endl;
+        return true;
+    }
+    StreetMap map;
+    if (!map.load(mapFile))
+        return false;
+    cout << "{\"stats\":\"load\",\"data\":" << map.loadStats().toJson() << "}" << endl;
+    
+    vector<int> nodes = connectedNodes(map.graph());
+    mt19937 rng(WORKLOAD_SEED);
+    vector<DeliveryRequest> deliveries = randomDeliveries(map.graph(), nodes, 101, rng);
+    GeoCoord depot = deliveries.back().location;
+    deliveries.pop_back();
+    
+    DeliveryOptimizer optimizer(&map);
+    vector<int> order;
+    double oldDist, newDist;
+    optimizer.optimizeDeliveryOrder(depot, deliveries, order, oldDist, newDist);
+    cout << "{\"stats\":\"optimizer\",\"data\":" << optimizer.stats().toJson() << "}" << endl;
+    
+    PointToPointRouter router(&map);
+    GeoCoord from = depot;
+    for (int i : order) // Route the optimized tour leg by leg
+    {
+        RoutePath path;
+        router.generatePointToPointPath(from, deliveries[i].location, path);
+        from = deliveries[i].location;
+    }
+    cout << "{\"stats\":\"router\",\"data\":" << router.stats().toJson() << "}" << endl;
+    return true;
+}
+
+// Heap and other anonymous memory resident in this process, after handing freed heap pages back to
+// the system so they don't count. Pages of the program and libraries are left out, since a load
+// only pulls them in once. 0 where /proc isn't there to ask.
+static long long residentBytes()
+{
+#ifdef __GLIBC__
+    malloc_trim(0);
+#endif
+    long long pages = 0, resident = 0, fileBacked = 0;
+    ifstream statm("/proc/self/statm");
+    if (!(statm >> pages >> resident >> fileBacked))
+        return 0;
+    return (resident - fileBacked) * sysconf(_SC_PAGESIZE);
+}
+
+// Memory held by the map in normal and compact storage, part by part, and how much each load
+// added to the resident set. Compact is loaded first, so it can't reuse pages the other load freed.
+static bool benchMemory(const string& mapFile)
+{
+    StreetMap normal, compact;
+    compact.setCompactStorage(true);
+    long long start = residentBytes();
+    if (!compact.load(mapFile))
+        return false;
+    long long afterCompact = residentBytes();
+    if (!normal.load(mapFile))
+        return false;
+    long long afterNormal = residentBytes();
+    MapMemoryUsage normalUsage, compactUsage;
+    normal.memoryUsage(normalUsage);
+    compact.memoryUsage(compactUsage);
+    long long compactResident = afterCompact - start, normalResident = afterNormal - afterCompact;
+    cout << "{\"memory\":\"normal\",\"bytes\":" << normalUsage.toJson() << ",\"resident_bytes\":" << normalResident << "}" << endl;
+    cout << "{\"memory\":\"compact\",\"bytes\":" << compactUsage.toJson() << ",\"resident_bytes\":" << compactResident << "}" << endl;
+    cout << "{\"memory\":\"reduction\",\"factor\":" << (double)normalUsage.total() / compactUsage.total()
+         << ",\"resident_factor\":" << (compactResident > 0 ? (double)normalResident / compactResident : 0) << "}" << endl;
+    return true;
+}
+
+// Load test for the -serve pipeline: the same seeded stream of NDJSON plan requests is fed through
+// runServer with 1, 2 and 4 planning threads. Reports requests per second and the per-request
+// planning latency percentiles taken from the responses.
+static bool benchServer(const string& mapFile)
+{
+    StreetMap map;
+    if (!map.load(mapFile))
+        return false;
+    vector<int> nodes = connectedNodes(map.graph());
+    mt19937 rng(WORKLOAD_SEED);
+    const int requestCount = 400;
+    string input;
+    for (int i = 0; i < requestCount; i++)
+    {
+        vector<DeliveryRequest> stops = randomDeliveries(map.graph(), nodes, 11, rng); // Last one is the depot
+        input += "{\"id\":" + to_string(i) + ",\"depot\":{\"lat\":\"" + stops.back().location.latitudeText
+            + "\",\"lon\":\"" + stops.back().location.longitudeText + "\"},\"deliveries\":[";
+        for (size_t j = 0; j + 1 < stops.size(); j++)
+            input += string(j > 0 ? "," : "") + "{\"item\":\"" + stops[j].item + "\",\"lat\":\"" + stops[j].location.latitudeText
+                + "\",\"lon\":\"" + stops[j].location.longitudeText + "\"}";
+        input += "]}\n";
+    }
+
+    const int threadCounts[] = { 1, 2, 4 };
+    for (int threads : threadCounts)
+    {
+        istringstream in(input);
+        ostringstream out;
+        auto start = chrono::steady_clock::now();
+        runServer(map, in, out, threads);
+        double seconds = secondsSince(start);
+
+        istringstream responses(out.str());
+        string line;
+        int count = 0, ok = 0;
+        vector<double> latencies;
+        while (getline(responses, line))
+        {
+            count++;
+            if (line.find("\"status\":\"ok\"") == string::npos)
+                continue;
+            ok++;
+            size_t ms = line.find("\"ms\":");
+            latencies.push_back(atof(line.c_str() + ms + 5));
+        }
+        sort(latencies.begin(), latencies.end());
+        char json[256];
+        snprintf(json, sizeof(json), "{\"benchmark\":\"server\",\"threads\":%d,\"requests\":%d,\"ok\":%d,\"requests_per_second\":%.1f,\"p50_ms\":%.3f,\"p99_ms\":%.3f}",
+                 threads, count, ok, count / seconds, percentile(latencies, 50), percentile(latencies, 99));
+        cout << json << endl;
+        if (count != requestCount || ok != requestCount)
+            cerr << "server: expected " << requestCount << " ok responses" << endl;
+    }
+    return true;
+}
+
+// Heap allocations made by one whole plan, for each batch size, with and without the plan arena,
+// and by one router leg
+#ifdef GOOBEREATS_STATS
+static bool benchAllocations(const string& mapFile)
+{
+    StreetMap map;
+    if (!map.load(mapFile))
+        return false;
+    vector<int> nodes = connectedNodes(map.graph());
+    DeliveryPlanner planner(&map);
+    for (int batch : batchSizes)
+    {
+        mt19937 rng(WORKLOAD_SEED + batch);
+        vector<DeliveryRequest> deliveries = randomDeliveries(map.graph(), nodes, batch + 1, rng);
+        GeoCoord depot = deliveries.back().location;
+        deliveries.pop_back();
+        vector<PlanCommand> commands;
+        commands.reserve(100000); // Output isn't a temporary, keep it out of the count
+        long long counts[2], bytes[2]; // Without the arena, then with it
+        for (int arena = 0; arena < 2; arena++)
+        {
+            planner.setArenaEnabled(arena == 1);
+            commands.clear();
+            double miles;
+            counts[arena] = allocationCount;
+            bytes[arena] = allocationBytes;
+            planner.generateCompactPlan(depot, deliveries, commands, miles);
+            counts[arena] = allocationCount - counts[arena];
+            bytes[arena] = allocationBytes - bytes[arena];
+        }
+        cout << "{\"benchmark\":\"allocations\",\"what\":\"plan\",\"batch\":" << batch << ",\"allocations\":" << counts[1]
+             << ",\"bytes\":" << bytes[1] << ",\"allocations_per_stop\":" << (double)counts[1] / batch
+             << ",\"allocations_no_arena\":" << counts[0] << ",\"bytes_no_arena\":" << bytes[0]
+             << ",\"reduction\":" << (counts[1] > 0 ? (double)counts[0] / counts[1] : 0) << "}" << endl;
+    }
+    planner.setArenaEnabled(true);
+
+    PointToPointRouter router(&map);
+    vector<pair<GeoCoord, GeoCoord>> routes = longRoutes(map.graph(), 100, WORKLOAD_SEED);
+    RoutePath path;
+    path.edges.reserve(1000000);
+    path.cumulativeMiles.reserve(1000000);
+    long long count = allocationCount, bytes = allocationBytes;
+    for (const auto& route : routes)
+        router.generatePointToPointPath(route.first, route.second, path);
+    count = allocationCount - count;
+    bytes = allocationBytes - bytes;
+    cout << "{\"benchmark\":\"allocations\",\"what\":\"leg\",\"legs\":" << routes.size() << ",\"allocations_per_leg\":"
+         << (double)count / routes.size() << ",\"bytes_per_leg\":" << (double)bytes / routes.size() << "}" << endl;
+    return true;
+}
+#else
+static bool benchAllocations(const string&)
+{
+    cout << "{\"benchmark\":\"allocations\",\"skipped\":\"build with -DGOOBEREATS_STATS\"}" << endl;
+    return true;
+}
+#endif
+
+int runBenchmarks(const string& mapFile, const vector<string>& names)
+{
+    struct Benchmark { const char* name; bool (*run)(const string&); };
+    const Benchmark benchmarks[] = {
+        { "load", benchLoad },
+        { "astar", benchAStar },
+        { "optimizer", benchOptimizer },
+        { "plan", benchPlans },
+        { "stats", benchStats },
+        { "memory", benchMemory },
+        { "layout", benchLayout },
+        { "commands", benchCommands },
+        { "server", benchServer },
+        { "allocations", benchAllocations },
+        { "approx", benchApprox },
+        { "hashmap", benchHashMap },
+        { "turns", benchTurns },
+        { "session", benchSession },
+        { "chains", benchChains },
+        { "zones", benchZones },
+        { "deliveryfile", benchDeliveryFile },
+        { "geometry", benchGeometry },
+    };
+    
+    // -sizes takes a comma separated list; the other arguments are benchmark names
+    batchSizes.assign(begin(DEFAULT_BATCH_SIZES), end(DEFAULT_BATCH_SIZES));
+    vector<string> only;
+    for (size_t i = 0; i < names.size(); i++)
+    {
+        if (names[i] != "-sizes")
+        {
+            only.push_back(names[i]);
+            continue;
+        }
+        batchSizes.clear();
+        istringstream list(i + 1 < names.size() ? names[++i] : "");
+        string size;
+        while (getline(list, size, ','))
+        {
+            char* stop;
+            long batch = strtol(size.c_str(), &stop, 10);
+            if (size.empty() || *stop != '\0' || batch < 1 || batch > MAX_BATCH_SIZE)
+            {
+                cerr << "Batch sizes must be from 1 to " << MAX_BATCH_SIZE << ": " << size << endl;
+                return 1;
+            }
+            batchSizes.push_back((int)batch);
+        }
+        if (batchSizes.empty())
+        {
+            cerr << "-sizes needs a list of batch sizes, like 1,10,100" << endl;
+            return 1;
+        }
+    }
+
+    for (const Benchmark& b : benchmarks)
+    {
+        if (!only.empty() && find(only.begin(), only.end(), b.name) == only.end()) // Only run the ones asked for
+            continue;
+        if (!b.run(mapFile))
+        {
+            cerr << "Unable to load map data file " << mapFile << endl; // Kept off cout, which is only JSON
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,1198 @@
+#include "provided.h"
+#include "support.h"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <list>
+#include <set>
+#include <queue>
+#include <random>
+#include <chrono>
+#include <algorithm>
+#include <functional>
+#include <utility>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <float.h>
+#include <unistd.h> // For mkstemp
+using namespace std;
+
+// Checks are run with: GooberEats -check mapdata.txt [check names...]
+//
+// They make sure the fast paths still give the right answers: routes from every router mode are
+// compared with a plain Dijkstra, the map and deliveries file parsers are fed malformed input, and
+// plans' route geometry is checked against the streets and read back from its encodings, and
+// delivery sessions' plans are compared with fresh ones as the map changes under them.
+// Each check prints one JSON line, like the benchmarks, e.g.
+//   {"check":"routes","cases":3000,"failures":0,"ms":..}
+// and describes each failure on cerr. The exit code is 1 if anything failed. Everything is seeded,
+// so a failure shows up again on the next run, and the whole set takes a few seconds.
+
+const unsigned int CHECK_SEED = 20200312;
+const int MAX_REPORTED = 10; // Failures described per check; the rest are only counted
+
+static double secondsSince(chrono::steady_clock::time_point start)
+{
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+// Counts a check's cases and failures, describing the first few failures
+struct CheckResult
+{
+    const char* name;
+    long long cases = 0;
+    long long failures = 0;
+
+    CheckResult(const char* checkName) : name(checkName) {}
+    void fail(const string& what)
+    {
+        if (failures++ < MAX_REPORTED)
+            cerr << name << ": " << what << endl;
+    }
+};
+
+// Silences cout and cerr while it exists, for parsers that report bad input on them
+struct QuietOutput
+{
+    streambuf* out;
+    streambuf* err;
+    QuietOutput() : out(cout.rdbuf(nullptr)), err(cerr.rdbuf(nullptr)) {}
+    ~QuietOutput() { cout.rdbuf(out); cerr.rdbuf(err); } // Putting the buffer back clears the error state too
+};
+
+// Plain Dijkstra from start until target is settled, over the same costs the routers use: the
+// reference routes are checked against. Returns the cost of the shortest route, DBL_MAX if none.
+static double referenceCost(const StreetGraph& graph, int start, int target)
+{
+    vector<double> dist(graph.numNodes(), DBL_MAX);
+    priority_queue<pair<double, int>, vector<pair<double, int>>, greater<pair<double, int>>> queue;
+    dist[start] = 0;
+    queue.push(make_pair(0.0, start));
+    while (!queue.empty())
+    {
+        pair<double, int> top = queue.top();
+        queue.pop();
+        int node = top.second;
+        if (top.first > dist[node])
+            continue;
+        if (node == target)
+            break;
+        for (int i = graph.adjStart[node]; i < graph.adjStart[node+1]; i++)
+        {
+            StreetEdge e = graph.edge(graph.adjEdges[i]);
+            if (e.usable() && dist[node] + e.weight < dist[e.to])
+            {
+                dist[e.to] = dist[node] + e.weight;
+                queue.push(make_pair(dist[e.to], e.to));
+            }
+        }
+    }
+    return dist[target];
+}
+
+// Edge weight of a mile, worked out the way TurnGraph does, to put turn costs in edge weight units
+static double weightPerMile(const StreetGraph& graph)
+{
+    double degrees = 0, miles = 0;
+    for (int e = 0; e < graph.numEdges(); e++)
+    {
+        StreetEdge edge = graph.edge(e);
+        degrees += coordDistance(graph.points[edge.from], graph.points[edge.to]);
+        miles += graph.miles(e);
+    }
+    return miles > 0 ? degrees / miles : 0;
+}
+
+// Penalty for driving edge to right after edge from, in edge weight units
+static double turnPenalty(const StreetGraph& graph, const TurnCosts& costs, double perMile, int from, int to)
+{
+    if (to == (from ^ 1))
+        return costs.uTurnCost() * perMile;
+    double angle = graph.angle(to) - graph.angle(from);
+    if (angle < 0)
+        angle += 360;
+    float turn = (float)angle; // TurnGraph keeps angles as floats, so compare the same way it does
+    if (turn < (float)costs.minTurnAngle || turn > (float)(360 - costs.minTurnAngle))
+        return 0;
+    return (turn < 180 ? costs.leftTurn : costs.rightTurn) * perMile;
+}
+
+// referenceCost with turn costs: Dijkstra over edges, where reaching an edge costs its weight plus
+// the penalty of turning onto it from the edge before
+static double referenceTurnCost(const StreetGraph& graph, const TurnCosts& costs, double perMile, int start, int target)
+{
+    if (start == target)
+        return 0;
+    vector<double> dist(graph.numEdges(), DBL_MAX);
+    priority_queue<pair<double, int>, vector<pair<double, int>>, greater<pair<double, int>>> queue;
+    for (int i = graph.adjStart[start]; i < graph.adjStart[start+1]; i++)
+    {
+        int e = graph.adjEdges[i];
+        if (graph.edge(e).usable())
+        {
+            dist[e] = graph.edge(e).weight;
+            queue.push(make_pair(dist[e], e));
+        }
+    }
+    while (!queue.empty())
+    {
+        pair<double, int> top = queue.top();
+        queue.pop();
+        int e = top.second;
+        if (top.first > dist[e])
+            continue;
+        if (graph.edge(e).to == target)
+            return dist[e];
+        int node = graph.edge(e).to;
+        for (int i = graph.adjStart[node]; i < graph.adjStart[node+1]; i++)
+        {
+            int next = graph.adjEdges[i];
+            if (!graph.edge(next).usable())
+                continue;
+            double score = dist[e] + turnPenalty(graph, costs, perMile, e, next) + graph.edge(next).weight;
+            if (score < dist[next])
+            {
+                dist[next] = score;
+                queue.push(make_pair(score, next));
+            }
+        }
+    }
+    return DBL_MAX;
+}
+
+static bool closeEnough(double a, double b)
+{
+    return fabs(a - b) <= 1e-9 * max(1.0, max(fabs(a), fabs(b)));
+}
+
+// What is wrong with path as a route from start to end, or "" if nothing: every edge must be open and
+// begin where the one before it ended, and the running miles must add up
+static string pathProblem(const StreetGraph& graph, const RoutePath& path, int start, int end)
+{
+    if (path.cumulativeMiles.size() != path.edges.size())
+        return "running miles don't match edges";
+    int at = start;
+    double miles = 0;
+    for (size_t i = 0; i < path.size(); i++)
+    {
+        int e = path.edges[i];
+        if (e < 0 || e >= graph.numEdges())
+            return "edge id out of range";
+        if (graph.edge(e).from != at)
+            return "edge " + to_string(i) + " doesn't start where the last one ended";
+        if (!graph.edge(e).usable())
+            return "edge " + to_string(i) + " is closed";
+        miles += graph.miles(e);
+        if (!closeEnough(miles, path.cumulativeMiles[i]))
+            return "running miles are off at edge " + to_string(i);
+        at = graph.edge(e).to;
+    }
+    if (at != end)
+        return "route doesn't end at the destination";
+    return "";
+}
+
+static double pathCost(const StreetGraph& graph, const RoutePath& path)
+{
+    double cost = 0;
+    for (int e : path.edges)
+        cost += graph.edge(e).weight;
+    return cost;
+}
+
+static double pathTurnCost(const StreetGraph& graph, const TurnCosts& costs, double perMile, const RoutePath& path)
+{
+    double cost = pathCost(graph, path);
+    for (size_t i = 1; i < path.size(); i++)
+        cost += turnPenalty(graph, costs, perMile, path.edges[i-1], path.edges[i]);
+    return cost;
+}
+
+// What is wrong with a segment route from start to end, or "" if nothing: each segment must start
+// where the one before it ended, and miles must be their total length
+static string routeProblem(const list<StreetSegment>& route, const GeoCoord& start, const GeoCoord& end, double miles)
+{
+    GeoCoord at = start;
+    double total = 0;
+    for (const StreetSegment& seg : route)
+    {
+        if (!(seg.start == at))
+            return "segment doesn't start where the last one ended";
+        total += distanceEarthMiles(seg.start, seg.end);
+        at = seg.end;
+    }
+    if (!(at == end))
+        return "route doesn't end at the destination";
+    if (!closeEnough(total, miles))
+        return "distance travelled isn't the segments' total length";
+    return "";
+}
+
+static string describe(const StreetGraph& graph, int a, int b)
+{
+    GeoCoord from = graph.coord(a), to = graph.coord(b);
+    return from.latitudeText + " " + from.longitudeText + " -> " + to.latitudeText + " " + to.longitudeText;
+}
+
+// What is wrong with a chain graph kept up to date through added segments, or "" if nothing: every
+// edge has to be in one shortcut, shortcuts have to run from end node to end node through interior
+// nodes, and each end node has to list the shortcuts leaving it in the order of its edges
+static string chainProblem(const StreetGraph& graph, const ChainGraph& chains)
+{
+    if (chains.numEdges() != graph.numEdges())
+        return "chain graph is out of date";
+    if ((int)chains.nodeShortcut.size() != graph.numNodes() || (int)chains.adjStart.size() != graph.numNodes() + 1 ||
+        chains.adjStart.back() != (int)chains.adjShortcuts.size() || chains.shortcuts.size() % 2 != 0)
+        return "chain graph has the wrong size";
+    vector<int> shortcutOf(graph.numEdges(), -1);
+    for (int s = 0; s < (int)chains.shortcuts.size(); s++)
+    {
+        const ChainGraph::Shortcut& shortcut = chains.shortcuts[s];
+        const ChainGraph::Shortcut& twin = chains.shortcuts[s ^ 1];
+        string which = "shortcut " + to_string(s);
+        if (shortcut.count < 1 || shortcut.first < 0 || shortcut.first + shortcut.count > chains.numEdges() || twin.count != shortcut.count)
+            return which + " has a bad edge range";
+        if (chains.interior(shortcut.from) || chains.interior(shortcut.to))
+            return which + " ends on an interior node";
+        for (int p = 0; p < shortcut.count; p++)
+        {
+            int e = chains.chainEdges[shortcut.first + p];
+            if (e < 0 || e >= graph.numEdges() || shortcutOf[e] != -1)
+                return which + " has an edge out of range or in another shortcut too";
+            shortcutOf[e] = s;
+            if (e != (chains.chainEdges[twin.first + shortcut.count - 1 - p] ^ 1))
+                return which + " isn't its twin reversed";
+            int node = graph.edge(e).from;
+            if (p == 0 ? node != shortcut.from : chains.position(node, s) != p || (chains.nodeShortcut[node] | 1) != (s | 1))
+                return which + " goes through node " + to_string(node) + ", which doesn't know it";
+            if (p > 0 && graph.edge(chains.chainEdges[shortcut.first + p - 1]).to != node)
+                return which + " has a gap";
+        }
+        if (graph.edge(chains.chainEdges[shortcut.first + shortcut.count - 1]).to != shortcut.to)
+            return which + " doesn't end where it says";
+    }
+    for (int n = 0; n < graph.numNodes(); n++)
+    {
+        int listed = chains.adjStart[n+1] - chains.adjStart[n];
+        if (chains.interior(n) ? listed != 0 : listed != graph.adjStart[n+1] - graph.adjStart[n])
+            return "node " + to_string(n) + " lists the wrong number of shortcuts";
+        for (int i = 0; i < listed; i++)
+        {
+            int s = chains.adjShortcuts[chains.adjStart[n] + i];
+            if (s < 0 || s >= (int)chains.shortcuts.size() || chains.chainEdges[chains.shortcuts[s].first] != graph.adjEdges[graph.adjStart[n] + i])
+                return "node " + to_string(n) + " lists the wrong shortcut";
+        }
+    }
+    return "";
+}
+
+// Whether a turn graph patched as segments were added has the same turns as one built from scratch
+static bool sameTurns(const TurnGraph& a, const TurnGraph& b)
+{
+    return a.turnStart == b.turnStart && a.turnEdges == b.turnEdges && a.turnAngles == b.turnAngles &&
+           a.weightPerMile.value() == b.weightPerMile.value();
+}
+
+// Random node pairs routed by every router mode, compared with referenceCost (referenceTurnCost for
+// turn costs, whose U-turns must also show up in the directions): on the map as loaded and
+// again after rounds of random closures, cost changes, added and removed segments. The routers live
+// through all the rounds so what they precompute has to keep up with the changes.
+static int checkRoutes(const string& mapFile, CheckResult& result)
+{
+    StreetMap map;
+    if (!map.load(mapFile))
+        return -1;
+    const StreetGraph& graph = map.graph();
+    mt19937 rng(CHECK_SEED);
+    uniform_int_distribution<int> pickNode(0, graph.numNodes() - 1);
+    const double bound = 1.5;
+    map.buildTurnGraph(); // So added segments are patched into it
+    TurnGraph ownTurns; // Patched the way a router patches its own, when the map has none
+    ownTurns.build(graph);
+
+    PointToPointRouter chains(&map), full(&map), depots(&map), turns(&map), turnsFull(&map), freeUTurns(&map);
+    full.setChainShortcuts(false);
+    TurnCosts turnCosts; // Left turns dear enough to be worth avoiding, U-turns left at their default
+    turnCosts.leftTurn = 0.2;
+    turnCosts.rightTurn = 0.02;
+    turns.setTurnCosts(turnCosts);
+    turnsFull.setTurnCosts(turnCosts);
+    turnsFull.setChainShortcuts(false);
+    TurnCosts freeUTurnCosts = turnCosts; // Which makes for lots of U-turns to check the directions of
+    freeUTurnCosts.uTurn = 0;
+    freeUTurns.setTurnCosts(freeUTurnCosts);
+    vector<int> depotNodes;
+    for (int i = 0; i < 3; i++)
+    {
+        depotNodes.push_back(pickNode(rng));
+        depots.registerDepot(graph.coord(depotNodes.back()));
+    }
+
+    for (int round = 0; round < 4; round++)
+    {
+        if (round > 0)
+            for (int i = 0; i < 40; i++)
+            {
+                int e = pickNode(rng) % (graph.numEdges() / 2) * 2;
+                GeoCoord a = graph.coord(graph.edge(e).from), b = graph.coord(graph.edge(e).to);
+                switch (rng() % 5)
+                {
+                    case 0: map.setSegmentOpen(a, b, false); break;
+                    case 1: map.setSegmentOpen(a, b, true); break;
+                    case 2: map.setSegmentCostFactor(a, b, 1 + rng() % 4); break;
+                    case 3: map.removeSegment(a, b); break;
+                    default: map.addSegment(a, graph.coord(pickNode(rng)), "Check Street"); break;
+                }
+            }
+        if (round > 0) // Everything patched for the added segments has to match a fresh build
+        {
+            while (ownTurns.numEdges() < graph.numEdges())
+                ownTurns.addSegment(graph, ownTurns.numEdges());
+            TurnGraph fresh;
+            fresh.build(graph);
+            string problem = chainProblem(graph, *map.chainGraph());
+            result.cases += 3;
+            if (!problem.empty())
+                result.fail("patched " + problem + " (round " + to_string(round) + ")");
+            if (!sameTurns(*map.turnGraph(), fresh))
+                result.fail("map's patched turn graph differs from a fresh one (round " + to_string(round) + ")");
+            if (!sameTurns(ownTurns, fresh))
+                result.fail("turn graph patched a segment at a time differs from a fresh one (round " + to_string(round) + ")");
+
+            // A dead end taken away and put back has to come back as the same node, not a new one
+            GeoCoord from = graph.coord(pickNode(rng));
+            char lat[32], lon[32];
+            writeFixedCoord(toFixedCoord(from.latitude) + 1000 + round, lat);
+            writeFixedCoord(toFixedCoord(from.longitude), lon);
+            GeoCoord deadEnd(lat, lon);
+            result.cases++;
+            if (map.nodeAt(deadEnd) == -1 && map.addSegment(from, deadEnd, "Check Street"))
+            {
+                int node = map.nodeAt(deadEnd), nodes = graph.numNodes();
+                map.removeSegment(from, deadEnd);
+                bool gone = map.nodeAt(deadEnd) == -1;
+                map.addSegment(from, deadEnd, "Check Street");
+                if (!gone)
+                    result.fail("coord with no segments left is still found (round " + to_string(round) + ")");
+                else if (map.nodeAt(deadEnd) != node || graph.numNodes() != nodes)
+                    result.fail("segment added back got a new node (round " + to_string(round) + ")");
+            }
+        }
+        double perMile = weightPerMile(graph);
+        for (int i = 0; i < 150; i++)
+        {
+            int a = pickNode(rng), b = pickNode(rng);
+            if (i % 4 == 0) // Some from or to a depot, which are answered from its trees
+            {
+                int depot = depotNodes[rng() % depotNodes.size()];
+                (i % 8 == 0 ? a : b) = depot;
+            }
+            GeoCoord start = graph.coord(a), end = graph.coord(b);
+            double expected = referenceCost(graph, a, b);
+            string where = " (" + describe(graph, a, b) + ", round " + to_string(round) + ")";
+
+            // Every exact mode must find a route exactly when there is one, and a shortest one
+            struct Mode { const char* name; const PointToPointRouter* router; };
+            const Mode modes[] = { { "chains", &chains }, { "full", &full }, { "depots", &depots } };
+            for (const Mode& mode : modes)
+            {
+                RoutePath path;
+                DeliveryResult status = mode.router->generatePointToPointPath(start, end, path);
+                result.cases++;
+                if (status != (expected == DBL_MAX ? NO_ROUTE : DELIVERY_SUCCESS))
+                    result.fail(string(mode.name) + ": wrong result " + to_string(status) + where);
+                else if (status == DELIVERY_SUCCESS)
+                {
+                    string problem = pathProblem(graph, path, a, b);
+                    if (!problem.empty())
+                        result.fail(string(mode.name) + ": " + problem + where);
+                    else if (!closeEnough(pathCost(graph, path), expected))
+                        result.fail(string(mode.name) + ": cost " + to_string(pathCost(graph, path)) + ", shortest is " + to_string(expected) + where);
+                }
+            }
+
+            // With turn costs
+            struct TurnMode { const char* name; const PointToPointRouter* router; const TurnCosts* costs; };
+            const TurnMode turnModes[] = { { "turns", &turns, &turnCosts }, { "turns full", &turnsFull, &turnCosts },
+                                         { "free U-turns", &freeUTurns, &freeUTurnCosts } };
+            for (const TurnMode& mode : turnModes)
+            {
+                RoutePath path;
+                DeliveryResult status = mode.router->generatePointToPointPath(start, end, path);
+                double expectedTurns = referenceTurnCost(graph, *mode.costs, perMile, a, b);
+                result.cases++;
+                if (status != (expectedTurns == DBL_MAX ? NO_ROUTE : DELIVERY_SUCCESS))
+                    result.fail(string(mode.name) + ": wrong result " + to_string(status) + where);
+                else if (status == DELIVERY_SUCCESS)
+                {
+                    string problem = pathProblem(graph, path, a, b);
+                    double cost = pathTurnCost(graph, *mode.costs, perMile, path);
+                    if (!problem.empty())
+                        result.fail(string(mode.name) + ": " + problem + where);
+                    else if (!closeEnough(cost, expectedTurns))
+                        result.fail(string(mode.name) + ": cost " + to_string(cost) + ", cheapest is " + to_string(expectedTurns) + where);
+                    else if (!path.empty())
+                    {
+                        vector<PlanCommand> commands;
+                        generateCommands(graph, path, a, vector<int>(1, b), vector<int>(1, 0), commands);
+                        long long uTurns = 0, aroundCommands = 0;
+                        for (size_t k = 1; k < path.size(); k++)
+                            uTurns += path.edges[k] == (path.edges[k-1] ^ 1);
+                        for (const PlanCommand& cmd : commands)
+                            aroundCommands += cmd.type == PlanCommand::TURN && cmd.direction == PlanCommand::AROUND;
+                        if (aroundCommands != uTurns)
+                            result.fail(string(mode.name) + ": " + to_string(uTurns) + " U-turns but " + to_string(aroundCommands) + " turn around commands" + where);
+                    }
+                }
+            }
+
+            // The segment form of the same route
+            list<StreetSegment> route;
+            double miles = 0;
+            result.cases++;
+            if (chains.generatePointToPointRoute(start, end, route, miles) == DELIVERY_SUCCESS)
+            {
+                string problem = routeProblem(route, start, end, miles);
+                if (!problem.empty())
+                    result.fail("segments: " + problem + where);
+            }
+
+            // Weighted A Star has to keep its guarantee
+            RoutePath path;
+            double suboptimality;
+            result.cases++;
+            if (chains.generateApproximatePath(start, end, bound, path, suboptimality) == DELIVERY_SUCCESS)
+            {
+                string problem = pathProblem(graph, path, a, b);
+                if (!problem.empty())
+                    result.fail("approx: " + problem + where);
+                else if (suboptimality > bound || pathCost(graph, path) > suboptimality * expected * (1 + 1e-9))
+                    result.fail("approx: cost " + to_string(pathCost(graph, path)) + " is over " + to_string(suboptimality) + " times the shortest " + to_string(expected) + where);
+            }
+            else if (expected != DBL_MAX)
+                result.fail("approx: no route found" + where);
+        }
+    }
+    return 0;
+}
+
+// What is wrong with a loaded map's graph and indexes, or "" if nothing
+static string graphProblem(const StreetMap& map)
+{
+    const StreetGraph& graph = map.graph();
+    if ((int)graph.adjStart.size() != graph.numNodes() + 1 || graph.adjStart[0] != 0 || graph.adjStart.back() != (int)graph.adjEdges.size())
+        return "adjacency has the wrong size";
+    if ((int)graph.adjEdges.size() != graph.numEdges() || graph.numEdges() % 2 != 0)
+        return "edges aren't all in pairs and in the adjacency";
+    for (int n = 0; n < graph.numNodes(); n++)
+    {
+        if (graph.adjStart[n] > graph.adjStart[n+1])
+            return "adjacency isn't in order";
+        for (int i = graph.adjStart[n]; i < graph.adjStart[n+1]; i++)
+            if (graph.adjEdges[i] < 0 || graph.adjEdges[i] >= graph.numEdges() || graph.edge(graph.adjEdges[i]).from != n)
+                return "adjacency lists an edge under the wrong node";
+        if (map.nodeAt(graph.coord(n)) != n)
+            return "node " + to_string(n) + " can't be looked up by its coord";
+    }
+    for (int e = 0; e < graph.numEdges(); e++)
+    {
+        StreetEdge edge = graph.edge(e);
+        StreetEdge twin = graph.edge(e ^ 1);
+        if (edge.from < 0 || edge.from >= graph.numNodes() || edge.to < 0 || edge.to >= graph.numNodes() ||
+            edge.street < 0 || edge.street >= (int)graph.streetNames.size())
+            return "edge " + to_string(e) + " has an id out of range";
+        if (twin.from != edge.to || twin.to != edge.from || twin.street != edge.street)
+            return "edge " + to_string(e) + " isn't its twin reversed";
+    }
+    return chainProblem(graph, *map.chainGraph());
+}
+
+static bool sameGraph(const StreetGraph& a, const StreetGraph& b)
+{
+    if (a.numNodes() != b.numNodes() || a.numEdges() != b.numEdges() || a.streetNames != b.streetNames || a.adjEdges != b.adjEdges)
+        return false;
+    for (int n = 0; n < a.numNodes(); n++)
+        if (!(a.coord(n) == b.coord(n)))
+            return false;
+    for (int e = 0; e < a.numEdges(); e++)
+        if (a.edge(e).from != b.edge(e).from || a.edge(e).to != b.edge(e).to || a.edge(e).street != b.edge(e).street)
+            return false;
+    return true;
+}
+
+// Lines of the map file that are likely to trip a parser up
+static const char* const BAD_MAP_LINES[] = {
+    "", " ", "0", "-1", "2147483648", "99999999", "1 2", "abc", "34.0547000 -118.4794734",
+    "34.0547000 -118.4794734 34.0544590", "x -118.4794734 34.0544590 -118.4801137",
+    "1e999 -118.4794734 34.0544590 -118.4801137", "nan nan nan nan", "34.0547000\t-118.4794734\t34.0544590\t-118.4801137",
+    "34.0547000 -118.4794734 34.0547000 -118.4794734", "34.0547000 -118.4794734 34.0544590 -118.4801137 extra",
+};
+
+// text with one random change: cut short, a piece removed, junk put in, or a line replaced, repeated,
+// moved or given Windows line endings
+static string mutate(const string& text, mt19937& rng)
+{
+    vector<string> lines;
+    istringstream in(text);
+    string line;
+    while (getline(in, line))
+        lines.push_back(line);
+    auto join = [&]() {
+        string joined;
+        for (const string& l : lines)
+            joined += l + "\n";
+        return joined;
+    };
+    size_t at = text.empty() ? 0 : rng() % text.size();
+    size_t which = lines.empty() ? 0 : rng() % lines.size();
+    switch (rng() % 8)
+    {
+        case 0:
+            return text.substr(0, at);
+        case 1:
+            return text.substr(0, at) + text.substr(min(text.size(), at + 1 + rng() % 40));
+        case 2:
+        {
+            const char junk[] = "0123456789-+.e \t\n\r:xX\xff";
+            string inserted;
+            for (int i = 1 + rng() % 8; i > 0; i--)
+                inserted += rng() % 16 == 0 ? '\0' : junk[rng() % (sizeof(junk) - 1)];
+            return text.substr(0, at) + inserted + text.substr(at);
+        }
+        case 3:
+            if (!lines.empty())
+                lines[which] = BAD_MAP_LINES[rng() % (sizeof(BAD_MAP_LINES) / sizeof(BAD_MAP_LINES[0]))];
+            return join();
+        case 4:
+            if (!lines.empty())
+                lines.insert(lines.begin() + which, lines[which]);
+            return join();
+        case 5:
+            if (!lines.empty())
+                swap(lines[which], lines[rng() % lines.size()]);
+            return join();
+        case 6:
+            for (string& l : lines)
+                l += "\r";
+            return join();
+        default: // Blank lines at the end, or no newline at all
+            return rng() % 2 ? text + "\n\n\n" : text.substr(0, text.find_last_not_of('\n') + 1);
+    }
+}
+
+// Name of a new empty file in /tmp, or "" if one can't be made
+static string temporaryFile()
+{
+    char fileName[] = "/tmp/goobereats_checkXXXXXX";
+    int fd = mkstemp(fileName);
+    if (fd == -1)
+        return "";
+    close(fd);
+    return fileName;
+}
+
+// Loads mutated copies of the start of the map file with one thread and with four, in normal and compact
+// storage. Loading must not crash or throw, both thread counts must agree, anything loaded must hold
+// together, and routes on it must still be right. Then loads into maps that already hold a file.
+static int checkLoad(const string& mapFile, CheckResult& result)
+{
+    ifstream inf(mapFile);
+    if (!inf)
+        return -1;
+    string text((istreambuf_iterator<char>(inf)), istreambuf_iterator<char>());
+    // Small pieces load quickly; a bigger one is split into chunks that are parsed on different threads
+    vector<string> pieces;
+    for (size_t lines : { 12, 300, 9000 })
+    {
+        size_t end = 0;
+        for (size_t i = 0; i < lines && end < text.size(); i++)
+            end = text.find('\n', end) == string::npos ? text.size() : text.find('\n', end) + 1;
+        pieces.push_back(text.substr(0, end));
+    }
+
+    string fileName = temporaryFile();
+    if (fileName.empty())
+    {
+        result.fail("can't make a temporary file");
+        return 0;
+    }
+    mt19937 rng(CHECK_SEED);
+    for (int i = 0; i < 240; i++)
+    {
+        const string& piece = pieces[i % 8 == 0 ? 2 : i % 2];
+        string fuzzed = mutate(piece, rng);
+        for (int more = rng() % 3; more > 0; more--)
+            fuzzed = mutate(fuzzed, rng);
+        ofstream(fileName, ios::binary) << fuzzed;
+        bool compact = i % 3 == 0;
+        string where = " (case " + to_string(i) + ")";
+
+        StreetMap one, four;
+        one.setLoadThreads(1);
+        four.setLoadThreads(4);
+        one.setCompactStorage(compact);
+        four.setCompactStorage(compact);
+        bool loadedOne = false, loadedFour = false;
+        result.cases++;
+        try
+        {
+            QuietOutput quiet;
+            loadedOne = one.load(fileName);
+            loadedFour = four.load(fileName);
+        }
+        catch (const exception& e)
+        {
+            result.fail(string("load threw ") + e.what() + where);
+            continue;
+        }
+        if (loadedOne != loadedFour || (loadedOne && !sameGraph(one.graph(), four.graph())))
+        {
+            result.fail("one thread and four threads loaded different maps" + where);
+            continue;
+        }
+        if (!loadedOne)
+            continue;
+        string problem = graphProblem(four);
+        if (!problem.empty())
+        {
+            result.fail(problem + where);
+            continue;
+        }
+
+        // A few routes on what was loaded
+        const StreetGraph& graph = four.graph();
+        PointToPointRouter router(&four);
+        for (int r = 0; r < 3 && graph.numNodes() > 0; r++)
+        {
+            int a = rng() % graph.numNodes(), b = rng() % graph.numNodes();
+            double expected = referenceCost(graph, a, b);
+            RoutePath path;
+            result.cases++;
+            DeliveryResult status = router.generatePointToPointPath(graph.coord(a), graph.coord(b), path);
+            if (status != (expected == DBL_MAX ? NO_ROUTE : DELIVERY_SUCCESS))
+                result.fail("wrong route result " + to_string(status) + where);
+            else if (status == DELIVERY_SUCCESS && (!pathProblem(graph, path, a, b).empty() || !closeEnough(pathCost(graph, path), expected)))
+                result.fail("bad route " + describe(graph, a, b) + where);
+        }
+    }
+
+    // A second file loaded into the map, whatever storage is asked for by then, must give the same
+    // map as loading both files as one, in the storage the first load picked
+    string secondName = temporaryFile();
+    if (secondName.empty())
+    {
+        result.fail("can't make a temporary file");
+        remove(fileName.c_str());
+        return 0;
+    }
+    // Whole street records from the start of the file, the second overlapping the first
+    auto firstStreets = [&](int streets) {
+        size_t end = 0;
+        for (int i = 0; i < streets && end < text.size(); i++)
+        {
+            int lines = 2 + atoi(text.c_str() + text.find('\n', end) + 1); // Name, count, then the segments
+            for (int l = 0; l < lines && end < text.size(); l++)
+                end = text.find('\n', end) + 1;
+        }
+        return text.substr(0, end);
+    };
+    string firstFile = firstStreets(100), secondFile = firstStreets(5);
+    ofstream(fileName, ios::binary) << firstFile << secondFile;
+    for (int modes = 0; modes < 4; modes++)
+    {
+        bool firstCompact = modes & 1, secondCompact = modes & 2;
+        string where = " (second load, " + string(firstCompact ? "compact" : "normal") + " then " +
+                       (secondCompact ? "compact" : "normal") + ")";
+        ofstream(secondName, ios::binary) << firstFile;
+        StreetMap twice, once;
+        twice.setCompactStorage(firstCompact);
+        once.setCompactStorage(firstCompact);
+        bool loaded = twice.load(secondName);
+        ofstream(secondName, ios::binary) << secondFile;
+        twice.setCompactStorage(secondCompact);
+        result.cases++;
+        if (!loaded || !twice.load(secondName) || !once.load(fileName))
+            result.fail("couldn't load" + where);
+        else if (twice.graph().compact != firstCompact || !sameGraph(twice.graph(), once.graph()))
+            result.fail("loading twice gave a different map" + where);
+        else if (!graphProblem(twice).empty())
+            result.fail(graphProblem(twice) + where);
+    }
+
+    // A compact map can't take a file whose coord text it couldn't rebuild; that load fails and
+    // leaves the map as it was
+    string odd = secondFile;
+    size_t coordLine = odd.find('\n', odd.find('\n') + 1) + 1; // After the first street's name and count
+    odd.insert(odd.find(' ', coordLine), "0"); // Eight decimals
+    ofstream(fileName, ios::binary) << firstFile;
+    ofstream(secondName, ios::binary) << odd;
+    StreetMap compactMap, before;
+    compactMap.setCompactStorage(true);
+    before.setCompactStorage(true);
+    result.cases++;
+    if (!compactMap.load(fileName) || !before.load(fileName))
+        result.fail("couldn't load (odd coord text into a compact map)");
+    else
+    {
+        bool loaded;
+        {
+            QuietOutput quiet;
+            loaded = compactMap.load(secondName);
+        }
+        if (loaded)
+            result.fail("compact map took coord text it can't rebuild");
+        else if (compactMap.graph().numNodes() != before.graph().numNodes() || compactMap.graph().numEdges() != before.graph().numEdges() ||
+                 !compactMap.graph().compact)
+            result.fail("failed load into a compact map changed it");
+    }
+    remove(fileName.c_str());
+    remove(secondName.c_str());
+    return 0;
+}
+
+// Feeds parseDelivery well formed lines, which must come back apart exactly as they were put together,
+// and mangled ones, which must either be turned down or split at the first colon into words with no
+// blanks in them and an item that isn't empty. Then all the lines go in a file for DeliveryFile, which
+// must keep exactly the deliveries parseDelivery gave (that a GeoCoord can be made from) and find the
+// same nodes for them as StreetMap::nodeAt.
+static int checkDeliveries(const string& mapFile, CheckResult& result)
+{
+    StreetMap map;
+    if (!map.load(mapFile))
+        return -1;
+    const StreetGraph& graph = map.graph();
+    mt19937 rng(CHECK_SEED);
+    const char itemChars[] = "abcdefghijklmnopqrstuvwxyz ABCXYZ0123456789:-'&()\t";
+    const char junk[] = "0123456789-+. \t:\r\xff";
+    string lat, lon, item;
+    QuietOutput quiet; // parseDelivery explains each line it turns down
+    string fileText = graph.coord(0).latitudeText + " " + graph.coord(0).longitudeText + "\n"; // Depot
+    vector<pair<GeoCoord, string>> expected; // Deliveries the file should give
+    for (int i = 0; i < 20000; i++)
+    {
+        GeoCoord at = graph.coord(rng() % graph.numNodes());
+        string wantItem;
+        for (int n = 1 + rng() % 20; n > 0; n--)
+            wantItem += itemChars[rng() % (sizeof(itemChars) - 1)];
+        string line = at.latitudeText + string(1 + rng() % 2, ' ') + at.longitudeText + ":" + wantItem;
+        if (i % 2 == 0)
+        {
+            fileText += line + "\n";
+            expected.push_back(make_pair(at, wantItem));
+            result.cases++;
+            if (!parseDelivery(line, lat, lon, item) || lat != at.latitudeText || lon != at.longitudeText || item != wantItem)
+                result.fail("didn't parse well formed line \"" + line + "\"");
+            continue;
+        }
+
+        // Mangle it a few times over
+        for (int n = 1 + rng() % 3; n > 0; n--)
+        {
+            size_t pos = line.empty() ? 0 : rng() % line.size();
+            switch (rng() % 3)
+            {
+                case 0: line.erase(pos, 1 + rng() % 6); break;
+                case 1: line.insert(pos, 1, junk[rng() % (sizeof(junk) - 1)]); break;
+                default: line = line.substr(0, pos); break;
+            }
+        }
+        fileText += line + "\n";
+        result.cases++;
+        try
+        {
+            if (!parseDelivery(line, lat, lon, item))
+                continue;
+        }
+        catch (const exception& e)
+        {
+            result.fail(string("threw ") + e.what() + " on \"" + line + "\"");
+            continue;
+        }
+        size_t colon = line.find(':');
+        bool blanks = lat.find_first_of(" \t\n") != string::npos || lon.find_first_of(" \t\n") != string::npos;
+        if (colon == string::npos || lat.empty() || lon.empty() || blanks || item.empty() || item != line.substr(colon + 1))
+            result.fail("accepted \"" + line + "\" as \"" + lat + "\" \"" + lon + "\" \"" + item + "\"");
+        try
+        {
+            expected.push_back(make_pair(GeoCoord(lat, lon), item));
+        }
+        catch (const exception&) // Not numbers
+        {
+        }
+    }
+
+    string fileName = temporaryFile();
+    if (fileName.empty())
+    {
+        result.fail("can't make a temporary file");
+        return 0;
+    }
+    ofstream(fileName, ios::binary) << fileText;
+    DeliveryFile file;
+    result.cases++;
+    if (!file.open(fileName))
+        result.fail("DeliveryFile couldn't open the file");
+    else if (!(file.depot() == graph.coord(0)))
+        result.fail("DeliveryFile got the depot wrong");
+    else if (file.deliveries().size() != expected.size())
+        result.fail("DeliveryFile gave " + to_string(file.deliveries().size()) + " deliveries, parseDelivery " + to_string(expected.size()));
+    else
+    {
+        vector<int> nodes;
+        file.findNodes(map, nodes, 4);
+        for (size_t i = 0; i < expected.size(); i++)
+        {
+            const DeliveryFile::Delivery& d = file.deliveries()[i];
+            const GeoCoord& want = expected[i].first;
+            result.cases++;
+            if (d.latitudeText.str() != want.latitudeText || d.longitudeText.str() != want.longitudeText || d.item.str() != expected[i].second ||
+                d.latitude != want.latitude || d.longitude != want.longitude)
+                result.fail("DeliveryFile read \"" + d.latitudeText.str() + " " + d.longitudeText.str() + ":" + d.item.str() +
+                            "\" where parseDelivery read \"" + want.latitudeText + " " + want.longitudeText + ":" + expected[i].second + "\"");
+            else if (nodes[i] != map.nodeAt(want))
+                result.fail("DeliveryFile found the wrong node for " + want.latitudeText + " " + want.longitudeText);
+        }
+    }
+    file.close();
+    remove(fileName.c_str());
+    return 0;
+}
+
+// Node at a geometry point, or -1 if there isn't one
+static int nodeAtPoint(const StreetMap& map, const RouteGeometry::Point& pt)
+{
+    char lat[32], lon[32];
+    writeFixedCoord(pt.latitude, lat);
+    writeFixedCoord(pt.longitude, lon);
+    return map.nodeAt(GeoCoord(lat, lon));
+}
+
+// What is wrong with geometry as the route of a plan from depot through deliveries with the given
+// miles, or "" if nothing: consecutive points must be joined by an open street, each leg must end at
+// a stop (the last at the depot), and each leg's miles must be the length of its streets
+static string geometryProblem(const StreetMap& map, const RouteGeometry& geometry, int depot,
+                              const vector<DeliveryRequest>& deliveries, double miles)
+{
+    const StreetGraph& graph = map.graph();
+    if (geometry.legEnds.size() != deliveries.size() + 1 || geometry.legMiles.size() != geometry.legEnds.size())
+        return to_string(geometry.legEnds.size()) + " legs for " + to_string(deliveries.size()) + " deliveries";
+    if (geometry.points.empty() || nodeAtPoint(map, geometry.points[0]) != depot)
+        return "doesn't start at the depot";
+    if (geometry.legEnds.back() != (int)geometry.points.size() - 1)
+        return "points go on past the last leg";
+    multiset<int> stopsLeft;
+    for (const DeliveryRequest& d : deliveries)
+        stopsLeft.insert(map.nodeAt(d.location));
+    int start = 0;
+    double total = 0;
+    for (size_t leg = 0; leg < geometry.legEnds.size(); leg++)
+    {
+        int end = geometry.legEnds[leg];
+        if (end < start || end >= (int)geometry.points.size())
+            return "leg " + to_string(leg) + " ends out of order";
+        double shortest = 0, longest = 0; // Miles the leg could be, where two nodes are joined more than once
+        for (int i = start; i < end; i++)
+        {
+            int a = nodeAtPoint(map, geometry.points[i]), b = nodeAtPoint(map, geometry.points[i+1]);
+            if (a == -1 || b == -1)
+                return "point " + to_string(a == -1 ? i : i + 1) + " isn't a map node";
+            double low = DBL_MAX, high = 0;
+            for (int j = graph.adjStart[a]; j < graph.adjStart[a+1]; j++)
+            {
+                StreetEdge edge = graph.edge(graph.adjEdges[j]);
+                if (edge.to == b && edge.usable())
+                {
+                    low = min(low, graph.miles(graph.adjEdges[j]));
+                    high = max(high, graph.miles(graph.adjEdges[j]));
+                }
+            }
+            if (low == DBL_MAX)
+                return "points " + to_string(i) + " and " + to_string(i + 1) + " aren't joined by an open street";
+            shortest += low;
+            longest += high;
+        }
+        double legMiles = geometry.legMiles[leg];
+        if (!(legMiles >= shortest * (1 - 1e-9) && legMiles <= longest * (1 + 1e-9)))
+            return "leg " + to_string(leg) + " is " + to_string(legMiles) + " miles, its streets " + to_string(shortest);
+        total += legMiles;
+        int at = nodeAtPoint(map, geometry.points[end]);
+        if (leg + 1 == geometry.legEnds.size())
+        {
+            if (at != depot)
+                return "last leg doesn't end at the depot";
+        }
+        else if (stopsLeft.count(at) == 0)
+            return "leg " + to_string(leg) + " doesn't end at a stop";
+        else
+            stopsLeft.erase(stopsLeft.find(at));
+        start = end;
+    }
+    if (!closeEnough(total, miles))
+        return "legs add up to " + to_string(total) + " miles, the plan " + to_string(miles);
+    return "";
+}
+
+// Reads an encoded polyline back into points in units of 10^-precision degrees. Written apart from
+// encodePolyline, straight from the format, so the two are checked against each other.
+static bool decodePolyline(const string& text, vector<pair<long long, long long>>& points)
+{
+    long long values[2] = { 0, 0 }; // Latitude and longitude so far
+    size_t i = 0;
+    while (i < text.size())
+    {
+        for (long long& value : values)
+        {
+            unsigned long long bits = 0;
+            int chunk = 0x20;
+            for (int shift = 0; chunk >= 0x20; shift += 5)
+            {
+                if (i == text.size() || shift > 60)
+                    return false;
+                chunk = text[i++] - 63;
+                if (chunk < 0 || chunk > 63)
+                    return false;
+                bits |= (unsigned long long)(chunk & 0x1f) << shift;
+            }
+            value += (bits & 1) ? ~(long long)(bits >> 1) : (long long)(bits >> 1);
+        }
+        points.push_back(make_pair(values[0], values[1]));
+    }
+    return true;
+}
+
+// Plans of random stops with their geometry, checked with geometryProblem, some with stops at the
+// depot or the same stop twice in a row. Then both encodings have to read back as the same points,
+// and binary data that's been cut short or garbled mustn't be read past its end.
+static int checkGeometry(const string& mapFile, CheckResult& result)
+{
+    StreetMap map;
+    if (!map.load(mapFile))
+        return -1;
+    const StreetGraph& graph = map.graph();
+    mt19937 rng(CHECK_SEED);
+    DeliveryPlanner planner(&map);
+    for (int tour = 0; tour < 300; tour++)
+    {
+        int depot = rng() % graph.numNodes();
+        vector<DeliveryRequest> deliveries;
+        for (int n = rng() % 12; n >= 0; n--)
+        {
+            int stop = rng() % graph.numNodes();
+            if (rng() % 8 == 0)
+                stop = depot;
+            else if (!deliveries.empty() && rng() % 8 == 0)
+                stop = map.nodeAt(deliveries.back().location);
+            deliveries.push_back(DeliveryRequest("item", graph.coord(stop)));
+        }
+        vector<PlanCommand> commands;
+        double miles;
+        RouteGeometry geometry;
+        if (planner.generateCompactPlan(graph.coord(depot), deliveries, commands, miles, &geometry) != DELIVERY_SUCCESS)
+            continue; // Not every node can reach every other
+        string where = " (tour " + to_string(tour) + ")";
+        result.cases++;
+        string problem = geometryProblem(map, geometry, depot, deliveries, miles);
+        if (!problem.empty())
+        {
+            result.fail(problem + where);
+            continue;
+        }
+
+        for (int precision : { 5, 7 })
+        {
+            string text;
+            encodePolyline(geometry, precision, text);
+            vector<pair<long long, long long>> decoded;
+            double scale = precision == 5 ? 100 : 1;
+            result.cases++;
+            bool same = decodePolyline(text, decoded) && decoded.size() == geometry.points.size();
+            for (size_t i = 0; same && i < decoded.size(); i++)
+                same = decoded[i].first == llround(geometry.points[i].latitude / scale) &&
+                       decoded[i].second == llround(geometry.points[i].longitude / scale);
+            if (!same)
+                result.fail("polyline at precision " + to_string(precision) + " doesn't read back" + where);
+        }
+
+        string binary;
+        encodeBinaryGeometry(geometry, binary);
+        RouteGeometry back;
+        result.cases++;
+        bool same = decodeBinaryGeometry(binary.data(), binary.size(), back) && back.points.size() == geometry.points.size() &&
+                    back.legEnds == geometry.legEnds && back.legMiles == geometry.legMiles;
+        for (size_t i = 0; same && i < back.points.size(); i++)
+            same = back.points[i].latitude == geometry.points[i].latitude && back.points[i].longitude == geometry.points[i].longitude;
+        if (!same)
+            result.fail("binary geometry doesn't read back" + where);
+
+        // Copies, so the sanitizers see any read past the end
+        vector<char> cut(binary.begin(), binary.begin() + rng() % binary.size());
+        result.cases++;
+        if (decodeBinaryGeometry(cut.data(), cut.size(), back))
+            result.fail("read binary geometry cut to " + to_string(cut.size()) + " of " + to_string(binary.size()) + " bytes" + where);
+        vector<char> garbled(binary.begin(), binary.end());
+        for (int n = 1 + rng() % 3; n > 0; n--)
+            garbled[rng() % garbled.size()] ^= (char)(1 << (rng() % 8));
+        result.cases++;
+        if (decodeBinaryGeometry(garbled.data(), garbled.size(), back))
+            for (size_t leg = 0; leg < back.legEnds.size(); leg++)
+                if (back.legEnds[leg] >= (int)back.points.size() || (leg > 0 && back.legEnds[leg] < back.legEnds[leg-1]))
+                {
+                    result.fail("garbled binary geometry read with legs out of order" + where);
+                    break;
+                }
+    }
+    return 0;
+}
+
+// A session's plan, after map changes made while it is under way, has to match a plan routed from
+// scratch on the changed map for the same stops in the same order
+static int checkSession(const string& mapFile, CheckResult& result)
+{
+    StreetMap map;
+    if (!map.load(mapFile))
+        return -1;
+    const StreetGraph& graph = map.graph();
+    mt19937 rng(CHECK_SEED);
+    uniform_int_distribution<int> pickNode(0, graph.numNodes() - 1);
+
+    for (int round = 0; round < 50; round++)
+    {
+        GeoCoord depot = graph.coord(pickNode(rng));
+        vector<DeliveryRequest> deliveries;
+        for (int i = 0; i < 8; i++)
+            deliveries.push_back(DeliveryRequest("Check item", graph.coord(pickNode(rng))));
+        DeliverySession session(&map);
+        if (session.start(depot, deliveries) != DELIVERY_SUCCESS)
+            continue;
+        GeoCoord driver = depot;
+        for (int step = 0; step < 12; step++)
+        {
+            string where = " (round " + to_string(round) + ", step " + to_string(step) + ")";
+            // The route the session should have now, from a router that has never seen the map before
+            PointToPointRouter fresh(&map);
+            const vector<int>& stops = session.remainingDeliveries();
+            vector<GeoCoord> tour(1, driver);
+            for (int id : stops)
+                tour.push_back(session.deliveries()[id].location);
+            tour.push_back(depot);
+            RoutePath route;
+            DeliveryResult expected = DELIVERY_SUCCESS;
+            for (size_t i = 0; i + 1 < tour.size() && expected == DELIVERY_SUCCESS; i++)
+            {
+                RoutePath leg;
+                expected = fresh.generatePointToPointPath(tour[i], tour[i+1], leg);
+                for (int e : leg.edges)
+                    route.append(graph, e);
+            }
+
+            vector<PlanCommand> commands;
+            double miles = 0;
+            DeliveryResult status = session.currentCompactPlan(commands, miles);
+            result.cases++;
+            if (status != expected)
+                result.fail("wrong result " + to_string(status) + ", fresh plan gives " + to_string(expected) + where);
+            else if (status == DELIVERY_SUCCESS)
+            {
+                vector<int> stopNodes;
+                for (size_t i = 1; i + 1 < tour.size(); i++)
+                    stopNodes.push_back(map.nodeAt(tour[i]));
+                vector<PlanCommand> freshCommands;
+                generateCommands(graph, route, map.nodeAt(driver), stopNodes, stops, freshCommands);
+                if (!closeEnough(miles, route.miles()))
+                    result.fail("plan is " + to_string(miles) + " miles, fresh plan " + to_string(route.miles()) + where);
+                else if (commands.size() != freshCommands.size())
+                    result.fail(to_string(commands.size()) + " commands, fresh plan has " + to_string(freshCommands.size()) + where);
+                else
+                    for (size_t i = 0; i < commands.size(); i++)
+                        if (commands[i].type != freshCommands[i].type || commands[i].direction != freshCommands[i].direction || commands[i].id != freshCommands[i].id)
+                        {
+                            result.fail("command " + to_string(i) + " differs from the fresh plan's" + where);
+                            break;
+                        }
+            }
+
+            // Change the map somewhere the tour goes, or might go, then change the tour
+            if (route.edges.empty())
+                break;
+            int e = route.edges[rng() % route.edges.size()] & ~1;
+            GeoCoord a = graph.coord(graph.edge(e).from), b = graph.coord(graph.edge(e).to);
+            switch (rng() % 5)
+            {
+                case 0: case 1: map.setSegmentOpen(a, b, false); break;
+                case 2: map.setSegmentCostFactor(a, b, 2 + rng() % 3); break;
+                case 3: // A shortcut between two nodes the tour passes
+                    map.addSegment(a, graph.coord(graph.edge(route.edges[rng() % route.edges.size()]).to), "Check Street");
+                    break;
+                default: // Undo an earlier change somewhere along the tour, so a segment gets cheaper
+                    for (int k = 0; k < 50 && !graph.changes.empty(); k++)
+                    {
+                        int c = (int)(rng() % graph.changes.size());
+                        StreetEdge changed = graph.edge(graph.changes[c].edge);
+                        if (changed.state == StreetEdge::REMOVED)
+                            continue;
+                        GeoCoord u = graph.coord(changed.from), v = graph.coord(changed.to);
+                        map.setSegmentOpen(u, v, true);
+                        map.setSegmentCostFactor(u, v, 1);
+                        break;
+                    }
+                    break;
+            }
+            switch (rng() % 4)
+            {
+                case 0:
+                {
+                    int id;
+                    session.addDelivery(DeliveryRequest("Check item", graph.coord(pickNode(rng))), id);
+                    break;
+                }
+                case 1:
+                    if (!stops.empty())
+                        session.cancelDelivery(stops[rng() % stops.size()]);
+                    break;
+                case 2:
+                    if (!stops.empty())
+                    {
+                        driver = session.deliveries()[stops[0]].location;
+                        session.deliverNext();
+                    }
+                    break;
+                default: // Leave the tour be, so only the plan query sees the change
+                    break;
+            }
+        }
+    }
+    return 0;
+}
+
+int runChecks(const string& mapFile, const vector<string>& names)
+{
+    struct Check { const char* name; int (*run)(const string&, CheckResult&); };
+    const Check checks[] = {
+        { "routes", checkRoutes },
+        { "load", checkLoad },
+        { "deliveries", checkDeliveries },
+        { "geometry", checkGeometry },
+        { "session", checkSession },
+    };
+
+    long long failures = 0;
+    for (const Check& c : checks)
+    {
+        if (!names.empty() && find(names.begin(), names.end(), c.name) == names.end()) // Only run the ones asked for
+            continue;
+        CheckResult result(c.name);
+        auto start = chrono::steady_clock::now();
+        if (c.run(mapFile, result) != 0)
+        {
+            cout << "Unable to load map data file " << mapFile << endl;
+            return 1;
+        }
+        cout << "{\"check\":\"" << c.name << "\",\"cases\":" << result.cases << ",\"failures\":" << result.failures
+             << ",\"ms\":" << secondsSince(start) * 1000 << "}" << endl;
+        failures += result.failures;
+    }
+    return failures > 0 ? 1 : 0;
+}
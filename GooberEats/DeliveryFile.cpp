@@ -0,0 +1,245 @@
+#include "provided.h"
+#include "support.h"
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <cstdlib> // For strtod
+#include <cstring> // For memchr
+#include <cerrno>
+#include <fcntl.h>    // For open
+#include <unistd.h>   // For close
+#include <sys/mman.h> // For mmap
+#include <sys/stat.h> // For fstat
+using namespace std;
+
+const int FIND_NODES_SLICE = 4096; // Deliveries looked up per task by findNodes
+
+// Whitespace as >> into a string sees it
+static bool isSpace(char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\v' || c == '\f' || c == '\r';
+}
+
+// Next whitespace separated word in [p, end), like >> into a string; moves p past it. False if there isn't one.
+static bool nextWord(const char*& p, const char* end, TextView& word)
+{
+    while (p < end && isSpace(*p))
+        p++;
+    word.data = p;
+    while (p < end && !isSpace(*p))
+        p++;
+    word.size = p - word.data;
+    return word.size > 0;
+}
+
+// Reads a coord number the way GeoCoord's constructor does (stod), from text that must be followed by
+// something that can't be part of a number. False where stod would throw.
+static bool parseNumber(const char* text, double& value)
+{
+    char* stop;
+    errno = 0;
+    value = strtod(text, &stop);
+    return stop != text && errno != ERANGE;
+}
+
+// Fast path for a word that is just a decimal like -118.4794734, which is every coord in practice: with
+// at most 15 digits the digits and the power of ten are exact doubles, so the one division is rounded
+// exactly as strtod would round. False (and value untouched) for anything else.
+static bool parseSimpleDecimal(const TextView& word, double& value)
+{
+    static const double powersOfTen[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15 };
+    const char* p = word.data;
+    const char* end = p + word.size;
+    bool negative = p < end && *p == '-';
+    if (negative)
+        p++;
+    long long digits = 0;
+    int count = 0, decimals = -1; // decimals stays -1 until the point
+    for (; p < end; p++)
+    {
+        if (*p == '.' && decimals == -1)
+            decimals = 0;
+        else if (*p >= '0' && *p <= '9' && count < 15)
+        {
+            digits = digits * 10 + (*p - '0');
+            count++;
+            if (decimals != -1)
+                decimals++;
+        }
+        else
+            return false;
+    }
+    if (count == 0)
+        return false;
+    double result = decimals > 0 ? (double)digits / powersOfTen[decimals] : (double)digits;
+    value = negative ? -result : result;
+    return true;
+}
+
+// Either way of reading a coord number; the word must be followed by something that ends strtod
+static bool parseCoordWord(const TextView& word, double& value)
+{
+    return parseSimpleDecimal(word, value) || parseNumber(word.data, value);
+}
+
+// Fills in gc with a coord's text and numbers, reusing gc's string space
+static void setCoord(GeoCoord& gc, const TextView& latText, const TextView& lonText, double lat, double lon)
+{
+    gc.latitudeText.assign(latText.data, latText.size);
+    gc.longitudeText.assign(lonText.data, lonText.size);
+    gc.latitude = lat;
+    gc.longitude = lon;
+}
+
+DeliveryFile::DeliveryFile()
+ : m_data(nullptr), m_size(0), m_mapped(false)
+{
+}
+
+DeliveryFile::~DeliveryFile()
+{
+    close();
+}
+
+bool DeliveryFile::open(const string& path)
+{
+    close();
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd == -1)
+        return false;
+    struct stat info;
+    if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0)
+    {
+        void* data = mmap(nullptr, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED)
+        {
+            madvise(data, (size_t)info.st_size, MADV_SEQUENTIAL); // Only a hint, read once front to back
+            m_data = (const char*)data;
+            m_size = (size_t)info.st_size;
+            m_mapped = true;
+        }
+    }
+    ::close(fd);
+    if (!m_mapped) // Not a regular file (a pipe, say), or empty: read it the ordinary way
+    {
+        ifstream inf(path, ios::binary);
+        if (!inf)
+            return false;
+        m_copy.assign(istreambuf_iterator<char>(inf), istreambuf_iterator<char>());
+        m_data = m_copy.data();
+        m_size = m_copy.size();
+    }
+
+    // Depot coords are the first two words, then the rest of their line is skipped. They're copied
+    // out since the file might end right after them, leaving nothing to stop strtod.
+    const char* p = m_data;
+    const char* end = m_data + m_size;
+    TextView lat, lon;
+    if (!nextWord(p, end, lat) || !nextWord(p, end, lon))
+    {
+        close();
+        return false;
+    }
+    string latText = lat.str(), lonText = lon.str();
+    TextView latCopy{latText.data(), latText.size()}, lonCopy{lonText.data(), lonText.size()};
+    double latitude, longitude;
+    if (!parseNumber(latText.c_str(), latitude) || !parseNumber(lonText.c_str(), longitude))
+    {
+        close();
+        return false;
+    }
+    setCoord(m_depot, latCopy, lonCopy, latitude, longitude);
+    const char* newline = (const char*)memchr(p, '\n', end - p);
+    parse(newline == nullptr ? end : newline + 1);
+    return true;
+}
+
+void DeliveryFile::parse(const char* p)
+{
+    const char* end = m_data + m_size;
+    m_deliveries.clear();
+    size_t lines = 1;
+    for (const char* q = p; (q = (const char*)memchr(q, '\n', end - q)) != nullptr; q++)
+        lines++;
+    m_deliveries.reserve(lines);
+    for (const char* next; p < end; p = next)
+    {
+        const char* lineEnd = (const char*)memchr(p, '\n', end - p);
+        if (lineEnd == nullptr)
+            lineEnd = end;
+        next = lineEnd + (lineEnd < end ? 1 : 0);
+
+        // Same checks and messages as parseDelivery
+        const char* colon = (const char*)memchr(p, ':', lineEnd - p);
+        const char* problem = nullptr;
+        Delivery d;
+        const char* words = p;
+        if (colon == nullptr)
+            problem = "Missing colon in deliveries file line: ";
+        else if (!nextWord(words, colon, d.latitudeText) || !nextWord(words, colon, d.longitudeText))
+            problem = "Bad format in deliveries file line: ";
+        else if (colon + 1 == lineEnd)
+            problem = "Missing item in deliveries file line: ";
+        // Both words end before the colon, so strtod stops inside the line
+        else if (!parseCoordWord(d.latitudeText, d.latitude) || !parseCoordWord(d.longitudeText, d.longitude))
+            problem = "Bad coord in deliveries file line: ";
+        if (problem != nullptr)
+        {
+            cout << problem;
+            cout.write(p, lineEnd - p);
+            cout << endl;
+            continue;
+        }
+        d.item.data = colon + 1;
+        d.item.size = lineEnd - (colon + 1);
+        m_deliveries.push_back(d);
+    }
+}
+
+void DeliveryFile::close()
+{
+    if (m_mapped)
+        munmap(const_cast<char*>(m_data), m_size);
+    m_data = nullptr;
+    m_size = 0;
+    m_mapped = false;
+    m_copy.clear();
+    m_copy.shrink_to_fit();
+    m_deliveries.clear();
+    m_depot = GeoCoord();
+}
+
+int DeliveryFile::findNodes(const StreetMap& map, vector<int>& nodes, int threads) const
+{
+    int count = (int)m_deliveries.size();
+    nodes.assign(count, -1);
+    int slices = (count + FIND_NODES_SLICE - 1) / FIND_NODES_SLICE;
+    vector<int> missing(slices, 0);
+    runParallel(slices, threads > 0 ? threads : hardwareThreads(), [&](int slice) {
+        GeoCoord gc; // One coord whose strings are reused for every lookup in the slice
+        int last = min(count, (slice + 1) * FIND_NODES_SLICE);
+        for (int i = slice * FIND_NODES_SLICE; i < last; i++)
+        {
+            const Delivery& d = m_deliveries[i];
+            setCoord(gc, d.latitudeText, d.longitudeText, d.latitude, d.longitude);
+            nodes[i] = map.nodeAt(gc);
+            missing[slice] += nodes[i] == -1;
+        }
+    });
+    int total = 0;
+    for (int m : missing)
+        total += m;
+    return total;
+}
+
+void DeliveryFile::toRequests(vector<DeliveryRequest>& requests) const
+{
+    requests.reserve(requests.size() + m_deliveries.size());
+    GeoCoord gc;
+    for (const Delivery& d : m_deliveries)
+    {
+        setCoord(gc, d.latitudeText, d.longitudeText, d.latitude, d.longitude);
+        requests.push_back(DeliveryRequest(d.item.str(), gc));
+    }
+}
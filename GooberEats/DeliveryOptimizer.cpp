@@ -1,7 +1,94 @@
 #include "provided.h"
+#include "support.h"
 #include <vector>
+#include <chrono>
+#include <algorithm> // For nth_element
+#include <cmath>
 using namespace std;
 
+//******************** Zones **************************************************
+
+// Big batches are split into zones of nearby stops. Each zone's tour is found on its own, the zones
+// are put in order, and then their tours are joined up. Everything is done on a flat projection of
+// the stops around the depot, in km, which is close enough over a city and much cheaper than
+// distanceEarthKM.
+
+const int MAX_TWO_OPT_PASSES = 50; // 2-opt nearly always settles in far fewer
+
+struct ZonePoint
+{
+    double x, y;
+};
+
+static double zoneDistance(const ZonePoint& a, const ZonePoint& b)
+{
+    return hypot(a.x - b.x, a.y - b.y);
+}
+
+// Splits stops[begin, end) in half across its longer side until no piece has more than maxStops,
+// adding each piece to zones as a (begin, end) range of stops
+static void splitZones(vector<int>& stops, size_t begin, size_t end, const vector<ZonePoint>& points, int maxStops, vector<pair<size_t, size_t>>& zones)
+{
+    if (end - begin <= (size_t)maxStops)
+    {
+        zones.push_back(make_pair(begin, end));
+        return;
+    }
+    double minX = points[stops[begin]].x, maxX = minX, minY = points[stops[begin]].y, maxY = minY;
+    for (size_t i = begin; i < end; i++)
+    {
+        minX = min(minX, points[stops[i]].x);
+        maxX = max(maxX, points[stops[i]].x);
+        minY = min(minY, points[stops[i]].y);
+        maxY = max(maxY, points[stops[i]].y);
+    }
+    bool acrossX = maxX - minX >= maxY - minY;
+    size_t middle = begin + (end - begin) / 2;
+    nth_element(stops.begin() + begin, stops.begin() + middle, stops.begin() + end, [&](int a, int b) {
+        return acrossX ? points[a].x < points[b].x : points[a].y < points[b].y;
+    });
+    splitZones(stops, begin, middle, points, maxStops, zones);
+    splitZones(stops, middle, end, points, maxStops, zones);
+}
+
+// Orders tour (point indexes) into a short round trip: nearest neighbor from tour[0], then 2-opt.
+// tour[0] stays first. Returns how many distances were compared.
+static long long orderTour(vector<int>& tour, const vector<ZonePoint>& points)
+{
+    long long compared = 0;
+    size_t n = tour.size();
+    for (size_t i = 1; i + 1 < n; i++)
+    {
+        size_t closest = i;
+        for (size_t j = i + 1; j < n; j++)
+            if (zoneDistance(points[tour[i-1]], points[tour[j]]) < zoneDistance(points[tour[i-1]], points[tour[closest]]))
+                closest = j;
+        compared += n - i;
+        swap(tour[i], tour[closest]);
+    }
+
+    // Reversing tour[i+1..j] swaps edges (i, i+1) and (j, j+1) for (i, j) and (i+1, j+1)
+    auto at = [&](size_t i) { return points[tour[i % n]]; };
+    bool improved = n >= 4;
+    for (int pass = 0; improved && pass < MAX_TWO_OPT_PASSES; pass++)
+    {
+        improved = false;
+        for (size_t i = 0; i + 2 < n; i++)
+            for (size_t j = i + 2; j < n && !(i == 0 && j == n - 1); j++)
+            {
+                double change = zoneDistance(at(i), at(j)) + zoneDistance(at(i + 1), at(j + 1))
+                              - zoneDistance(at(i), at(i + 1)) - zoneDistance(at(j), at(j + 1));
+                compared++;
+                if (change < -1e-9)
+                {
+                    reverse(tour.begin() + i + 1, tour.begin() + j + 1);
+                    improved = true;
+                }
+            }
+    }
+    return compared;
+}
+
 class DeliveryOptimizerImpl
 {
 public:
@@ -12,15 +99,34 @@ public:
         vector<DeliveryRequest>& deliveries,
         double& oldCrowDistance,
         double& newCrowDistance) const;
+    void optimizeDeliveryOrder(
+        const GeoCoord& depot,
+        const vector<DeliveryRequest>& deliveries,
+        vector<int>& order,
+        double& oldCrowDistance,
+        double& newCrowDistance) const;
+    const OptimizerStats& stats() const;
+    void setArena(MonotonicArena* arena);
+    void setZones(int maxZoneStops, int threads);
     
 private:
     // Data members
     const StreetMap* m_streetMap; // Pointer to a StreetMap
+    mutable OptimizerStats m_stats; // Only filled in when built with GOOBEREATS_STATS
+    MonotonicArena* m_arena; // Where temporaries go (nullptr for the heap)
+    int m_maxZoneStops; // Batches bigger than this are split into zones (0 for never)
+    int m_zoneThreads; // Threads zone tours are found on, or 0 for one per core
+    // Private member functions
+    // Order for a batch too big for the greedy search: tours of zones of nearby stops, joined up
+    void zoneOrder(const GeoCoord& depot, const vector<DeliveryRequest>& deliveries, vector<int>& order) const;
 };
 
 DeliveryOptimizerImpl::DeliveryOptimizerImpl(const StreetMap* sm)
 {
     m_streetMap = sm;
+    m_arena = nullptr;
+    m_maxZoneStops = 0;
+    m_zoneThreads = 0;
 }
 
 DeliveryOptimizerImpl::~DeliveryOptimizerImpl()
@@ -33,40 +139,175 @@ void DeliveryOptimizerImpl::optimizeDeliveryOrder(
     double& oldCrowDistance,
     double& newCrowDistance) const
 {
-    oldCrowDistance = 0; // Reset oldCrowDistance
+    vector<int> order; // Find optimized order as indexes, then rearrange deliveries to match
+    optimizeDeliveryOrder(depot, deliveries, order, oldCrowDistance, newCrowDistance);
+    vector<DeliveryRequest> optimizedDeliveries; // Create vector to store optimized deliveries
+    optimizedDeliveries.reserve(deliveries.size());
+    for (int i : order)
+        optimizedDeliveries.push_back(deliveries[i]);
+    // Replace reference deliveries vector with optimmized one
+    deliveries.swap(optimizedDeliveries);
+}
+
+void DeliveryOptimizerImpl::optimizeDeliveryOrder(
+    const GeoCoord& depot,
+    const vector<DeliveryRequest>& deliveries,
+    vector<int>& order,
+    double& oldCrowDistance,
+    double& newCrowDistance) const
+{
+    STATS(auto callStart = chrono::steady_clock::now(); m_stats.iterations = 0; m_stats.oldMiles = m_stats.newMiles = m_stats.improvement = 0;)
+    order.clear();
+    oldCrowDistance = newCrowDistance = 0;
+    if (deliveries.empty()) // Nothing to order
+        return;
+    
     oldCrowDistance += distanceEarthMiles(depot, deliveries[0].location); // Add distance from depot to first location to oldCrowDistance
     for (size_t i = 1; i < deliveries.size(); i++) // Loop through deliveries starting from second element to end
     {
         oldCrowDistance += distanceEarthMiles(deliveries[i].location, deliveries[i-1].location); // Add distance from previous to current delivery to oldCrowDistance
     }
     
-    // Optimize deliveries by finding shortest crows distance path
-    vector<DeliveryRequest> optimizedDeliveries; // Create vector to store optimized deliveries
-    GeoCoord currentCoord = depot; // Store current last coord in path
-    while (deliveries.size() > 0) // Loop while there are still more points
+    if (m_maxZoneStops > 0 && deliveries.size() > (size_t)m_maxZoneStops)
+        zoneOrder(depot, deliveries, order);
+    else
     {
-        // SEARCH deliveries FOR NEXT CLOSEST DELIVERY
-        auto it = deliveries.begin(); // Setup iterator to loop through deliveries
-        auto closest = it; // Store iterator to closest delivery (start with first element)
-        while (it != deliveries.end()) // Loop through all deliveries
+        // Optimize deliveries by finding shortest crows distance path
+        ArenaVector<int> remaining((ArenaAllocator<int>(m_arena))); // Indexes of deliveries not yet in the order
+        remaining.reserve(deliveries.size());
+        for (size_t i = 0; i < deliveries.size(); i++)
+            remaining.push_back((int)i);
+        GeoCoord currentCoord = depot; // Store current last coord in path
+        while (remaining.size() > 0) // Loop while there are still more points
         {
-            if (distanceEarthKM(currentCoord, it->location) < distanceEarthKM(currentCoord, closest->location))
-                closest = it; // Replace closest if closer one is found
-            it++;
+            // SEARCH remaining FOR NEXT CLOSEST DELIVERY
+            auto it = remaining.begin(); // Setup iterator to loop through remaining deliveries
+            auto closest = it; // Store iterator to closest delivery (start with first element)
+            while (it != remaining.end()) // Loop through all remaining deliveries
+            {
+                if (distanceEarthKM(currentCoord, deliveries[*it].location) < distanceEarthKM(currentCoord, deliveries[*closest].location))
+                    closest = it; // Replace closest if closer one is found
+                it++;
+                STATS(m_stats.iterations++;)
+            }
+            
+            order.push_back(*closest); // Push next closest delivery into order
+            remaining.erase(closest); // Remove it from remaining
         }
-        
-        optimizedDeliveries.push_back(*closest); // Push next closest delivery into optimized vector
-        deliveries.erase(closest); // Remove optimized DeliveryRequest from deliveries
     }
-    // Replace reference deliveries vector with optimmized one
-    deliveries = optimizedDeliveries;
     
-    newCrowDistance = 0; // Reset newCrowDistance
-    newCrowDistance += distanceEarthMiles(depot, deliveries[0].location); // Add distance from depot to first location to oldCrowDistance
-    for (size_t i = 1; i < deliveries.size(); i++) // Loop through deliveries starting from second element to end
+    newCrowDistance += distanceEarthMiles(depot, deliveries[order[0]].location); // Add distance from depot to first location to newCrowDistance
+    for (size_t i = 1; i < order.size(); i++) // Loop through order starting from second element to end
     {
-        newCrowDistance += distanceEarthMiles(deliveries[i].location, deliveries[i-1].location); // Add distance from previous to current delivery to oldCrowDistance
+        newCrowDistance += distanceEarthMiles(deliveries[order[i]].location, deliveries[order[i-1]].location); // Add distance from previous to current delivery to newCrowDistance
     }
+    
+    STATS(
+        m_stats.oldMiles = oldCrowDistance;
+        m_stats.newMiles = newCrowDistance;
+        m_stats.improvement = oldCrowDistance - newCrowDistance;
+        m_stats.seconds = chrono::duration<double>(chrono::steady_clock::now() - callStart).count();
+        m_stats.microsecondsPerCall.add(m_stats.seconds * 1e6);
+    )
+}
+
+void DeliveryOptimizerImpl::zoneOrder(const GeoCoord& depot, const vector<DeliveryRequest>& deliveries, vector<int>& order) const
+{
+    // Stops are points 0 to n-1 and the depot is point n
+    int n = (int)deliveries.size();
+    const double kmPerDegree = 111.2;
+    double kmPerLongitude = kmPerDegree * cos(deg2rad(depot.latitude));
+    vector<ZonePoint> points(n + 1);
+    for (int i = 0; i <= n; i++)
+    {
+        const GeoCoord& gc = i < n ? deliveries[i].location : depot;
+        points[i] = ZonePoint{(gc.longitude - depot.longitude) * kmPerLongitude, (gc.latitude - depot.latitude) * kmPerDegree};
+    }
+    vector<int> stops(n);
+    for (int i = 0; i < n; i++)
+        stops[i] = i;
+    vector<pair<size_t, size_t>> ranges;
+    splitZones(stops, 0, n, points, m_maxZoneStops, ranges);
+    int numZones = (int)ranges.size();
+
+    // Each zone's tour, on its own thread
+    vector<vector<int>> tours(numZones);
+    vector<long long> compared(numZones + 1, 0);
+    runParallel(numZones, m_zoneThreads > 0 ? m_zoneThreads : hardwareThreads(), [&](int z) {
+        tours[z].assign(stops.begin() + ranges[z].first, stops.begin() + ranges[z].second);
+        compared[z] = orderTour(tours[z], points);
+    });
+
+    // The order to visit zones in: a tour of their centers starting at the depot
+    vector<ZonePoint> centers(numZones + 1);
+    for (int z = 0; z < numZones; z++)
+    {
+        ZonePoint sum{0, 0};
+        for (int stop : tours[z])
+        {
+            sum.x += points[stop].x;
+            sum.y += points[stop].y;
+        }
+        centers[z] = ZonePoint{sum.x / tours[z].size(), sum.y / tours[z].size()};
+    }
+    centers[numZones] = points[n];
+    vector<int> zones(1, numZones);
+    for (int z = 0; z < numZones; z++)
+        zones.push_back(z);
+    compared[numZones] = orderTour(zones, centers);
+
+    // Join the zone tours: each is opened at whichever of its edges, driven either way, best links
+    // the end of the zone before with the center of the zone after (the depot after the last one)
+    order.clear();
+    order.reserve(n);
+    ZonePoint last = points[n];
+    for (int i = 1; i <= numZones; i++)
+    {
+        const vector<int>& tour = tours[zones[i]];
+        const ZonePoint& next = centers[i < numZones ? zones[i+1] : numZones];
+        size_t size = tour.size();
+        double best = 0;
+        size_t bestCut = 0;
+        bool bestForward = true;
+        for (size_t cut = 0; cut < size; cut++)
+        {
+            // Dropping the edge from tour[cut] to tour[cut+1]
+            const ZonePoint& a = points[tour[cut]];
+            const ZonePoint& b = points[tour[(cut + 1) % size]];
+            double dropped = zoneDistance(a, b);
+            double forward = zoneDistance(last, b) + zoneDistance(a, next) - dropped;  // In at b, round to a
+            double backward = zoneDistance(last, a) + zoneDistance(b, next) - dropped; // In at a, back round to b
+            if (cut == 0 || min(forward, backward) < best)
+            {
+                best = min(forward, backward);
+                bestCut = cut;
+                bestForward = forward <= backward;
+            }
+        }
+        for (size_t k = 0; k < size; k++)
+            order.push_back(bestForward ? tour[(bestCut + 1 + k) % size] : tour[(bestCut + size - k) % size]);
+        last = points[order.back()];
+    }
+    STATS(
+        for (long long c : compared)
+            m_stats.iterations += c;
+    )
+}
+
+const OptimizerStats& DeliveryOptimizerImpl::stats() const
+{
+    return m_stats;
+}
+
+void DeliveryOptimizerImpl::setArena(MonotonicArena* arena)
+{
+    m_arena = arena;
+}
+
+void DeliveryOptimizerImpl::setZones(int maxZoneStops, int threads)
+{
+    m_maxZoneStops = max(0, maxZoneStops);
+    m_zoneThreads = threads;
 }
 
 //******************** DeliveryOptimizer functions ****************************
@@ -92,3 +333,28 @@ void DeliveryOptimizer::optimizeDeliveryOrder(
 {
     return m_impl->optimizeDeliveryOrder(depot, deliveries, oldCrowDistance, newCrowDistance);
 }
+
+void DeliveryOptimizer::optimizeDeliveryOrder(
+        const GeoCoord& depot,
+        const vector<DeliveryRequest>& deliveries,
+        vector<int>& order,
+        double& oldCrowDistance,
+        double& newCrowDistance) const
+{
+    return m_impl->optimizeDeliveryOrder(depot, deliveries, order, oldCrowDistance, newCrowDistance);
+}
+
+const OptimizerStats& DeliveryOptimizer::stats() const
+{
+    return m_impl->stats();
+}
+
+void DeliveryOptimizer::setArena(MonotonicArena* arena)
+{
+    m_impl->setArena(arena);
+}
+
+void DeliveryOptimizer::setZones(int maxZoneStops, int threads)
+{
+    m_impl->setZones(maxZoneStops, threads);
+}
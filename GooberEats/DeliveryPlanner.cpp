@@ -1,4 +1,5 @@
 #include "provided.h"
+#include "support.h"
 #include <vector>
 #include <list>
 #include <string>
@@ -14,17 +15,34 @@ public:
         const vector<DeliveryRequest>& deliveries,
         vector<DeliveryCommand>& commands,
         double& totalDistanceTravelled) const;
+    DeliveryResult generateCompactPlan(
+        const GeoCoord& depot,
+        const vector<DeliveryRequest>& deliveries,
+        vector<PlanCommand>& commands,
+        double& totalDistanceTravelled,
+        RouteGeometry* geometry) const;
+    void setSnapToMap(bool snap);
+    void setTurnCosts(const TurnCosts& costs);
+    void setZones(int maxZoneStops, int threads);
+    void setArenaEnabled(bool enabled);
     
 private:
     // Data Members
     const StreetMap* m_streetMap; // Pointer to StreetMap
-    // Member functions
-    string getDirection(const StreetSegment& s) const;
+    bool m_snapToMap; // Whether to snap coords onto the map before planning
+    TurnCosts m_turnCosts; // Passed on to the router
+    int m_maxZoneStops; // Passed on to the optimizer
+    int m_zoneThreads;
+    bool m_arenaEnabled; // Whether plans take temporaries from an arena
 };
 
 DeliveryPlannerImpl::DeliveryPlannerImpl(const StreetMap* sm)
 {
     m_streetMap = sm;
+    m_snapToMap = false;
+    m_maxZoneStops = 0;
+    m_zoneThreads = 0;
+    m_arenaEnabled = true;
 }
 
 DeliveryPlannerImpl::~DeliveryPlannerImpl()
@@ -37,180 +55,142 @@ DeliveryResult DeliveryPlannerImpl::generateDeliveryPlan(
     vector<DeliveryCommand>& commands,
     double& totalDistanceTravelled) const
 {
+    // Plan with compact commands, then expand them to DeliveryCommands
+    vector<PlanCommand> plan;
+    DeliveryResult dr = generateCompactPlan(depot, deliveries, plan, totalDistanceTravelled, nullptr);
+    if (dr != DELIVERY_SUCCESS)
+        return dr;
+    commands.reserve(commands.size() + plan.size());
+    for (const PlanCommand& cmd : plan)
+        commands.push_back(toDeliveryCommand(cmd, m_streetMap->graph(), deliveries));
+    return DELIVERY_SUCCESS;
+}
+
+DeliveryResult DeliveryPlannerImpl::generateCompactPlan(
+    const GeoCoord& inputDepot,
+    const vector<DeliveryRequest>& deliveries,
+    vector<PlanCommand>& commands,
+    double& totalDistanceTravelled,
+    RouteGeometry* geometry) const
+{
+    if (geometry != nullptr)
+        geometry->clear();
+    if (deliveries.empty()) // Nothing to deliver
+    {
+        totalDistanceTravelled = 0;
+        return DELIVERY_SUCCESS;
+    }
+    
+    // Temporaries of this plan all come from one arena and are freed together when it returns. The
+    // first block fits the router's per node scratch space so most plans need just the one.
+    const StreetGraph& graph = m_streetMap->graph();
+    MonotonicArena planArena(graph.numNodes() * (sizeof(double) + sizeof(int)) + 64 * 1024);
+    MonotonicArena* arena = m_arenaEnabled ? &planArena : nullptr; // Blocks are only taken once used
+    
+    // SNAP COORDS ONTO MAP (if turned on)
+    
+    GeoCoord depot = inputDepot;
+    vector<GeoCoord> locations; // Delivery locations, in the same order as deliveries
+    locations.reserve(deliveries.size());
+    for (const DeliveryRequest& dr : deliveries)
+        locations.push_back(dr.location);
+    if (m_snapToMap)
+    {
+        // Snap depot and all delivery locations in one batch
+        locations.push_back(depot);
+        m_streetMap->snapToNodes(locations);
+        depot = locations.back();
+        locations.pop_back();
+    }
+    
     // OPTIMIZE DELIVERIES
     
     DeliveryOptimizer dOptimizer(m_streetMap); // Construct delivery optimizer
+    dOptimizer.setArena(arena);
+    dOptimizer.setZones(m_maxZoneStops, m_zoneThreads);
     double oldCrowsDist, newCrowsDist; // Setup vars to optimize delivery
-    vector<DeliveryRequest> optimizedDeliveries = deliveries; // Create new vector to store optimized deliveries
-    dOptimizer.optimizeDeliveryOrder(depot, optimizedDeliveries, oldCrowsDist, newCrowsDist); // Optimize delivery
+    vector<int> order; // Indexes of deliveries in the order we will make them
+    if (m_snapToMap) // Optimize using the snapped locations
+    {
+        vector<DeliveryRequest> snapped; // Only locations matter to the optimizer, so leave the items out
+        snapped.reserve(locations.size());
+        for (const GeoCoord& gc : locations)
+            snapped.push_back(DeliveryRequest("", gc));
+        dOptimizer.optimizeDeliveryOrder(depot, snapped, order, oldCrowsDist, newCrowsDist);
+    }
+    else
+        dOptimizer.optimizeDeliveryOrder(depot, deliveries, order, oldCrowsDist, newCrowsDist);
     if (newCrowsDist > oldCrowsDist) // If optimization makes it slower
-        optimizedDeliveries = deliveries; // Reset optimized to orginal order
+        for (size_t i = 0; i < order.size(); i++) // Reset to orginal order
+            order[i] = (int)i;
+    ArenaVector<GeoCoord> stops((ArenaAllocator<GeoCoord>(arena))); // Delivery locations in optimized order
+    stops.reserve(order.size());
+    for (int i : order)
+        stops.push_back(locations[i]);
     
     // GENERATE POINT TO POINT ROUTE
     
     PointToPointRouter p2pRouter(m_streetMap); // Construct PointToPointRouter
-    list<StreetSegment> route; // Construct route list to store route
-    double totalDistTravelled; // Construct var to store total distance
+    p2pRouter.setArena(arena);
+    p2pRouter.setTurnCosts(m_turnCosts);
+    RoutePath route; // Every leg's edges, back to back
+    vector<size_t> legEdges; // Edges in route by the end of each leg
+    legEdges.reserve(stops.size() + 1);
     
-    DeliveryResult dr = p2pRouter.generatePointToPointRoute(depot, optimizedDeliveries[0].location, route, totalDistTravelled); // Attempt to generage route from depot to first delivery
+    DeliveryResult dr = p2pRouter.generatePointToPointPath(depot, stops[0], route); // Attempt to generage route from depot to first delivery
     if (dr != DELIVERY_SUCCESS) // Return error if not success
         return dr;
+    legEdges.push_back(route.size());
     
-    size_t i = 1; // Set up traversal variable to traverse deliveries
-    for (i = 1; i < optimizedDeliveries.size(); i++) // For each delivery location (starting from second location)
+    for (size_t i = 1; i < stops.size(); i++) // For each delivery location (starting from second location)
     {
         // Attempt to generate point to point route from each delivery to next (up to last delivery)
-        dr = p2pRouter.generatePointToPointRoute(optimizedDeliveries[i-1].location, optimizedDeliveries[i].location, route, totalDistTravelled);
+        dr = p2pRouter.generatePointToPointPath(stops[i-1], stops[i], route);
         if (dr != DELIVERY_SUCCESS) // Return error if not success
             return dr;
+        legEdges.push_back(route.size());
     }
-    dr = p2pRouter.generatePointToPointRoute(optimizedDeliveries[optimizedDeliveries.size()-1].location, depot, route, totalDistTravelled); // Attempt to generate route from last delivery location back to depot
+    dr = p2pRouter.generatePointToPointPath(stops[stops.size()-1], depot, route); // Attempt to generate route from last delivery location back to depot
     if (dr != DELIVERY_SUCCESS) // Return error if not success
         return dr;
+    legEdges.push_back(route.size());
     
-    totalDistanceTravelled = totalDistTravelled; // Update total distance
+    totalDistanceTravelled = route.miles(); // Update total distance
     
     // PROCESS ROUTE INTO DELIVERY COMMANDS
     
-    auto routeIt = route.begin(); // Set up route iterator
-    auto routePeeker = routeIt; // Set up iterator to peek at next segment
-    routePeeker++; // Advance iterator to the segment after current
-    
-    double currentStreetDist = 0; // Set up tracker for distance in current path
-    int deliveryIndex = 0; // Set up counter for which delivery we are on currently (start at first element)
-    StreetSegment streetStart = *(route.begin()); // Set up var to track the first segment in current proceed path
-    bool justDelivered = false; // Set up var to track whether we just delivered
-    
-    // First check all the beginning deliveries that are at the starting depot
-    while (depot == optimizedDeliveries[deliveryIndex].location && deliveryIndex < optimizedDeliveries.size())
-    {
-        // Create deliver command and push back into commands vector
-        DeliveryCommand deliver;
-        deliver.initAsDeliverCommand(optimizedDeliveries[deliveryIndex].item);
-        commands.push_back(deliver);
-        deliveryIndex++; // Increment deliveries made
-    }
-    
-    if (deliveryIndex == optimizedDeliveries.size()) // If thats all deliveries
-        return DELIVERY_SUCCESS;
-    
-    // Otherwise, if there are more deliveries, loop
-    while (routePeeker != route.end()) // Loop through whole route
-    {
-        // Check if delivery is to be made at curent location, and do all of them (if > 1)
-        while (routePeeker->start == optimizedDeliveries[deliveryIndex].location && deliveryIndex < optimizedDeliveries.size())
-        {
-            // Conclude previous proceed command (if there is one)
-            if (currentStreetDist != 0) // If there is a current route
-            {
-                currentStreetDist += distanceEarthMiles(routeIt->start, routeIt->end); // Add to current path distance
-                // Generate previous proceed command
-                DeliveryCommand proceed;
-                proceed.initAsProceedCommand(getDirection(streetStart), routeIt->name, currentStreetDist); // init as proceed cmd using getDirection for direction
-                commands.push_back(proceed); // Add proceed to commands
-                streetStart = *routePeeker; // Update first street segment
-            }
-            // Create deliver command and push back into commands vector
-            DeliveryCommand deliver;
-            deliver.initAsDeliverCommand(optimizedDeliveries[deliveryIndex].item);
-            commands.push_back(deliver);
-            // Reset curr path distance and increment deliveryIndex
-            currentStreetDist = 0;
-            deliveryIndex++;
-            justDelivered = true; // Update justDelivered
-        }
-        if (justDelivered) // If we just finished delivering, increment iterators and continue
-        {
-            routeIt++;
-            routePeeker++;
-            justDelivered = false; // Update justDelivered
-            continue;
-        }
-        
-        // If we don't deliver this turn, we continue path
-        if (routeIt->name == routePeeker->name) // If we continue to be on the same street
-            currentStreetDist += distanceEarthMiles(routeIt->start, routeIt->end); // Add to current path distance
-        else // If we go on a new street
-        {
-            // Conclude previous proceed command
-            currentStreetDist += distanceEarthMiles(routeIt->start, routeIt->end); // Add to current path distance
-            // Generate previous proceed command
-            DeliveryCommand proceed;
-            proceed.initAsProceedCommand(getDirection(streetStart), routeIt->name, currentStreetDist); // init as proceed cmd using getDirection for direction
-            commands.push_back(proceed); // Add proceed to commands
-            // Reset counter and update starting street segment
-            currentStreetDist = 0;
-            streetStart = *routePeeker;
-            
-            // Test for turn
-            double angleBtwn = angleBetween2Lines(*routeIt, *routePeeker); // Get angle
-            if (angleBtwn < 1.0 || angleBtwn > 359.0) // No turn
-            {}
-            else if (angleBtwn >= 1.0 && angleBtwn < 180.0) // Left turn
-            {
-                DeliveryCommand turn;
-                turn.initAsTurnCommand("left", routePeeker->name);
-                commands.push_back(turn);
-            }
-            else if (angleBtwn >= 180.0 && angleBtwn <= 359.0) // Right turn
-            {
-                DeliveryCommand turn;
-                turn.initAsTurnCommand("right", routePeeker->name);
-                commands.push_back(turn);
-            }
-        }
-        routeIt++;
-        routePeeker++;
-    }
-    
-    // Conclude last proceed command
-    currentStreetDist += distanceEarthMiles(routeIt->start, routeIt->end); // Add to current path distance
-    // Generate previous proceed command
-    DeliveryCommand proceed;
-    proceed.initAsProceedCommand(getDirection(*routeIt), routeIt->name, currentStreetDist); // init as proceed cmd using getDirection for direction
-    commands.push_back(proceed); // Add proceed to commands
-    
-    // Repeatedly check deliveries for last point until the end
-    while (routeIt->end == optimizedDeliveries[deliveryIndex].location && deliveryIndex < optimizedDeliveries.size())
-    {
-        // Create deliver command and push back into commands vector
-        DeliveryCommand deliver;
-        deliver.initAsDeliverCommand(optimizedDeliveries[deliveryIndex].item);
-        commands.push_back(deliver);
-        deliveryIndex++;
-    }
+    // Every leg was routed, so the depot and every stop are nodes; compare ids from here on
+    int depotNode = m_streetMap->nodeAt(depot);
+    vector<int> stopNodes;
+    stopNodes.reserve(stops.size());
+    for (const GeoCoord& stop : stops)
+        stopNodes.push_back(m_streetMap->nodeAt(stop));
     
+    generateCommands(graph, route, depotNode, stopNodes, order, commands);
+    if (geometry != nullptr) // Straight from the edges, like the commands
+        buildRouteGeometry(graph, route, depotNode, legEdges, *geometry);
     return DELIVERY_SUCCESS; // Return success
 }
 
-string DeliveryPlannerImpl::getDirection(const StreetSegment& s) const
+void DeliveryPlannerImpl::setSnapToMap(bool snap)
 {
-    double angle = angleOfLine(s); // Get angle of street segment
-    
-    if (angle < 0.0 || angle >= 360.0) // Error Check
-        return "ERROR - BAD ANGLE";
-    
-    // Determine which direction angle is in
-    if (angle < 22.5)
-        return "east";
-    else if (angle < 67.5)
-        return "northeast";
-    else if (angle < 112.5)
-        return "north";
-    else if (angle < 157.5)
-        return "northwest";
-    else if (angle < 202.5)
-        return "west";
-    else if (angle < 247.5)
-        return "southwest";
-    else if (angle < 292.5)
-        return "south";
-    else if (angle < 337.5)
-        return "southeast";
-    else if (angle < 360.0)
-        return "east";
-    else
-        return "ERROR - BAD ANGLE";
+    m_snapToMap = snap;
+}
+
+void DeliveryPlannerImpl::setTurnCosts(const TurnCosts& costs)
+{
+    m_turnCosts = costs;
+}
+
+void DeliveryPlannerImpl::setZones(int maxZoneStops, int threads)
+{
+    m_maxZoneStops = maxZoneStops;
+    m_zoneThreads = threads;
+}
+
+void DeliveryPlannerImpl::setArenaEnabled(bool enabled)
+{
+    m_arenaEnabled = enabled;
 }
 
 //******************** DeliveryPlanner functions ******************************
@@ -236,3 +216,33 @@ DeliveryResult DeliveryPlanner::generateDeliveryPlan(
 {
     return m_impl->generateDeliveryPlan(depot, deliveries, commands, totalDistanceTravelled);
 }
+
+DeliveryResult DeliveryPlanner::generateCompactPlan(
+    const GeoCoord& depot,
+    const vector<DeliveryRequest>& deliveries,
+    vector<PlanCommand>& commands,
+    double& totalDistanceTravelled,
+    RouteGeometry* geometry) const
+{
+    return m_impl->generateCompactPlan(depot, deliveries, commands, totalDistanceTravelled, geometry);
+}
+
+void DeliveryPlanner::setSnapToMap(bool snap)
+{
+    m_impl->setSnapToMap(snap);
+}
+
+void DeliveryPlanner::setTurnCosts(const TurnCosts& costs)
+{
+    m_impl->setTurnCosts(costs);
+}
+
+void DeliveryPlanner::setZones(int maxZoneStops, int threads)
+{
+    m_impl->setZones(maxZoneStops, threads);
+}
+
+void DeliveryPlanner::setArenaEnabled(bool enabled)
+{
+    m_impl->setArenaEnabled(enabled);
+}
@@ -0,0 +1,498 @@
+#include "provided.h"
+#include "support.h"
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include <algorithm>
+#include <utility>
+#include <float.h> // For DBL_MAX
+using namespace std;
+
+const int REPAIR_RADIUS = 3; // Stops on each side of a change that local repair may reorder
+const int MAX_REPAIR_PASSES = 10; // Improving moves local repair makes at most
+
+class DeliverySessionImpl
+{
+public:
+    DeliverySessionImpl(const StreetMap* sm);
+    ~DeliverySessionImpl();
+    DeliveryResult start(const GeoCoord& depot, const vector<DeliveryRequest>& deliveries);
+    DeliveryResult addDelivery(const DeliveryRequest& delivery, int& id);
+    bool cancelDelivery(int id);
+    bool deliverNext();
+    DeliveryResult moveDriver(const GeoCoord& location);
+    DeliveryResult currentPlan(vector<DeliveryCommand>& commands, double& totalDistanceTravelled) const;
+    DeliveryResult currentCompactPlan(vector<PlanCommand>& commands, double& totalDistanceTravelled) const;
+    const vector<DeliveryRequest>& deliveries() const;
+    const vector<int>& remainingDeliveries() const;
+    int legsRouted() const;
+
+private:
+    // Data members
+    const StreetMap* m_streetMap; // Pointer to StreetMap
+    PointToPointRouter m_router; // Routes legs, keeping its scratch space between them
+    vector<DeliveryRequest> m_deliveries; // Every delivery given, indexed by id
+    vector<int> m_deliveryNodes; // Map node of each delivery's location
+    GeoCoord m_depot;
+    int m_depotNode;
+    GeoCoord m_driver; // Where the driver is: the depot, the last stop made, or wherever moveDriver said
+    int m_driverNode;
+    vector<int> m_stops; // Ids of the deliveries still to make, in tour order
+    // Legs are checked against map changes lazily by the (const) plan queries, hence mutable
+    mutable vector<RoutePath> m_legs; // m_legs[i] ends at stop i, or back at the depot for the last one; m_legs[0] starts at the driver
+    mutable vector<bool> m_legStale; // Legs a map change may have made wrong or no longer shortest
+    mutable size_t m_changesSeen; // How many of the graph's logged changes m_legStale includes
+    int m_legsRouted;
+    // Private member functions
+    const GeoCoord& tourCoord(const GeoCoord& driver, const vector<int>& stops, int pos) const; // Driver for -1, depot past the last stop
+    int tourNode(int driverNode, const vector<int>& stops, int pos) const; // Same, as node ids
+    // Legs of a tour of stops starting at driverNode, reusing the current tour's legs wherever the
+    // ends match and routing the rest. Nothing changes if a leg can't be routed.
+    DeliveryResult routeLegs(int driverNode, const vector<int>& stops, vector<RoutePath>& legs);
+    void catchUp() const; // Mark the legs that map changes made since the last call may have spoiled
+    void repair(vector<int>& stops, int center, const GeoCoord& driver) const; // Local reordering around stops[center]
+};
+
+DeliverySessionImpl::DeliverySessionImpl(const StreetMap* sm)
+ : m_streetMap(sm), m_router(sm)
+{
+    m_depotNode = m_driverNode = -1;
+    m_legsRouted = 0;
+    m_changesSeen = sm->graph().changes.size();
+}
+
+DeliverySessionImpl::~DeliverySessionImpl()
+{
+}
+
+DeliveryResult DeliverySessionImpl::start(const GeoCoord& depot, const vector<DeliveryRequest>& deliveries)
+{
+    int depotNode = m_streetMap->nodeAt(depot);
+    if (depotNode == -1)
+        return BAD_COORD;
+    vector<int> nodes;
+    nodes.reserve(deliveries.size());
+    for (const DeliveryRequest& dr : deliveries)
+    {
+        nodes.push_back(m_streetMap->nodeAt(dr.location));
+        if (nodes.back() == -1)
+            return BAD_COORD;
+    }
+
+    // Same order DeliveryPlanner would use
+    DeliveryOptimizer dOptimizer(m_streetMap);
+    double oldCrowsDist, newCrowsDist;
+    vector<int> order;
+    dOptimizer.optimizeDeliveryOrder(depot, deliveries, order, oldCrowsDist, newCrowsDist);
+    if (newCrowsDist > oldCrowsDist) // If optimization makes it slower
+        for (size_t i = 0; i < order.size(); i++) // Reset to orginal order
+            order[i] = (int)i;
+
+    // Route every leg, setting the current tour aside so none of it is reused
+    catchUp(); // While the current legs are still there to check, in case this fails
+    vector<RoutePath> oldLegs, legs;
+    oldLegs.swap(m_legs);
+    m_deliveryNodes.swap(nodes);
+    swap(m_depotNode, depotNode);
+    DeliveryResult dr = routeLegs(m_depotNode, order, legs);
+    if (dr != DELIVERY_SUCCESS)
+    {
+        oldLegs.swap(m_legs);
+        m_deliveryNodes.swap(nodes);
+        swap(m_depotNode, depotNode);
+        return dr;
+    }
+
+    m_deliveries = deliveries;
+    m_depot = m_driver = depot;
+    m_driverNode = m_depotNode;
+    m_stops.swap(order);
+    m_legs.swap(legs);
+    m_legStale.assign(m_legs.size(), false);
+    return DELIVERY_SUCCESS;
+}
+
+DeliveryResult DeliverySessionImpl::addDelivery(const DeliveryRequest& delivery, int& id)
+{
+    int node = m_streetMap->nodeAt(delivery.location);
+    if (m_depotNode == -1 || node == -1) // Not started, or not on the map
+        return BAD_COORD;
+
+    // Cheapest insertion: the place in the tour where the stop adds the least straight line distance
+    size_t bestPos = 0;
+    double bestAdded = DBL_MAX;
+    for (size_t pos = 0; pos <= m_stops.size(); pos++)
+    {
+        const GeoCoord& prev = tourCoord(m_driver, m_stops, (int)pos - 1);
+        const GeoCoord& next = tourCoord(m_driver, m_stops, (int)pos);
+        double added = distanceEarthMiles(prev, delivery.location) + distanceEarthMiles(delivery.location, next) - distanceEarthMiles(prev, next);
+        if (added < bestAdded)
+        {
+            bestAdded = added;
+            bestPos = pos;
+        }
+    }
+
+    int newId = (int)m_deliveries.size();
+    m_deliveries.push_back(delivery);
+    m_deliveryNodes.push_back(node);
+    vector<int> stops = m_stops;
+    stops.insert(stops.begin() + bestPos, newId);
+    repair(stops, (int)bestPos, m_driver);
+
+    vector<RoutePath> legs;
+    DeliveryResult dr = routeLegs(m_driverNode, stops, legs);
+    if (dr != DELIVERY_SUCCESS) // Forget the delivery
+    {
+        m_deliveries.pop_back();
+        m_deliveryNodes.pop_back();
+        return dr;
+    }
+    m_stops.swap(stops);
+    m_legs.swap(legs);
+    m_legStale.assign(m_legs.size(), false);
+    id = newId;
+    return DELIVERY_SUCCESS;
+}
+
+bool DeliverySessionImpl::cancelDelivery(int id)
+{
+    auto it = find(m_stops.begin(), m_stops.end(), id);
+    if (it == m_stops.end()) // Unknown, cancelled or already made
+        return false;
+    int pos = (int)(it - m_stops.begin());
+    vector<int> stops = m_stops;
+    stops.erase(stops.begin() + pos);
+    repair(stops, min(pos, (int)stops.size() - 1), m_driver);
+
+    vector<RoutePath> legs;
+    if (routeLegs(m_driverNode, stops, legs) != DELIVERY_SUCCESS) // Only if the map changed since the tour was routed
+        return false;
+    m_stops.swap(stops);
+    m_legs.swap(legs);
+    m_legStale.assign(m_legs.size(), false);
+    return true;
+}
+
+bool DeliverySessionImpl::deliverNext()
+{
+    if (m_stops.empty())
+        return false;
+    // The driver is at the stop now, and the leg there is behind them
+    m_driver = m_deliveries[m_stops[0]].location;
+    m_driverNode = m_deliveryNodes[m_stops[0]];
+    m_stops.erase(m_stops.begin());
+    m_legs.erase(m_legs.begin());
+    m_legStale.erase(m_legStale.begin());
+    m_legsRouted = 0;
+    return true;
+}
+
+DeliveryResult DeliverySessionImpl::moveDriver(const GeoCoord& location)
+{
+    int node = m_streetMap->nodeAt(location);
+    if (m_depotNode == -1 || node == -1)
+        return BAD_COORD;
+    // From somewhere else the next few stops may be better taken in another order
+    vector<int> stops = m_stops;
+    repair(stops, 0, location);
+    vector<RoutePath> legs;
+    DeliveryResult dr = routeLegs(node, stops, legs);
+    if (dr != DELIVERY_SUCCESS)
+        return dr;
+    m_driver = location;
+    m_driverNode = node;
+    m_stops.swap(stops);
+    m_legs.swap(legs);
+    m_legStale.assign(m_legs.size(), false);
+    return DELIVERY_SUCCESS;
+}
+
+DeliveryResult DeliverySessionImpl::currentPlan(vector<DeliveryCommand>& commands, double& totalDistanceTravelled) const
+{
+    vector<PlanCommand> plan;
+    DeliveryResult dr = currentCompactPlan(plan, totalDistanceTravelled);
+    if (dr != DELIVERY_SUCCESS)
+        return dr;
+    commands.reserve(commands.size() + plan.size());
+    for (const PlanCommand& cmd : plan)
+        commands.push_back(toDeliveryCommand(cmd, m_streetMap->graph(), m_deliveries));
+    return DELIVERY_SUCCESS;
+}
+
+DeliveryResult DeliverySessionImpl::currentCompactPlan(vector<PlanCommand>& commands, double& totalDistanceTravelled) const
+{
+    if (m_depotNode == -1) // Not started
+        return BAD_COORD;
+    const StreetGraph& graph = m_streetMap->graph();
+    catchUp();
+    for (int i = 0; i < (int)m_legs.size(); i++) // Route again the legs map changes spoiled
+    {
+        if (!m_legStale[i])
+            continue;
+        int from = tourNode(m_driverNode, m_stops, i - 1), to = tourNode(m_driverNode, m_stops, i);
+        RoutePath leg;
+        DeliveryResult dr = m_router.generatePointToPointPath(graph.coord(from), graph.coord(to), leg);
+        if (dr != DELIVERY_SUCCESS) // A closure cut a stop off; the leg stays stale in case it reopens
+            return dr;
+        m_legs[i] = move(leg);
+        m_legStale[i] = false;
+    }
+    RoutePath route; // Every leg's edges, back to back
+    for (const RoutePath& leg : m_legs)
+        for (int e : leg.edges)
+            route.append(graph, e);
+    totalDistanceTravelled = route.miles();
+
+    vector<int> stopNodes;
+    stopNodes.reserve(m_stops.size());
+    for (int id : m_stops)
+        stopNodes.push_back(m_deliveryNodes[id]);
+    generateCommands(graph, route, m_driverNode, stopNodes, m_stops, commands);
+    return DELIVERY_SUCCESS;
+}
+
+const vector<DeliveryRequest>& DeliverySessionImpl::deliveries() const
+{
+    return m_deliveries;
+}
+
+const vector<int>& DeliverySessionImpl::remainingDeliveries() const
+{
+    return m_stops;
+}
+
+int DeliverySessionImpl::legsRouted() const
+{
+    return m_legsRouted;
+}
+
+// Private member functions
+
+const GeoCoord& DeliverySessionImpl::tourCoord(const GeoCoord& driver, const vector<int>& stops, int pos) const
+{
+    if (pos < 0)
+        return driver;
+    return pos < (int)stops.size() ? m_deliveries[stops[pos]].location : m_depot;
+}
+
+int DeliverySessionImpl::tourNode(int driverNode, const vector<int>& stops, int pos) const
+{
+    if (pos < 0)
+        return driverNode;
+    return pos < (int)stops.size() ? m_deliveryNodes[stops[pos]] : m_depotNode;
+}
+
+DeliveryResult DeliverySessionImpl::routeLegs(int driverNode, const vector<int>& stops, vector<RoutePath>& legs)
+{
+    // Current legs by the nodes they join, leaving out any a map change spoiled. The same pair can
+    // come up more than once (say, stops at the same place), so each cached leg is handed out only once.
+    catchUp();
+    auto key = [](int from, int to) { return (long long)from << 32 | (unsigned int)to; };
+    unordered_multimap<long long, int> cached;
+    for (int i = 0; i < (int)m_legs.size(); i++)
+        if (!m_legStale[i])
+            cached.insert(make_pair(key(tourNode(m_driverNode, m_stops, i - 1), tourNode(m_driverNode, m_stops, i)), i));
+
+    // Route the legs that are new first, so a failure leaves the current ones alone
+    const StreetGraph& graph = m_streetMap->graph();
+    vector<int> reuse(stops.size() + 1, -1); // Index in m_legs of each leg to keep
+    legs.assign(stops.size() + 1, RoutePath());
+    int routed = 0;
+    for (int i = 0; i <= (int)stops.size(); i++)
+    {
+        int from = tourNode(driverNode, stops, i - 1), to = tourNode(driverNode, stops, i);
+        auto it = cached.find(key(from, to));
+        if (it != cached.end())
+        {
+            reuse[i] = it->second;
+            cached.erase(it);
+            continue;
+        }
+        DeliveryResult dr = m_router.generatePointToPointPath(graph.coord(from), graph.coord(to), legs[i]);
+        if (dr != DELIVERY_SUCCESS)
+            return dr;
+        routed++;
+    }
+    for (int i = 0; i <= (int)stops.size(); i++)
+        if (reuse[i] != -1)
+            legs[i] = move(m_legs[reuse[i]]);
+    m_legsRouted = routed;
+    return DELIVERY_SUCCESS;
+}
+
+void DeliverySessionImpl::catchUp() const
+{
+    const StreetGraph& graph = m_streetMap->graph();
+    if (m_changesSeen == graph.changes.size())
+        return;
+    // A leg is spoiled if it uses a changed segment, or if a segment that got cheaper (reopened,
+    // added, or a lower cost factor) could make a shorter route between its ends. That can only be
+    // when the straight line distances to and from the segment plus its cost come to less than the
+    // leg's cost, since no route between two points costs less than the straight line between them.
+    unordered_set<int> changed;
+    vector<int> cheaper;
+    for (size_t c = m_changesSeen; c < graph.changes.size(); c++)
+    {
+        const StreetChange& change = graph.changes[c];
+        changed.insert(change.edge);
+        if (change.newCost < change.oldCost)
+            cheaper.push_back(change.edge);
+    }
+    for (int i = 0; i < (int)m_legs.size(); i++)
+    {
+        if (m_legStale[i])
+            continue;
+        double cost = 0;
+        for (int e : m_legs[i].edges)
+        {
+            if (changed.count(e & ~1))
+            {
+                m_legStale[i] = true;
+                break;
+            }
+            cost += graph.edge(e).weight;
+        }
+        if (m_legStale[i] || cheaper.empty())
+            continue;
+        const NodePoint& from = graph.points[tourNode(m_driverNode, m_stops, i - 1)];
+        const NodePoint& to = graph.points[tourNode(m_driverNode, m_stops, i)];
+        for (int e : cheaper)
+        {
+            StreetEdge edge = graph.edge(e);
+            const NodePoint& u = graph.points[edge.from];
+            const NodePoint& v = graph.points[edge.to];
+            double viaSegment = edge.weight + min(coordDistance(from, u) + coordDistance(v, to), coordDistance(from, v) + coordDistance(u, to));
+            if (viaSegment < cost)
+            {
+                m_legStale[i] = true;
+                break;
+            }
+        }
+    }
+    m_changesSeen = graph.changes.size();
+}
+
+void DeliverySessionImpl::repair(vector<int>& stops, int center, const GeoCoord& driver) const
+{
+    if (stops.empty())
+        return;
+    // Only stops within REPAIR_RADIUS of center move, so the tour outside the window and the legs
+    // there stay as they are. Moves are judged on straight line distance, like DeliveryOptimizer's.
+    int first = max(0, center - REPAIR_RADIUS);
+    int last = min((int)stops.size() - 1, center + REPAIR_RADIUS);
+    const GeoCoord& before = tourCoord(driver, stops, first - 1);
+    const GeoCoord& after = tourCoord(driver, stops, last + 1);
+    vector<int> window(stops.begin() + first, stops.begin() + last + 1);
+    auto length = [&](const vector<int>& w) {
+        double miles = 0;
+        const GeoCoord* prev = &before;
+        for (int id : w)
+        {
+            miles += distanceEarthMiles(*prev, m_deliveries[id].location);
+            prev = &m_deliveries[id].location;
+        }
+        return miles + distanceEarthMiles(*prev, after);
+    };
+
+    double bestLength = length(window);
+    for (int pass = 0; pass < MAX_REPAIR_PASSES; pass++)
+    {
+        // Take the best of every 2-opt reversal and Or-opt move within the window
+        vector<int> best;
+        auto consider = [&](const vector<int>& candidate) {
+            double l = length(candidate);
+            if (l < bestLength - 1e-9)
+            {
+                bestLength = l;
+                best = candidate;
+            }
+        };
+        int n = (int)window.size();
+        for (int i = 0; i < n; i++)
+            for (int j = 0; j < n; j++)
+            {
+                if (i == j)
+                    continue;
+                vector<int> candidate = window;
+                if (i < j) // Reverse stops i through j
+                {
+                    reverse(candidate.begin() + i, candidate.begin() + j + 1);
+                    consider(candidate);
+                    candidate = window;
+                    rotate(candidate.begin() + i, candidate.begin() + i + 1, candidate.begin() + j + 1); // Move stop i to j
+                }
+                else
+                    rotate(candidate.begin() + j, candidate.begin() + i, candidate.begin() + i + 1); // Move stop i back to j
+                consider(candidate);
+            }
+        if (best.empty()) // Nothing shortens it any more
+            break;
+        window.swap(best);
+    }
+    copy(window.begin(), window.end(), stops.begin() + first);
+}
+
+//******************** DeliverySession functions ******************************
+
+// These functions simply delegate to DeliverySessionImpl's functions.
+
+DeliverySession::DeliverySession(const StreetMap* sm)
+{
+    m_impl = new DeliverySessionImpl(sm);
+}
+
+DeliverySession::~DeliverySession()
+{
+    delete m_impl;
+}
+
+DeliveryResult DeliverySession::start(const GeoCoord& depot, const vector<DeliveryRequest>& deliveries)
+{
+    return m_impl->start(depot, deliveries);
+}
+
+DeliveryResult DeliverySession::addDelivery(const DeliveryRequest& delivery, int& id)
+{
+    return m_impl->addDelivery(delivery, id);
+}
+
+bool DeliverySession::cancelDelivery(int id)
+{
+    return m_impl->cancelDelivery(id);
+}
+
+bool DeliverySession::deliverNext()
+{
+    return m_impl->deliverNext();
+}
+
+DeliveryResult DeliverySession::moveDriver(const GeoCoord& location)
+{
+    return m_impl->moveDriver(location);
+}
+
+DeliveryResult DeliverySession::currentPlan(vector<DeliveryCommand>& commands, double& totalDistanceTravelled) const
+{
+    return m_impl->currentPlan(commands, totalDistanceTravelled);
+}
+
+DeliveryResult DeliverySession::currentCompactPlan(vector<PlanCommand>& commands, double& totalDistanceTravelled) const
+{
+    return m_impl->currentCompactPlan(commands, totalDistanceTravelled);
+}
+
+const vector<DeliveryRequest>& DeliverySession::deliveries() const
+{
+    return m_impl->deliveries();
+}
+
+const vector<int>& DeliverySession::remainingDeliveries() const
+{
+    return m_impl->remainingDeliveries();
+}
+
+int DeliverySession::legsRouted() const
+{
+    return m_impl->legsRouted();
+}
@@ -3,9 +3,76 @@
 // Skeleton for the ExpandableHashMap class template.  You must implement the first six
 // member functions.
 
-#include <list>
+#ifndef ExpandableHashMap_h
+#define ExpandableHashMap_h
 
-template<typename KeyType, typename ValueType>
+#include <cstddef> // For size_t
+#include <functional> // For equal_to and hash
+#include <utility> // For move
+#include <vector>
+
+// Policies the map is built from. Each is a template parameter, so the choice is made at compile time
+// and every call inlines; the defaults give the map's original behavior.
+
+// Hashes with the free function hasher(key), which the code using the map defines for its key type
+template<typename KeyType>
+struct FreeFunctionHasher
+{
+    unsigned int operator()(const KeyType& key) const
+    {
+        unsigned int hasher(const KeyType& k); // Prototype hasher
+        return hasher(key);
+    }
+};
+
+// std::hash, for key types that have one
+template<typename KeyType>
+struct StdHasher
+{
+    size_t operator()(const KeyType& key) const { return std::hash<KeyType>()(key); }
+};
+
+// For integer keys like node ids. Only the low bits pick a bucket, so mix every bit into them.
+struct IntHasher
+{
+    size_t operator()(long long key) const
+    {
+        unsigned long long h = (unsigned long long)key;
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        return (size_t)h;
+    }
+};
+
+// Where to look next after bucket home is taken; step counts from 1. Both visit every bucket of a
+// power of two table before repeating.
+struct LinearProbing
+{
+    static size_t next(size_t slot, size_t, size_t mask) { return (slot + 1) & mask; }
+};
+
+struct QuadraticProbing // Steps of 1, 2, 3, ... so probes land on triangular numbers from home
+{
+    static size_t next(size_t slot, size_t step, size_t mask) { return (slot + step) & mask; }
+};
+
+// Bucket count to grow to when the map gets too full. Must keep it a power of two.
+struct DoublingGrowth
+{
+    static size_t next(size_t buckets) { return buckets * 2; }
+};
+
+struct QuadruplingGrowth // Fewer rehashes while loading, more memory afterwards
+{
+    static size_t next(size_t buckets) { return buckets * 4; }
+};
+
+template<typename KeyType, typename ValueType,
+         typename Hash = FreeFunctionHasher<KeyType>,
+         typename Equal = std::equal_to<KeyType>,
+         typename Probing = LinearProbing,
+         typename Growth = DoublingGrowth>
 class ExpandableHashMap
 {
 public:
@@ -14,8 +81,12 @@ public:
 	void reset();
 	int size() const;
 	void associate(const KeyType& key, const ValueType& value);
+	bool remove(const KeyType& key); // Returns false if key wasn't in the map
+	int probeLength(const KeyType& key) const; // Number of buckets find(key) looks at
+	size_t memoryUsage() const; // Bytes held by buckets and entries, not counting memory keys and values own
 
 	  // for a map that can't be modified, return a pointer to const ValueType
+	  // (good until the map is next changed)
 	const ValueType* find(const KeyType& key) const;
 
 	  // for a modifiable map, return a pointer to modifiable ValueType
@@ -29,121 +100,164 @@ public:
 	ExpandableHashMap& operator=(const ExpandableHashMap&) = delete;
 
 private:
-    // Node struct for hashmap
+    // Entries are kept back to back in m_entries. The buckets are open addressed: each holds an entry's
+    // index and the low bits of its key's hash, and a key that collides moves on to the buckets the
+    // Probing policy picks. Comparing the stored hash first skips most key compares, and growing only
+    // moves buckets around, never keys, values or rehashing.
     struct Node
     {
-        Node(KeyType k, ValueType v)
-        {
-            m_key = k;
-            m_value = v;
-        }
         KeyType m_key;
         ValueType m_value;
     };
+    struct Bucket
+    {
+        unsigned int hash; // Low bits of the key's hash
+        int entry; // Index in m_entries, or EMPTY or REMOVED
+    };
+    enum { EMPTY = -1, REMOVED = -2 };
     // Data members
     double m_maxLoadFactor; // Max load
-    int m_size; // Current size counter
-    unsigned int m_numBuckets; // Current number of buckets counter
-    std::list<Node>* m_map; // Array of linked lists of nodes
+    size_t m_used; // Buckets full or removed; removed ones still lengthen probes until a rehash
+    std::vector<Bucket> m_buckets; // Size is always a power of two
+    std::vector<Node> m_entries;
+    Hash m_hash;
+    Equal m_equal;
     // Private member functions
-    unsigned int getBucketNum(const KeyType& key) const; // Hashes a key and returns a corresponding bucket to hashed value
-    void expandMap(unsigned int size); // Rehashes all items in map and inserts it into new map structure with size as inputted
+    // Bucket holding key, or the empty one that ends its probe sequence; probes gets the buckets looked at
+    size_t findBucket(const KeyType& key, unsigned int hash, int* probes = nullptr) const;
+    void expandMap(size_t size); // Moves every bucket into a new array of size buckets
 };
 
-template<typename KeyType, typename ValueType>
-ExpandableHashMap<KeyType, ValueType>::ExpandableHashMap(double maximumLoadFactor)
+template<typename KeyType, typename ValueType, typename Hash, typename Equal, typename Probing, typename Growth>
+ExpandableHashMap<KeyType, ValueType, Hash, Equal, Probing, Growth>::ExpandableHashMap(double maximumLoadFactor)
 {
-    // Set up maxLoadFactor and other default data members
-    m_maxLoadFactor = maximumLoadFactor;
-    m_size = 0;
-    m_numBuckets = 8;
-    m_map = new std::list<Node>[8];
+    // Set up maxLoadFactor and other default data members. Probing needs some empty buckets, so cap the load.
+    m_maxLoadFactor = maximumLoadFactor > 0 && maximumLoadFactor < 0.9 ? maximumLoadFactor : 0.9;
+    reset();
 }
 
-template<typename KeyType, typename ValueType>
-ExpandableHashMap<KeyType, ValueType>::~ExpandableHashMap()
+template<typename KeyType, typename ValueType, typename Hash, typename Equal, typename Probing, typename Growth>
+ExpandableHashMap<KeyType, ValueType, Hash, Equal, Probing, Growth>::~ExpandableHashMap()
 {
-    delete[] m_map; // Deletes dynamically allocated array of lists
 }
 
-template<typename KeyType, typename ValueType>
-void ExpandableHashMap<KeyType, ValueType>::reset()
+template<typename KeyType, typename ValueType, typename Hash, typename Equal, typename Probing, typename Growth>
+void ExpandableHashMap<KeyType, ValueType, Hash, Equal, Probing, Growth>::reset()
 {
-    delete[] m_map; // Deletes current dynamically allocated array of lists
-    m_map =  new std::list<Node>[8]; // Dynamically allocated new clean map of default bucket num
-    m_size = 0; // Reset size
-    m_numBuckets = 8; // Reset bucket num
+    Bucket empty = { 0, EMPTY };
+    std::vector<Bucket>(8, empty).swap(m_buckets); // Clean map of default bucket num, giving back the old memory
+    std::vector<Node>().swap(m_entries);
+    m_used = 0;
 }
 
-template<typename KeyType, typename ValueType>
-int ExpandableHashMap<KeyType, ValueType>::size() const
+template<typename KeyType, typename ValueType, typename Hash, typename Equal, typename Probing, typename Growth>
+int ExpandableHashMap<KeyType, ValueType, Hash, Equal, Probing, Growth>::size() const
 {
-    return m_size;
+    return (int)m_entries.size();
 }
 
-template<typename KeyType, typename ValueType>
-void ExpandableHashMap<KeyType, ValueType>::associate(const KeyType& key, const ValueType& value)
+template<typename KeyType, typename ValueType, typename Hash, typename Equal, typename Probing, typename Growth>
+void ExpandableHashMap<KeyType, ValueType, Hash, Equal, Probing, Growth>::associate(const KeyType& key, const ValueType& value)
 {
-    ValueType* foundValue = find(key); // Search for key in map
-    if (foundValue != nullptr) // If key is found
+    unsigned int hash = (unsigned int)m_hash(key);
+    size_t bucket = findBucket(key, hash); // Search for key in map
+    if (m_buckets[bucket].entry >= 0) // If key is found
     {
-        *foundValue = value; // Set new value and return
+        m_entries[m_buckets[bucket].entry].m_value = value; // Set new value and return
         return;
     }
-    
-    if ((m_size+1.0)/m_numBuckets > m_maxLoadFactor) // Otherwise check if load is > maxLoad
-        expandMap(m_numBuckets*2); // Expand the map
-    
-    unsigned int bucket = getBucketNum(key); // Get bucket for new key
-    m_map[bucket].push_back(Node(key, value)); // Push key value pair into bucket
-    m_size++; // Increase size counter
+
+    if (m_used + 1.0 > m_maxLoadFactor * m_buckets.size()) // Otherwise check if load is > maxLoad
+    {
+        // Grow if live entries fill the map, otherwise rehashing at the same size clears out removed buckets
+        expandMap(m_entries.size() + 1.0 > m_maxLoadFactor * m_buckets.size() / 2 ? Growth::next(m_buckets.size()) : m_buckets.size());
+        bucket = findBucket(key, hash);
+    }
+
+    m_buckets[bucket].hash = hash; // Point the empty bucket at a new entry
+    m_buckets[bucket].entry = (int)m_entries.size();
+    m_entries.push_back(Node{key, value});
+    m_used++;
 }
 
-template<typename KeyType, typename ValueType>
-const ValueType* ExpandableHashMap<KeyType, ValueType>::find(const KeyType& key) const
+template<typename KeyType, typename ValueType, typename Hash, typename Equal, typename Probing, typename Growth>
+const ValueType* ExpandableHashMap<KeyType, ValueType, Hash, Equal, Probing, Growth>::find(const KeyType& key) const
 {
-    unsigned int bucket = getBucketNum(key); // Find associated bucket for key
-    for (auto it = m_map[bucket].begin(); it != m_map[bucket].end(); it++) // Loop through linked list in bucket
+    int entry = m_buckets[findBucket(key, (unsigned int)m_hash(key))].entry;
+    return entry >= 0 ? &m_entries[entry].m_value : nullptr; // nullptr if not found
+}
+
+template<typename KeyType, typename ValueType, typename Hash, typename Equal, typename Probing, typename Growth>
+bool ExpandableHashMap<KeyType, ValueType, Hash, Equal, Probing, Growth>::remove(const KeyType& key)
+{
+    size_t bucket = findBucket(key, (unsigned int)m_hash(key));
+    int entry = m_buckets[bucket].entry;
+    if (entry < 0) // return false if not found
+        return false;
+    m_buckets[bucket].entry = REMOVED; // Leave a marker so probes for keys past it keep going
+
+    // Fill the hole with the last entry so entries stay back to back
+    int last = (int)m_entries.size() - 1;
+    if (entry != last)
     {
-        if (it->m_key == key) // If key found return pointer to value
-            return &(it->m_value);
+        const KeyType& lastKey = m_entries[last].m_key;
+        m_buckets[findBucket(lastKey, (unsigned int)m_hash(lastKey))].entry = entry;
+        m_entries[entry] = std::move(m_entries[last]);
     }
-    return nullptr; // return nullptr if not found
+    m_entries.pop_back();
+    return true;
+}
+
+template<typename KeyType, typename ValueType, typename Hash, typename Equal, typename Probing, typename Growth>
+int ExpandableHashMap<KeyType, ValueType, Hash, Equal, Probing, Growth>::probeLength(const KeyType& key) const
+{
+    int probes;
+    findBucket(key, (unsigned int)m_hash(key), &probes); // Walk the buckets the same way find does
+    return probes;
+}
+
+template<typename KeyType, typename ValueType, typename Hash, typename Equal, typename Probing, typename Growth>
+size_t ExpandableHashMap<KeyType, ValueType, Hash, Equal, Probing, Growth>::memoryUsage() const
+{
+    return m_buckets.capacity() * sizeof(Bucket) + m_entries.capacity() * sizeof(Node);
 }
 
 // Private member function implementations
 
-template<typename KeyType, typename ValueType>
-unsigned int ExpandableHashMap<KeyType, ValueType>::getBucketNum(const KeyType& key) const
+template<typename KeyType, typename ValueType, typename Hash, typename Equal, typename Probing, typename Growth>
+size_t ExpandableHashMap<KeyType, ValueType, Hash, Equal, Probing, Growth>::findBucket(const KeyType& key, unsigned int hash, int* probes) const
 {
-    unsigned int hasher(const KeyType& k); // Prototype hasher
-    unsigned int hash = hasher(key); // Hash key
-    unsigned int bucket = hash % m_numBuckets; // Modulus hash by number of buckets
-    
-    return bucket; // Return bucket number
+    size_t mask = m_buckets.size() - 1;
+    size_t bucket = hash & mask; // Power of two size, so masking picks the home bucket
+    size_t step = 1;
+    for (; m_buckets[bucket].entry != EMPTY; step++) // Load is capped, so an empty bucket always ends the walk
+    {
+        const Bucket& b = m_buckets[bucket];
+        if (b.entry >= 0 && b.hash == hash && m_equal(m_entries[b.entry].m_key, key)) // Found key
+            break;
+        bucket = Probing::next(bucket, step, mask);
+    }
+    if (probes != nullptr)
+        *probes = (int)step;
+    return bucket;
 }
 
-template<typename KeyType, typename ValueType>
-void ExpandableHashMap<KeyType, ValueType>::expandMap(unsigned int size)
+template<typename KeyType, typename ValueType, typename Hash, typename Equal, typename Probing, typename Growth>
+void ExpandableHashMap<KeyType, ValueType, Hash, Equal, Probing, Growth>::expandMap(size_t size)
 {
-    // Record old num of buckets and set data member to new size
-    unsigned int oldNumBuckets = m_numBuckets;
-    m_numBuckets = size;
-    
-    std::list<Node>* newMap = new std::list<Node>[size]; // Create new array of linked lists of new size
-    
-    for (int i = 0; i < oldNumBuckets; i++) // Loop through all buckets in old array
+    Bucket empty = { 0, EMPTY };
+    std::vector<Bucket> newBuckets(size, empty); // Create new array of new size
+    for (const Bucket& b : m_buckets) // Move every live bucket to its place in the new array
     {
-        auto it = m_map[i].begin(); // Make new iterator to point to first list element
-        while(it != m_map[i].end()) // Loop through all nodes in list for each bucket
-        {
-            unsigned int newBucket = getBucketNum(it->m_key); // Get new bucket number
-            newMap[newBucket].splice(newMap[newBucket].end(), m_map[i], it); // Insert current item into new bucket in new map
-            it = m_map[i].begin(); // Reset iterator to start of map because splice removes item from original list
-        }
+        if (b.entry < 0) // Removed buckets don't come along
+            continue;
+        size_t bucket = b.hash & (size - 1);
+        for (size_t step = 1; newBuckets[bucket].entry != EMPTY; step++) // No duplicates, so just find an empty bucket
+            bucket = Probing::next(bucket, step, size - 1);
+        newBuckets[bucket] = b;
     }
-    
-    delete[] m_map; // Delete old map
-    
-    m_map = newMap; // Assign new map to Data Member
+    m_buckets.swap(newBuckets);
+    m_used = m_entries.size();
 }
+
+#endif /* ExpandableHashMap_h */
@@ -1,12 +1,17 @@
 #include "provided.h"
+#include "support.h"
 #include <list>
 
-#include <set>
-#include <map>
+#include <vector>
+#include <queue>
+#include <functional> // For greater
+#include <utility> // For pair
+#include <algorithm> // For reverse
 #include <cmath> // For distance calculations
 #include <float.h> // For DBL_MAX
 
 #include <iostream>
+#include <chrono>
 
 using namespace std;
 
@@ -20,33 +25,118 @@ public:
         const GeoCoord& end,
         list<StreetSegment>& route,
         double& totalDistanceTravelled) const;
-    
+    DeliveryResult generatePointToPointPath(
+        const GeoCoord& start,
+        const GeoCoord& end,
+        RoutePath& path) const;
+    DeliveryResult generateApproximatePath(
+        const GeoCoord& start,
+        const GeoCoord& end,
+        double bound,
+        RoutePath& path,
+        double& suboptimality) const;
+    bool registerDepot(const GeoCoord& depot);
+    size_t depotMemoryUsage() const;
+    const RouterStats& stats() const;
+    void setArena(MonotonicArena* arena);
+    void setTurnCosts(const TurnCosts& costs);
+    void setChainShortcuts(bool enabled);
+
 private:
     // Private structs
-    struct DoubleMaxVal // Default starting g/f values for A Star (double max value)
+    struct ShortestPathTree // Shortest paths from (or to) one root node
+    {
+        vector<int> parentEdge; // Edge joining each node to the tree (-1 if none)
+        vector<double> dist; // Cost of each node's path (DBL_MAX if unreachable)
+    };
+    struct DepotTrees // Shortest path trees rooted at a registered depot
+    {
+        int depot; // Node id of the depot
+        ShortestPathTree fromDepot; // parentEdge is the edge used to reach each node from the depot
+        ShortestPathTree toDepot; // parentEdge is the first edge on each node's path back to the depot
+        size_t bytes; // Memory held by this entry
+    };
+    typedef pair<double, int> QueueEntry; // (f score, node)
+    struct TurnQueueEntry // Searching edges, the g score comes along so stale entries are spotted without the heuristic
     {
-        DoubleMaxVal() {score = DBL_MAX;}
-        double score;
+        double f, g;
+        int edge;
+        bool operator>(const TurnQueueEntry& other) const { return f > other.f; }
     };
-    struct CoordSegPair // To store both previous coord and segment in traceback map
+    template <typename Entry>
+    struct Heap : priority_queue<Entry, ArenaVector<Entry>, greater<Entry>> // Lowest f score first
     {
-        CoordSegPair()
+        Heap(MonotonicArena* arena = nullptr)
+         : priority_queue<Entry, ArenaVector<Entry>, greater<Entry>>(greater<Entry>(), ArenaVector<Entry>(ArenaAllocator<Entry>(arena))) {}
+        void clear() { this->c.clear(); } // Empty it but keep the space
+        const ArenaVector<Entry>& entries() const { return this->c; } // Everything still queued, in heap order
+    };
+    typedef Heap<QueueEntry> OpenSet;
+    typedef Heap<TurnQueueEntry> TurnOpenSet;
+    struct TurnPrices // m_turnCosts in edge weight units
+    {
+        double left, right, uTurn;
+        float minAngle, maxAngle;
+        double forAngle(float angle) const { return angle < minAngle || angle > maxAngle ? 0 : angle < 180 ? left : right; }
+        double penalty(const StreetGraph& graph, int e, int next) const // Same as the turn graph gives for next after e
         {
-            coord = GeoCoord();
-            seg = StreetSegment();
+            return next == (e ^ 1) ? uTurn : forAngle((float)TurnGraph::turnAngle(graph, e, next));
         }
-        GeoCoord coord;
-        StreetSegment seg;
     };
     // Data members
     const StreetMap* m_streetMap;
+    const StreetGraph& m_graph;
+    // Trees are patched for map changes lazily by the (const) route queries, hence mutable
+    mutable vector<DepotTrees> m_depots; // Few depots, so a linear scan beats hashing
+    mutable size_t m_depotBytes; // Running total of DepotTrees::bytes
+    mutable size_t m_changesSeen; // How many of the graph's logged changes the trees include
+    mutable RouterStats m_stats; // Only filled in when built with GOOBEREATS_STATS
+    // A Star scratch space, kept between queries so a plan's legs share one allocation
+    mutable ArenaVector<double> m_gScore; // Best known distance from start to each node
+    mutable ArenaVector<int> m_cameFrom; // Edge used to reach each node so we can trace back
+    mutable OpenSet m_openSet; // Nodes we are going to explore
+    // Routing with turn costs, searching edges instead of nodes
+    TurnCosts m_turnCosts;
+    mutable TurnGraph m_ownTurnGraph; // Only built if the map has no turn graph of its own
+    mutable ArenaVector<double> m_edgeScore; // Best known cost from start to the end of each edge
+    mutable ArenaVector<int> m_edgeParent; // Edge before each edge on its best route (-1 for the first)
+    mutable ArenaVector<int> m_edgeVia; // How findChainTurnPath got to each edge from its parent
+    mutable TurnOpenSet m_turnOpenSet;
+    mutable ArenaVector<int> m_touchedEdges; // Edges the last search scored, so only they need resetting
+    mutable WeightPerMile m_weightPerMile; // For findChainTurnPath, which doesn't need a turn graph
+    bool m_chainShortcuts; // Whether A Star runs over the map's chain graph
     // Private Member Functions
-    double distance(const GeoCoord& start, const GeoCoord& end) const; // Returns euclidean distance between two coords
+    // Shortest path search continuing from the nodes in openSet, over gScore/parentEdge which may already
+    // hold part of a tree. If target is -1 this is Dijkstra and runs until openSet is empty, otherwise an
+    // A Star that stops at target, with its heuristic scaled by heuristicWeight (above 1 for weighted A Star,
+    // which expands fewer nodes but may settle for a longer path). With reverse set, edges are followed
+    // backwards so the tree gives paths *to* its root instead of from it.
+    void search(OpenSet& openSet, int target, bool reverse, double* gScore, int* parentEdge, double heuristicWeight = 1) const;
+    void growTree(int root, bool reverse, ShortestPathTree& tree) const; // Full tree from scratch
+    void patchTree(int edge, bool reverse, ShortestPathTree& tree) const; // Fix tree after edge's cost changed
+    void catchUp() const; // Patch depot trees for map changes made since they were last used
+    const DepotTrees* findDepot(int node) const;
+    size_t treeBytes(const DepotTrees& trees) const;
+    // generatePointToPointPath without the timing. A Star's heuristic is scaled by bound, and suboptimality
+    // gets the factor the path found is guaranteed to be within.
+    DeliveryResult findPath(const GeoCoord& start, const GeoCoord& end, double bound, RoutePath& path, double& suboptimality) const;
+    // findPath with turn costs, for node ids already looked up
+    DeliveryResult findTurnPath(int startNode, int endNode, double bound, RoutePath& path, double& suboptimality) const;
+    // findTurnPath over the map's chain graph, for exact routes: finds a route of the same cost but
+    // only expands the edges that end chains
+    DeliveryResult findChainTurnPath(const ChainGraph& chains, int startNode, int endNode, RoutePath& path) const;
+    const TurnGraph& turnGraph() const; // The map's turn graph, or our own if it has none
+    TurnPrices turnPrices(double weightPerMile) const;
+    void resetEdgeScores() const; // Sets every m_edgeScore to DBL_MAX and m_edgeParent to -1
+    // findPath's A Star over the map's chain graph, for node ids already looked up. Finds the same
+    // path as searching the full graph but only expands the nodes where chains end.
+    DeliveryResult findChainPath(const ChainGraph& chains, int startNode, int endNode, RoutePath& path) const;
 };
 
 PointToPointRouterImpl::PointToPointRouterImpl(const StreetMap* sm)
+ : m_streetMap(sm), m_graph(sm->graph()), m_depotBytes(0), m_changesSeen(sm->graph().changes.size()),
+   m_chainShortcuts(true)
 {
-    m_streetMap = sm;
 }
 
 PointToPointRouterImpl::~PointToPointRouterImpl()
@@ -59,80 +149,694 @@ DeliveryResult PointToPointRouterImpl::generatePointToPointRoute(
         list<StreetSegment>& route,
         double& totalDistanceTravelled) const
 {
+    // Find the route as edge ids, then expand it into segments
+    RoutePath path;
+    DeliveryResult result = generatePointToPointPath(start, end, path);
+    if (result == DELIVERY_SUCCESS)
+    {
+        appendSegments(m_graph, path, route); // Append route to the end of the passed route var
+        totalDistanceTravelled += path.miles(); // Add distance to count
+    }
+    return result;
+}
+
+DeliveryResult PointToPointRouterImpl::generatePointToPointPath(
+        const GeoCoord& start,
+        const GeoCoord& end,
+        RoutePath& path) const
+{
+    STATS(auto queryStart = chrono::steady_clock::now();)
+    double suboptimality;
+    DeliveryResult result = findPath(start, end, 1, path, suboptimality);
+    STATS(
+        m_stats.seconds = chrono::duration<double>(chrono::steady_clock::now() - queryStart).count();
+        m_stats.expandedPerQuery.add((double)m_stats.nodesExpanded);
+        m_stats.microsecondsPerQuery.add(m_stats.seconds * 1e6);
+    )
+    return result;
+}
+
+DeliveryResult PointToPointRouterImpl::generateApproximatePath(
+        const GeoCoord& start,
+        const GeoCoord& end,
+        double bound,
+        RoutePath& path,
+        double& suboptimality) const
+{
+    STATS(auto queryStart = chrono::steady_clock::now();)
+    DeliveryResult result = findPath(start, end, max(bound, 1.0), path, suboptimality);
+    STATS(
+        m_stats.seconds = chrono::duration<double>(chrono::steady_clock::now() - queryStart).count();
+        m_stats.expandedPerQuery.add((double)m_stats.nodesExpanded);
+        m_stats.microsecondsPerQuery.add(m_stats.seconds * 1e6);
+    )
+    return result;
+}
+
+DeliveryResult PointToPointRouterImpl::findPath(
+        const GeoCoord& start,
+        const GeoCoord& end,
+        double bound,
+        RoutePath& path,
+        double& suboptimality) const
+{
+    STATS(m_stats.nodesExpanded = m_stats.heapPushes = m_stats.relaxations = 0;)
+    suboptimality = 1; // Exact unless weighted A Star runs below
+    
     // TEST FOR BAD COORDS
-    vector<StreetSegment> temp; // Create temp vector to test if start/end is valid coords using getSegmentsThatStartWith
-    // Try start/end coords
-    if (!m_streetMap->getSegmentsThatStartWith(start, temp) || !m_streetMap->getSegmentsThatStartWith(end, temp))
+    int startNode = m_streetMap->nodeAt(start);
+    int endNode = m_streetMap->nodeAt(end);
+    if (startNode == -1 || endNode == -1)
         return BAD_COORD; // Return if bad coord
-    
+    const ChainGraph* chains = m_streetMap->chainGraph();
+    bool useChains = bound == 1 && m_chainShortcuts && chains->numEdges() == m_graph.numEdges();
+    if (m_turnCosts.enabled())
+        return useChains ? findChainTurnPath(*chains, startNode, endNode, path) : findTurnPath(startNode, endNode, bound, path, suboptimality);
+
+    // DEPOT ROUTING (walk a precomputed tree, no search needed)
+    catchUp();
+    const DepotTrees* depot = findDepot(startNode);
+    const int* parentEdge = nullptr; // Tree to trace the path back through, from end to start
+    if (depot != nullptr) // Starting at a depot, walk back from end to the root of the from-depot tree
+        parentEdge = depot->fromDepot.parentEdge.data();
+    else if ((depot = findDepot(endNode)) != nullptr) // Ending at a depot, follow the to-depot tree from start
+    {
+        const vector<int>& toDepot = depot->toDepot.parentEdge;
+        if (startNode != endNode && toDepot[startNode] == -1)
+            return NO_ROUTE;
+        for (int node = startNode; node != endNode; node = m_graph.edge(toDepot[node]).to)
+            path.append(m_graph, toDepot[node]);
+        return DELIVERY_SUCCESS;
+    }
+
     // A STAR ROUTING
-    // Set up structures for A Star
-    set<GeoCoord> openSet; // Set of nodes we are going to explore
-    map<GeoCoord, CoordSegPair> cameFrom; // Map GeoCoord to CoordSegPair as we traverse a path so we can trace back
-    map<GeoCoord, DoubleMaxVal> gScore; // Map GeoCoord to g score (a double that defaults to infinity/max val)
-    map<GeoCoord, DoubleMaxVal> fScore; // Map GeoCoord to f score (a double that defaults to infinity/max val)
-    
-    openSet.insert(start); // Start node exploration at start coord
-    gScore[start].score = 0; // Set start node g score to 0 because the distance from start to start is 0
-    fScore[start].score = distance(start, end);
-    
-    while (!(openSet.empty())) // Loop while there are more nodes to explore
+    if (parentEdge == nullptr && useChains)
+        return findChainPath(*chains, startNode, endNode, path);
+    if (parentEdge == nullptr)
+    {
+        m_gScore.assign(m_graph.numNodes(), DBL_MAX); // Reuses the space of earlier queries
+        m_cameFrom.assign(m_graph.numNodes(), -1);
+        m_openSet.clear();
+        m_gScore[startNode] = 0;
+        m_openSet.push(QueueEntry(bound * coordDistance(start, end), startNode));
+        STATS(m_stats.heapPushes++;)
+        search(m_openSet, endNode, false, m_gScore.data(), m_cameFrom.data(), bound);
+        parentEdge = m_cameFrom.data();
+        if (bound > 1 && m_gScore[endNode] > 0 && m_gScore[endNode] != DBL_MAX)
+        {
+            // Some node on a shortest path is still queued with its true distance, so the smallest unweighted
+            // f score left is a lower bound on the shortest path's cost
+            double lowerBound = m_gScore[endNode];
+            for (const QueueEntry& entry : m_openSet.entries())
+                lowerBound = min(lowerBound, m_gScore[entry.second] + coordDistance(m_graph.points[entry.second], m_graph.points[endNode]));
+            suboptimality = lowerBound > 0 ? min(bound, m_gScore[endNode] / lowerBound) : bound;
+        }
+    }
+    if (startNode != endNode && parentEdge[endNode] == -1)
+        return NO_ROUTE;  // Return if no route found
+
+    // Reconstruct full path by walking back from end, then flipping it around
+    size_t first = path.size();
+    for (int node = endNode; node != startNode; node = m_graph.edge(parentEdge[node]).from)
+        path.edges.push_back(parentEdge[node]);
+    reverse(path.edges.begin() + first, path.edges.end());
+    for (size_t i = first; i < path.edges.size(); i++) // Fill in running distance
+        path.cumulativeMiles.push_back((i == 0 ? 0 : path.cumulativeMiles[i-1]) + m_graph.miles(path.edges[i]));
+    return DELIVERY_SUCCESS; // Return if we get to the end
+}
+
+bool PointToPointRouterImpl::registerDepot(const GeoCoord& depot)
+{
+    int node = m_streetMap->nodeAt(depot);
+    if (node == -1) // Depot has to be on the map
+        return false;
+    catchUp();
+    if (findDepot(node) != nullptr) // Already registered
+        return true;
+
+    STATS(m_stats.nodesExpanded = m_stats.heapPushes = m_stats.relaxations = 0;)
+    DepotTrees trees;
+    trees.depot = node;
+    growTree(node, false, trees.fromDepot); // Paths out of the depot
+    growTree(node, true, trees.toDepot); // Paths back into the depot
+    trees.bytes = treeBytes(trees);
+    m_depotBytes += trees.bytes;
+    m_depots.push_back(std::move(trees));
+    return true;
+}
+
+size_t PointToPointRouterImpl::depotMemoryUsage() const
+{
+    return m_depotBytes;
+}
+
+const RouterStats& PointToPointRouterImpl::stats() const
+{
+    return m_stats;
+}
+
+void PointToPointRouterImpl::setArena(MonotonicArena* arena)
+{
+    // Drop the old scratch space; the next query gets new space from arena
+    m_gScore = ArenaVector<double>(ArenaAllocator<double>(arena));
+    m_cameFrom = ArenaVector<int>(ArenaAllocator<int>(arena));
+    m_openSet = OpenSet(arena);
+    m_edgeScore = ArenaVector<double>(ArenaAllocator<double>(arena));
+    m_edgeParent = ArenaVector<int>(ArenaAllocator<int>(arena));
+    m_edgeVia = ArenaVector<int>(ArenaAllocator<int>(arena));
+    m_turnOpenSet = TurnOpenSet(arena);
+    m_touchedEdges = ArenaVector<int>(ArenaAllocator<int>(arena));
+}
+
+void PointToPointRouterImpl::setTurnCosts(const TurnCosts& costs)
+{
+    m_turnCosts = costs;
+}
+
+void PointToPointRouterImpl::setChainShortcuts(bool enabled)
+{
+    m_chainShortcuts = enabled;
+}
+
+const TurnGraph& PointToPointRouterImpl::turnGraph() const
+{
+    const TurnGraph* shared = m_streetMap->turnGraph();
+    if (shared != nullptr && shared->numEdges() == m_graph.numEdges())
+        return *shared;
+    if (m_ownTurnGraph.numEdges() == 0) // Build once, then patch in segments added since
+        m_ownTurnGraph.build(m_graph);
+    while (m_ownTurnGraph.numEdges() < m_graph.numEdges())
+        m_ownTurnGraph.addSegment(m_graph, m_ownTurnGraph.numEdges());
+    return m_ownTurnGraph;
+}
+
+PointToPointRouterImpl::TurnPrices PointToPointRouterImpl::turnPrices(double weightPerMile) const
+{
+    TurnPrices prices;
+    prices.left = m_turnCosts.leftTurn * weightPerMile;
+    prices.right = m_turnCosts.rightTurn * weightPerMile;
+    prices.uTurn = m_turnCosts.uTurnCost() * weightPerMile;
+    prices.minAngle = (float)m_turnCosts.minTurnAngle;
+    prices.maxAngle = (float)(360 - m_turnCosts.minTurnAngle);
+    return prices;
+}
+
+void PointToPointRouterImpl::resetEdgeScores() const
+{
+    // There are a lot more edges than a search usually reaches, so rather than clearing every score
+    // only the ones the last search set are put back
+    if ((int)m_edgeScore.size() != m_graph.numEdges())
     {
-        // Get node with lowest f score in openSet
-        auto currentPtr = openSet.begin();
-        GeoCoord current = *(openSet.begin());
-        for (auto it = openSet.begin(); it != openSet.end(); it++) // Loop through all coords in set
+        m_edgeScore.assign(m_graph.numEdges(), DBL_MAX);
+        m_edgeParent.assign(m_graph.numEdges(), -1);
+        m_edgeVia.assign(m_graph.numEdges(), -1);
+    }
+    else
+        for (int e : m_touchedEdges)
         {
-            if (fScore[*it].score < fScore[current].score) // Check if f score of coord in iterator is < than in current
+            m_edgeScore[e] = DBL_MAX;
+            m_edgeParent[e] = -1;
+        }
+    m_touchedEdges.clear();
+    m_turnOpenSet.clear();
+}
+
+DeliveryResult PointToPointRouterImpl::findTurnPath(int startNode, int endNode, double bound, RoutePath& path, double& suboptimality) const
+{
+    suboptimality = 1;
+    if (startNode == endNode)
+        return DELIVERY_SUCCESS;
+    const TurnGraph& turns = turnGraph();
+    TurnPrices prices = turnPrices(turns.weightPerMile.value()); // Penalties in the same units as edge weights
+    const NodePoint& target = m_graph.points[endNode];
+    auto heuristic = [&](const StreetEdge& edge) { // Turns only add cost, so straight line distance still never overestimates
+        return coordDistance(m_graph.points[edge.to], target);
+    };
+
+    // A Star over edges: an edge's score is the cost of the best route that ends by driving along it
+    resetEdgeScores();
+    for (int i = m_graph.adjStart[startNode]; i < m_graph.adjStart[startNode+1]; i++) // No turn onto the first edge
+    {
+        int e = m_graph.adjEdges[i];
+        StreetEdge edge = m_graph.edge(e);
+        if (!edge.usable())
+            continue;
+        m_edgeScore[e] = edge.weight;
+        m_touchedEdges.push_back(e);
+        m_turnOpenSet.push(TurnQueueEntry{edge.weight + bound * heuristic(edge), edge.weight, e});
+        STATS(m_stats.heapPushes++;)
+    }
+    int last = -1; // Edge arriving at endNode
+    while (!m_turnOpenSet.empty())
+    {
+        TurnQueueEntry entry = m_turnOpenSet.top();
+        m_turnOpenSet.pop();
+        int current = entry.edge;
+        if (entry.g > m_edgeScore[current]) // Stale entry, edge was reached more cheaply since
+            continue;
+        if (m_graph.edge(current).to == endNode)
+        {
+            last = current;
+            break;
+        }
+        STATS(m_stats.nodesExpanded++;)
+
+        for (int i = turns.turnStart[current]; i < turns.turnStart[current+1]; i++)
+        {
+            int next = turns.turnEdges[i];
+            StreetEdge nextEdge = m_graph.edge(next);
+            if (!nextEdge.usable())
+                continue;
+            double penalty = next == (current ^ 1) ? prices.uTurn : prices.forAngle(turns.turnAngles[i]);
+            double score = entry.g + penalty + nextEdge.weight;
+            if (score < m_edgeScore[next])
             {
-                current = *it; // Set current to coord w/ smaller f score
-                currentPtr = it; // Set currentPtr to point to coord w/ smaller f score
+                if (m_edgeScore[next] == DBL_MAX)
+                    m_touchedEdges.push_back(next);
+                m_edgeScore[next] = score;
+                m_edgeParent[next] = current;
+                m_turnOpenSet.push(TurnQueueEntry{score + bound * heuristic(nextEdge), score, next});
+                STATS(m_stats.relaxations++; m_stats.heapPushes++;)
             }
         }
-        
-        // Check if we found end
-        if (current == end)
+    }
+    if (last == -1)
+        return NO_ROUTE;
+    if (bound > 1) // Same lower bound as in findPath
+    {
+        double lowerBound = m_edgeScore[last];
+        for (const TurnQueueEntry& entry : m_turnOpenSet.entries())
+            lowerBound = min(lowerBound, m_edgeScore[entry.edge] + heuristic(m_graph.edge(entry.edge)));
+        suboptimality = lowerBound > 0 ? min(bound, m_edgeScore[last] / lowerBound) : bound;
+    }
+
+    // Walk back through the parent edges, then flip the new part of the path around
+    size_t first = path.size();
+    for (int e = last; e != -1; e = m_edgeParent[e])
+        path.edges.push_back(e);
+    reverse(path.edges.begin() + first, path.edges.end());
+    for (size_t i = first; i < path.edges.size(); i++) // Fill in running distance
+        path.cumulativeMiles.push_back((i == 0 ? 0 : path.cumulativeMiles[i-1]) + m_graph.miles(path.edges[i]));
+    return DELIVERY_SUCCESS;
+}
+
+DeliveryResult PointToPointRouterImpl::findChainTurnPath(const ChainGraph& chains, int startNode, int endNode, RoutePath& path) const
+{
+    if (startNode == endNode)
+        return DELIVERY_SUCCESS;
+    m_weightPerMile.count(m_graph, m_graph.numEdges()); // Count any segments added since the last search
+    TurnPrices prices = turnPrices(m_weightPerMile.value());
+    const NodePoint& target = m_graph.points[endNode];
+    auto heuristic = [&](int e) {
+        return coordDistance(m_graph.points[m_graph.edge(e).to], target);
+    };
+
+    // Same A Star over edges as findTurnPath, but the only edges scored are the last ones of shortcuts,
+    // arriving at chain ends: an interior node has just its two neighbors, so there the only choices
+    // are to drive on or turn around. m_edgeVia holds how an edge was reached from its parent:
+    //   s       all of shortcut s, if the edge is its last
+    //   s       into shortcut s as far as its first interior node, then a U-turn back, if the edge
+    //           is the twin of s's first (turning around any further in only costs more)
+    //   -2 - s  the part of shortcut s after an interior startNode
+    // An interior endNode is scored on the way past into endScore, and queued as edge -1.
+    resetEdgeScores();
+    double endScore = DBL_MAX;
+    int endParent = -1, endVia = -1, endPosition = 0;
+    int endShortcut = chains.interior(endNode) ? chains.nodeShortcut[endNode] : -1;
+    auto relax = [&](int e, double score, int parent, int via) {
+        if (score < m_edgeScore[e])
+        {
+            if (m_edgeScore[e] == DBL_MAX)
+                m_touchedEdges.push_back(e);
+            m_edgeScore[e] = score;
+            m_edgeParent[e] = parent;
+            m_edgeVia[e] = via;
+            m_turnOpenSet.push(TurnQueueEntry{score + heuristic(e), score, e});
+            STATS(m_stats.relaxations++; m_stats.heapPushes++;)
+        }
+    };
+    // Drive along shortcut s from its edge p on, coming off edge before (-1 at the start). Penalties and
+    // weights are added one edge at a time in the same order findTurnPath adds them, so scores match.
+    auto follow = [&](int s, int p, int before, double score, int parent, int via) {
+        const ChainGraph::Shortcut& shortcut = chains.shortcuts[s];
+        int endAt = (s | 1) == (endShortcut | 1) ? chains.position(endNode, s) : -1;
+        for (; p < shortcut.count; p++)
         {
-            // Reconstruct full path
-            list<StreetSegment> tempRoute; // Construct temp route list to store current route
-            while (cameFrom.find(current) != cameFrom.end()) // Loop while current coord is still in trackback path
+            if (p == endAt && score < endScore)
             {
-                tempRoute.push_front(cameFrom[current].seg); // Push current seg to front of tempRoute
-                totalDistanceTravelled += distanceEarthMiles(cameFrom[current].coord, current); // Add distance to count
-                current = cameFrom[current].coord; // Go back one coord on path
+                endScore = score;
+                endParent = parent;
+                endVia = via;
+                endPosition = p;
+                m_turnOpenSet.push(TurnQueueEntry{score, score, -1});
+                STATS(m_stats.heapPushes++;)
             }
-            route.splice(route.end(), tempRoute); // Append tempRoute to the end of the passed route var
-            return DELIVERY_SUCCESS; // Return if we get to the end
-        }
-        
-        openSet.erase(currentPtr); // Erase current coord from set
-        // Get segments connected to current coord
-        vector<StreetSegment> neighborSegs;
-        m_streetMap->getSegmentsThatStartWith(current, neighborSegs);
-        
-        for (size_t i = 0; i < neighborSegs.size(); i++) // Loop through every connected seg
-        {
-            GeoCoord neighborCoord = neighborSegs[i].end;
-            double tempGScore = gScore[current].score + distance(current, neighborCoord); // Calculate gScore of neighbor through current coord
-            if (tempGScore < gScore[neighborCoord].score) // Check if tempGScore is better than currently stored g score (better path)
+            int e = chains.chainEdges[shortcut.first + p];
+            StreetEdge edge = m_graph.edge(e);
+            if (!edge.usable()) // Closed or removed, so the rest of the chain can't be reached this way
+                return;
+            if (before != -1)
+                score += prices.penalty(m_graph, before, e);
+            score += edge.weight;
+            before = e;
+        }
+        relax(before, score, parent, via);
+    };
+    auto turnBack = [&](int s, int before, double score, int parent) {
+        const ChainGraph::Shortcut& shortcut = chains.shortcuts[s];
+        if (shortcut.count < 2) // Its far end is a chain end, where turning around is an ordinary turn
+            return;
+        int e = chains.chainEdges[shortcut.first];
+        StreetEdge out = m_graph.edge(e);
+        StreetEdge back = m_graph.edge(e ^ 1);
+        if (!out.usable() || !back.usable())
+            return;
+        score += prices.penalty(m_graph, before, e);
+        score += out.weight;
+        score += prices.uTurn;
+        score += back.weight;
+        relax(e ^ 1, score, parent, s);
+    };
+
+    if (chains.interior(startNode)) // Head both ways along its chain
+    {
+        int s = chains.nodeShortcut[startNode];
+        follow(s, chains.position(startNode, s), -1, 0, -1, -2 - s);
+        follow(s ^ 1, chains.position(startNode, s ^ 1), -1, 0, -1, -2 - (s ^ 1));
+    }
+    else
+        for (int i = chains.adjStart[startNode]; i < chains.adjStart[startNode+1]; i++)
+            follow(chains.adjShortcuts[i], 0, -1, 0, -1, chains.adjShortcuts[i]);
+    int last = -1; // Edge arriving at endNode, if it's a chain end
+    bool reachedEnd = false; // Whether an interior endNode was reached
+    while (!m_turnOpenSet.empty())
+    {
+        TurnQueueEntry entry = m_turnOpenSet.top();
+        m_turnOpenSet.pop();
+        int current = entry.edge;
+        if (current == -1)
+        {
+            if (entry.g > endScore) // Stale, endNode was reached more cheaply since
+                continue;
+            reachedEnd = true;
+            break;
+        }
+        if (entry.g > m_edgeScore[current]) // Stale entry
+            continue;
+        int node = m_graph.edge(current).to;
+        if (node == endNode)
+        {
+            last = current;
+            break;
+        }
+        STATS(m_stats.nodesExpanded++;)
+        for (int i = chains.adjStart[node]; i < chains.adjStart[node+1]; i++)
+        {
+            int s = chains.adjShortcuts[i];
+            follow(s, 0, current, entry.g, current, s);
+            turnBack(s, current, entry.g, current);
+        }
+    }
+    if (last == -1 && !reachedEnd)
+        return NO_ROUTE;
+
+    // Unpack each step walking back from the end, then flip the new part of the path around
+    size_t first = path.size();
+    auto unpack = [&](int s, int begin, int end) { // Edges begin up to end of shortcut s, backwards
+        for (int p = end - 1; p >= begin; p--)
+            path.edges.push_back(chains.chainEdges[chains.shortcuts[s].first + p]);
+    };
+    int state = last;
+    if (reachedEnd)
+    {
+        int s = endVia >= 0 ? endVia : -2 - endVia;
+        unpack(s, endVia >= 0 ? 0 : chains.position(startNode, s), endPosition);
+        state = endParent;
+    }
+    for (; state != -1; state = m_edgeParent[state])
+    {
+        int via = m_edgeVia[state];
+        int s = via >= 0 ? via : -2 - via;
+        const ChainGraph::Shortcut& shortcut = chains.shortcuts[s];
+        if (via < 0)
+            unpack(s, chains.position(startNode, s), shortcut.count);
+        else if (chains.chainEdges[shortcut.first + shortcut.count - 1] == state)
+            unpack(s, 0, shortcut.count);
+        else // Turned back: out along state's twin and back along state
+        {
+            path.edges.push_back(state);
+            path.edges.push_back(state ^ 1);
+        }
+    }
+    reverse(path.edges.begin() + first, path.edges.end());
+    for (size_t i = first; i < path.edges.size(); i++) // Fill in running distance
+        path.cumulativeMiles.push_back((i == 0 ? 0 : path.cumulativeMiles[i-1]) + m_graph.miles(path.edges[i]));
+    return DELIVERY_SUCCESS;
+}
+
+DeliveryResult PointToPointRouterImpl::findChainPath(const ChainGraph& chains, int startNode, int endNode, RoutePath& path) const
+{
+    if (startNode == endNode)
+        return DELIVERY_SUCCESS;
+    const NodePoint& target = m_graph.points[endNode];
+    auto heuristic = [&](int node) {
+        return coordDistance(m_graph.points[node], target);
+    };
+    // Only chain ends and endNode get scores. m_cameFrom holds the shortcut each was reached along, or
+    // -2 - shortcut if that was only the part of it after an interior startNode.
+    m_gScore.assign(m_graph.numNodes(), DBL_MAX);
+    m_cameFrom.assign(m_graph.numNodes(), -1);
+    m_openSet.clear();
+    auto relax = [&](int node, double score, int from) {
+        if (score < m_gScore[node])
+        {
+            m_gScore[node] = score;
+            m_cameFrom[node] = from;
+            m_openSet.push(QueueEntry(score + heuristic(node), node));
+            STATS(m_stats.relaxations++; m_stats.heapPushes++;)
+        }
+    };
+    // Drive along shortcut s from its edge p on, adding up edge weights one at a time just as a search
+    // of the full graph would, so scores match it exactly. An interior endNode is scored on the way past.
+    int endShortcut = chains.interior(endNode) ? chains.nodeShortcut[endNode] : -1;
+    auto follow = [&](int s, int p, double score, int from) {
+        const ChainGraph::Shortcut& shortcut = chains.shortcuts[s];
+        int endAt = (s | 1) == (endShortcut | 1) ? chains.position(endNode, s) : -1;
+        for (; p < shortcut.count; p++)
+        {
+            if (p == endAt)
+                relax(endNode, score, from);
+            StreetEdge edge = m_graph.edge(chains.chainEdges[shortcut.first + p]);
+            if (!edge.usable()) // Closed or removed, so the rest of the chain can't be reached this way
+                return;
+            score += edge.weight;
+        }
+        relax(shortcut.to, score, from);
+    };
+
+    m_gScore[startNode] = 0;
+    if (chains.interior(startNode)) // Head both ways along its chain
+    {
+        int s = chains.nodeShortcut[startNode];
+        follow(s, chains.position(startNode, s), 0, -2 - s);
+        follow(s ^ 1, chains.position(startNode, s ^ 1), 0, -2 - (s ^ 1));
+    }
+    else
+    {
+        m_openSet.push(QueueEntry(heuristic(startNode), startNode));
+        STATS(m_stats.heapPushes++;)
+    }
+    while (!m_openSet.empty())
+    {
+        QueueEntry entry = m_openSet.top();
+        m_openSet.pop();
+        int current = entry.second;
+        if (entry.first > m_gScore[current] + heuristic(current)) // Stale entry
+            continue;
+        if (current == endNode)
+            break;
+        STATS(m_stats.nodesExpanded++;)
+        for (int i = chains.adjStart[current]; i < chains.adjStart[current+1]; i++)
+            follow(chains.adjShortcuts[i], 0, m_gScore[current], chains.adjShortcuts[i]);
+    }
+    if (m_cameFrom[endNode] == -1)
+        return NO_ROUTE;
+
+    // Unpack the shortcuts walking back from end, then flip the new part of the path around
+    size_t first = path.size();
+    for (int node = endNode; node != startNode; )
+    {
+        int from = m_cameFrom[node];
+        int s = from >= 0 ? from : -2 - from;
+        const ChainGraph::Shortcut& shortcut = chains.shortcuts[s];
+        int begin = from >= 0 ? 0 : chains.position(startNode, s);
+        int end = node == endNode && endShortcut != -1 ? chains.position(endNode, s) : shortcut.count;
+        for (int p = end - 1; p >= begin; p--)
+            path.edges.push_back(chains.chainEdges[shortcut.first + p]);
+        node = from >= 0 ? shortcut.from : startNode;
+    }
+    reverse(path.edges.begin() + first, path.edges.end());
+    for (size_t i = first; i < path.edges.size(); i++) // Fill in running distance
+        path.cumulativeMiles.push_back((i == 0 ? 0 : path.cumulativeMiles[i-1]) + m_graph.miles(path.edges[i]));
+    return DELIVERY_SUCCESS;
+}
+
+void PointToPointRouterImpl::search(OpenSet& openSet, int target, bool reverse, double* gScore, int* parentEdge, double heuristicWeight) const
+{
+    // Heuristic is straight line distance to target (zero for a full search)
+    auto heuristic = [&](int node) {
+        return target == -1 ? 0.0 : heuristicWeight * coordDistance(m_graph.points[node], m_graph.points[target]);
+    };
+
+    while (!openSet.empty()) // Loop while there are more nodes to explore
+    {
+        QueueEntry entry = openSet.top(); // Get node with lowest f score
+        openSet.pop();
+        int current = entry.second;
+        if (entry.first > gScore[current] + heuristic(current)) // Stale entry, node was reached more cheaply since
+            continue;
+        if (current == target) // Check if we found end
+            return;
+        STATS(m_stats.nodesExpanded++;)
+
+        for (int i = m_graph.adjStart[current]; i < m_graph.adjStart[current+1]; i++) // Loop through every connected edge
+        {
+            // Going backwards we want the edge from the neighbor into current, which is the reverse of this one
+            int edge = reverse ? (m_graph.adjEdges[i] ^ 1) : m_graph.adjEdges[i];
+            if (!m_graph.edge(edge).usable()) // Closed or removed
+                continue;
+            int neighbor = reverse ? m_graph.edge(edge).from : m_graph.edge(edge).to;
+            double tempGScore = gScore[current] + m_graph.edge(edge).weight; // Calculate g score of neighbor through current
+            if (tempGScore < gScore[neighbor]) // Check if this is a better path
             {
-                cameFrom[neighborCoord].coord = current; // Record coord in path so far
-                cameFrom[neighborCoord].seg = neighborSegs[i]; // Record segment in path so far
-                gScore[neighborCoord].score = tempGScore; // Update gScore
-                fScore[neighborCoord].score = gScore[neighborCoord].score + distance(neighborCoord, end); // Update fScore
-                if (openSet.find(neighborCoord) == openSet.end()) // If openSet doesn't have the neighbor coord
-                    openSet.insert(neighborCoord); // Add neighbor coord to openSet
+                gScore[neighbor] = tempGScore;
+                parentEdge[neighbor] = edge; // Record edge in path so far
+                openSet.push(QueueEntry(tempGScore + heuristic(neighbor), neighbor));
+                STATS(m_stats.relaxations++; m_stats.heapPushes++;)
             }
         }
     }
-    
-    return NO_ROUTE;  // Return if no route found
 }
 
-double PointToPointRouterImpl::distance(const GeoCoord& start, const GeoCoord& end) const
+void PointToPointRouterImpl::growTree(int root, bool reverse, ShortestPathTree& tree) const
 {
-    // Uses pythagorean theorem
-    return abs(sqrt(pow((end.latitude - start.latitude), 2.0) +  pow((end.longitude - start.longitude), 2.0)));
+    tree.dist.assign(m_graph.numNodes(), DBL_MAX);
+    tree.parentEdge.assign(m_graph.numNodes(), -1);
+    tree.dist[root] = 0;
+    OpenSet openSet;
+    openSet.push(QueueEntry(0, root));
+    STATS(m_stats.heapPushes++;)
+    search(openSet, -1, reverse, tree.dist.data(), tree.parentEdge.data());
+}
+
+void PointToPointRouterImpl::patchTree(int edge, bool reverse, ShortestPathTree& tree) const
+{
+    // Within the tree every edge leads from a tail node to a head node (backwards for a reverse tree)
+    StreetEdge e = m_graph.edge(edge);
+    int tail = reverse ? e.to : e.from;
+    int head = reverse ? e.from : e.to;
+    OpenSet openSet;
+
+    // If the edge is in the tree and its cost changed, everything below it needs a new path
+    if (tree.parentEdge[head] == edge && tree.dist[head] != tree.dist[tail] + e.cost())
+    {
+        // Mark the subtree: a node is in it if following parent edges up from it reaches head
+        vector<char> state(m_graph.numNodes(), 0); // 0 unknown, 1 in subtree, 2 not in subtree
+        state[head] = 1;
+        vector<int> path;
+        for (int n = 0; n < m_graph.numNodes(); n++)
+        {
+            int node = n;
+            while (state[node] == 0 && tree.parentEdge[node] != -1) // Walk up until we hit a node we know about or the root
+            {
+                path.push_back(node);
+                StreetEdge up = m_graph.edge(tree.parentEdge[node]);
+                node = reverse ? up.to : up.from;
+            }
+            char result = state[node] == 1 ? 1 : 2;
+            for (int p : path)
+                state[p] = result;
+            path.clear();
+        }
+
+        // Forget the subtree's paths, then seed each node with its best edge from outside the subtree
+        for (int n = 0; n < m_graph.numNodes(); n++)
+            if (state[n] == 1)
+            {
+                tree.dist[n] = DBL_MAX;
+                tree.parentEdge[n] = -1;
+            }
+        for (int n = 0; n < m_graph.numNodes(); n++)
+        {
+            if (state[n] != 1)
+                continue;
+            for (int i = m_graph.adjStart[n]; i < m_graph.adjStart[n+1]; i++)
+            {
+                int in = reverse ? m_graph.adjEdges[i] : (m_graph.adjEdges[i] ^ 1); // Edge into n within the tree
+                int from = reverse ? m_graph.edge(in).to : m_graph.edge(in).from;
+                if (state[from] == 1 || tree.dist[from] == DBL_MAX || !m_graph.edge(in).usable())
+                    continue;
+                if (tree.dist[from] + m_graph.edge(in).weight < tree.dist[n])
+                {
+                    tree.dist[n] = tree.dist[from] + m_graph.edge(in).weight;
+                    tree.parentEdge[n] = in;
+                }
+            }
+            if (tree.dist[n] != DBL_MAX)
+            {
+                openSet.push(QueueEntry(tree.dist[n], n));
+                STATS(m_stats.heapPushes++;)
+            }
+        }
+    }
+    // If the edge now gives a shorter path to head, take it
+    else if (e.usable() && tree.dist[tail] != DBL_MAX && tree.dist[tail] + e.weight < tree.dist[head])
+    {
+        tree.dist[head] = tree.dist[tail] + e.weight;
+        tree.parentEdge[head] = edge;
+        openSet.push(QueueEntry(tree.dist[head], head));
+        STATS(m_stats.heapPushes++;)
+    }
+    search(openSet, -1, reverse, tree.dist.data(), tree.parentEdge.data()); // Spread the new paths
+}
+
+void PointToPointRouterImpl::catchUp() const
+{
+    if (m_changesSeen == m_graph.changes.size())
+        return;
+    for (DepotTrees& trees : m_depots)
+    {
+        ShortestPathTree* both[2] = { &trees.fromDepot, &trees.toDepot };
+        for (ShortestPathTree* tree : both) // Make room for nodes added since the tree was grown
+        {
+            tree->dist.resize(m_graph.numNodes(), DBL_MAX);
+            tree->parentEdge.resize(m_graph.numNodes(), -1);
+        }
+        for (size_t c = m_changesSeen; c < m_graph.changes.size(); c++)
+            for (int half = 0; half < 2; half++) // Segment changes apply to both directions
+            {
+                patchTree(m_graph.changes[c].edge + half, false, trees.fromDepot);
+                patchTree(m_graph.changes[c].edge + half, true, trees.toDepot);
+            }
+        m_depotBytes -= trees.bytes;
+        trees.bytes = treeBytes(trees);
+        m_depotBytes += trees.bytes;
+    }
+    m_changesSeen = m_graph.changes.size();
+}
+
+const PointToPointRouterImpl::DepotTrees* PointToPointRouterImpl::findDepot(int node) const
+{
+    for (const DepotTrees& trees : m_depots)
+        if (trees.depot == node)
+            return &trees;
+    return nullptr;
+}
+
+size_t PointToPointRouterImpl::treeBytes(const DepotTrees& trees) const
+{
+    return sizeof(DepotTrees) + (trees.fromDepot.parentEdge.capacity() + trees.toDepot.parentEdge.capacity()) * sizeof(int)
+        + (trees.fromDepot.dist.capacity() + trees.toDepot.dist.capacity()) * sizeof(double);
 }
 
 //******************** PointToPointRouter functions ***************************
@@ -158,3 +862,51 @@ DeliveryResult PointToPointRouter::generatePointToPointRoute(
 {
     return m_impl->generatePointToPointRoute(start, end, route, totalDistanceTravelled);
 }
+
+DeliveryResult PointToPointRouter::generatePointToPointPath(
+        const GeoCoord& start,
+        const GeoCoord& end,
+        RoutePath& path) const
+{
+    return m_impl->generatePointToPointPath(start, end, path);
+}
+
+DeliveryResult PointToPointRouter::generateApproximatePath(
+        const GeoCoord& start,
+        const GeoCoord& end,
+        double bound,
+        RoutePath& path,
+        double& suboptimality) const
+{
+    return m_impl->generateApproximatePath(start, end, bound, path, suboptimality);
+}
+
+bool PointToPointRouter::registerDepot(const GeoCoord& depot)
+{
+    return m_impl->registerDepot(depot);
+}
+
+size_t PointToPointRouter::depotMemoryUsage() const
+{
+    return m_impl->depotMemoryUsage();
+}
+
+const RouterStats& PointToPointRouter::stats() const
+{
+    return m_impl->stats();
+}
+
+void PointToPointRouter::setArena(MonotonicArena* arena)
+{
+    m_impl->setArena(arena);
+}
+
+void PointToPointRouter::setTurnCosts(const TurnCosts& costs)
+{
+    m_impl->setTurnCosts(costs);
+}
+
+void PointToPointRouter::setChainShortcuts(bool enabled)
+{
+    m_impl->setChainShortcuts(enabled);
+}
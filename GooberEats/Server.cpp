@@ -0,0 +1,532 @@
+#include "provided.h"
+#include "support.h"
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+using namespace std;
+
+// Long running planner: GooberEats -serve mapdata.txt [threads]
+//
+// Reads one JSON request per line on stdin and writes one JSON response per line on stdout, in the
+// same order. A request looks like
+//   {"id":7,"depot":{"lat":"34.0625329","lon":"-118.4470263"},"snap":false,
+//    "deliveries":[{"item":"Chicken tenders","lat":"34.0712323","lon":"-118.4505969"}]}
+// Coords may be strings or numbers; either way their text is used as is, like in a deliveries file.
+// The response is
+//   {"id":7,"status":"ok","miles":2.41,"ms":0.83,"commands":["Proceed north on ...", ...]}
+// or {"id":7,"status":"error","error":"..."} with error BAD_COORD, NO_ROUTE or a parse message.
+// With "geometry":true in the request the response also has the route to draw, as an encoded
+// polyline at 5 decimal places and the miles of each leg:
+//   ..,"polyline":"_p~iF~ps|U_ulLnnqC..","leg_miles":[0.83,1.02,0.56]}
+//
+// Parsing, planning and writing run on separate threads connected by queues, so reading the next
+// request and writing the last response overlap with planning. Planning itself can use several threads.
+
+//******************** BlockingQueue ******************************************
+
+// Bounded queue between pipeline stages. pop blocks until an item arrives or the queue is closed.
+template <typename T>
+class BlockingQueue
+{
+public:
+    BlockingQueue(size_t capacity) : m_capacity(capacity), m_closed(false) {}
+    void push(T item)
+    {
+        unique_lock<mutex> lock(m_mutex);
+        m_notFull.wait(lock, [&] { return m_items.size() < m_capacity; });
+        m_items.push_back(std::move(item));
+        m_notEmpty.notify_one();
+    }
+    bool pop(T& item) // Returns false once the queue is closed and empty
+    {
+        unique_lock<mutex> lock(m_mutex);
+        m_notEmpty.wait(lock, [&] { return !m_items.empty() || m_closed; });
+        if (m_items.empty())
+            return false;
+        item = std::move(m_items.front());
+        m_items.pop_front();
+        m_notFull.notify_one();
+        return true;
+    }
+    void close() // No more pushes; wakes everyone waiting to pop
+    {
+        lock_guard<mutex> lock(m_mutex);
+        m_closed = true;
+        m_notEmpty.notify_all();
+    }
+
+private:
+    size_t m_capacity;
+    bool m_closed;
+    deque<T> m_items;
+    mutex m_mutex;
+    condition_variable m_notEmpty, m_notFull;
+};
+
+//******************** JSON ***************************************************
+
+// Just enough JSON for requests: values are kept as text, and numbers keep the exact text they were
+// written with so coords can be compared the same way as ones read from a file
+struct JsonValue
+{
+    enum Type { NUL, BOOLEAN, NUMBER, STRING, ARRAY, OBJECT };
+    Type type = NUL;
+    string text; // STRING contents, NUMBER text, or "true"/"false"
+    vector<JsonValue> items; // ARRAY elements
+    vector<pair<string, JsonValue>> members; // OBJECT members in order
+
+    const JsonValue* member(const string& name) const
+    {
+        for (const auto& m : members)
+            if (m.first == name)
+                return &m.second;
+        return nullptr;
+    }
+};
+
+class JsonParser
+{
+public:
+    JsonParser(const string& text) : m_text(text), m_pos(0), m_depth(0), m_tooDeep(false) {}
+    bool parse(JsonValue& value, string& error) // Whole text must be one value
+    {
+        if (!parseValue(value) || (skipSpace(), m_pos != m_text.size()))
+        {
+            error = m_tooDeep ? "JSON nested too deeply" : "bad JSON at character " + to_string(m_pos);
+            return false;
+        }
+        return true;
+    }
+
+private:
+    static const int MAX_DEPTH = 64; // Arrays and objects nest by recursion, so a line can't be allowed to go on forever
+    const string& m_text;
+    size_t m_pos;
+    int m_depth; // Arrays and objects open around the current position
+    bool m_tooDeep;
+
+    void skipSpace()
+    {
+        while (m_pos < m_text.size() && (m_text[m_pos] == ' ' || m_text[m_pos] == '\t' || m_text[m_pos] == '\r' || m_text[m_pos] == '\n'))
+            m_pos++;
+    }
+    bool consume(char c)
+    {
+        skipSpace();
+        if (m_pos < m_text.size() && m_text[m_pos] == c)
+        {
+            m_pos++;
+            return true;
+        }
+        return false;
+    }
+    bool parseValue(JsonValue& value)
+    {
+        skipSpace();
+        if (m_pos >= m_text.size())
+            return false;
+        char c = m_text[m_pos];
+        if (c == '{' || c == '[')
+        {
+            if (m_depth == MAX_DEPTH)
+            {
+                m_tooDeep = true;
+                return false;
+            }
+            m_depth++;
+            bool parsed = c == '{' ? parseObject(value) : parseArray(value);
+            m_depth--;
+            return parsed;
+        }
+        if (c == '"')
+        {
+            value.type = JsonValue::STRING;
+            return parseString(value.text);
+        }
+        if (c == '-' || (c >= '0' && c <= '9'))
+        {
+            value.type = JsonValue::NUMBER;
+            size_t start = m_pos;
+            while (m_pos < m_text.size() && string("+-.eE0123456789").find(m_text[m_pos]) != string::npos)
+                m_pos++;
+            value.text = m_text.substr(start, m_pos - start);
+            return true;
+        }
+        const char* words[] = { "true", "false", "null" };
+        for (const char* word : words)
+            if (m_text.compare(m_pos, strlen(word), word) == 0)
+            {
+                m_pos += strlen(word);
+                value.type = word[0] == 'n' ? JsonValue::NUL : JsonValue::BOOLEAN;
+                value.text = word;
+                return true;
+            }
+        return false;
+    }
+    bool parseHex4(unsigned int& code) // The four hex digits of a \u escape
+    {
+        if (m_pos + 4 > m_text.size())
+            return false;
+        code = 0;
+        for (int i = 0; i < 4; i++)
+        {
+            char c = m_text[m_pos++];
+            int digit = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+            if (digit < 0)
+                return false;
+            code = code * 16 + digit;
+        }
+        return true;
+    }
+    bool parseString(string& out)
+    {
+        m_pos++; // Opening quote
+        while (m_pos < m_text.size() && m_text[m_pos] != '"')
+        {
+            char c = m_text[m_pos++];
+            if (c != '\\')
+            {
+                out += c;
+                continue;
+            }
+            if (m_pos >= m_text.size())
+                return false;
+            char e = m_text[m_pos++];
+            switch (e)
+            {
+              case 'n': out += '\n'; break;
+              case 't': out += '\t'; break;
+              case 'r': out += '\r'; break;
+              case 'b': out += '\b'; break;
+              case 'f': out += '\f'; break;
+              case 'u':
+              {
+                  unsigned int code;
+                  if (!parseHex4(code))
+                      return false;
+                  if (code >= 0xDC00 && code <= 0xDFFF) // Second half of a pair with no first half
+                      return false;
+                  if (code >= 0xD800 && code <= 0xDBFF) // First half of a surrogate pair; the second must follow
+                  {
+                      unsigned int low;
+                      if (m_text.compare(m_pos, 2, "\\u") != 0)
+                          return false;
+                      m_pos += 2;
+                      if (!parseHex4(low) || low < 0xDC00 || low > 0xDFFF)
+                          return false;
+                      code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+                  }
+                  if (code < 0x80) // Write the code point as UTF-8
+                      out += (char)code;
+                  else if (code < 0x800)
+                  {
+                      out += (char)(0xC0 | (code >> 6));
+                      out += (char)(0x80 | (code & 0x3F));
+                  }
+                  else if (code < 0x10000)
+                  {
+                      out += (char)(0xE0 | (code >> 12));
+                      out += (char)(0x80 | ((code >> 6) & 0x3F));
+                      out += (char)(0x80 | (code & 0x3F));
+                  }
+                  else
+                  {
+                      out += (char)(0xF0 | (code >> 18));
+                      out += (char)(0x80 | ((code >> 12) & 0x3F));
+                      out += (char)(0x80 | ((code >> 6) & 0x3F));
+                      out += (char)(0x80 | (code & 0x3F));
+                  }
+                  break;
+              }
+              default: out += e; break; // \" \\ \/
+            }
+        }
+        if (m_pos >= m_text.size())
+            return false;
+        m_pos++; // Closing quote
+        return true;
+    }
+    bool parseArray(JsonValue& value)
+    {
+        value.type = JsonValue::ARRAY;
+        m_pos++;
+        if (consume(']'))
+            return true;
+        do
+        {
+            value.items.push_back(JsonValue());
+            if (!parseValue(value.items.back()))
+                return false;
+        } while (consume(','));
+        return consume(']');
+    }
+    bool parseObject(JsonValue& value)
+    {
+        value.type = JsonValue::OBJECT;
+        m_pos++;
+        if (consume('}'))
+            return true;
+        do
+        {
+            skipSpace();
+            string name;
+            if (m_pos >= m_text.size() || m_text[m_pos] != '"' || !parseString(name) || !consume(':'))
+                return false;
+            value.members.push_back(make_pair(name, JsonValue()));
+            if (!parseValue(value.members.back().second))
+                return false;
+        } while (consume(','));
+        return consume('}');
+    }
+};
+
+// Appends s as a JSON string literal
+static void appendJsonString(string& out, const string& s)
+{
+    out += '"';
+    for (char c : s)
+    {
+        switch (c)
+        {
+          case '"': out += "\\\""; break;
+          case '\\': out += "\\\\"; break;
+          case '\n': out += "\\n"; break;
+          case '\r': out += "\\r"; break;
+          case '\t': out += "\\t"; break;
+          default:
+            if ((unsigned char)c < 0x20)
+            {
+                char escaped[8];
+                snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                out += escaped;
+            }
+            else
+                out += c;
+        }
+    }
+    out += '"';
+}
+
+//******************** Server *************************************************
+
+struct ServerRequest
+{
+    size_t sequence; // Position in the input, so responses go out in order
+    string id; // Request's "id" as JSON text, echoed back
+    string error; // Set if the line couldn't be turned into a request
+    GeoCoord depot;
+    vector<DeliveryRequest> deliveries;
+    bool snap = false;
+    bool geometry = false; // Whether to send the route's polyline and leg miles too
+};
+
+struct ServerResponse
+{
+    size_t sequence;
+    string line; // Complete JSON response, without the newline
+};
+
+// Reads a coord given as {"lat":..,"lon":..} with string or number values
+static bool readCoord(const JsonValue* value, GeoCoord& gc)
+{
+    if (value == nullptr || value->type != JsonValue::OBJECT)
+        return false;
+    const JsonValue* lat = value->member("lat");
+    const JsonValue* lon = value->member("lon");
+    if (lat == nullptr || lon == nullptr || (lat->type != JsonValue::STRING && lat->type != JsonValue::NUMBER)
+        || (lon->type != JsonValue::STRING && lon->type != JsonValue::NUMBER))
+        return false;
+    try
+    {
+        gc = GeoCoord(lat->text, lon->text);
+    }
+    catch (...) // Text that isn't a number
+    {
+        return false;
+    }
+    return true;
+}
+
+static void parseRequest(const string& line, ServerRequest& request)
+{
+    JsonValue root;
+    if (!JsonParser(line).parse(root, request.error))
+        return;
+    if (root.type != JsonValue::OBJECT)
+    {
+        request.error = "request must be a JSON object";
+        return;
+    }
+    const JsonValue* id = root.member("id");
+    if (id != nullptr)
+    {
+        if (id->type == JsonValue::STRING)
+        {
+            request.id.clear();
+            appendJsonString(request.id, id->text);
+        }
+        else if (id->type == JsonValue::NUMBER)
+            request.id = id->text;
+    }
+    if (!readCoord(root.member("depot"), request.depot))
+    {
+        request.error = "missing or bad depot";
+        return;
+    }
+    const JsonValue* snap = root.member("snap");
+    request.snap = snap != nullptr && snap->text == "true";
+    const JsonValue* geometry = root.member("geometry");
+    request.geometry = geometry != nullptr && geometry->text == "true";
+    const JsonValue* deliveries = root.member("deliveries");
+    if (deliveries == nullptr || deliveries->type != JsonValue::ARRAY)
+    {
+        request.error = "missing deliveries array";
+        return;
+    }
+    for (const JsonValue& d : deliveries->items)
+    {
+        GeoCoord location;
+        const JsonValue* item = d.type == JsonValue::OBJECT ? d.member("item") : nullptr;
+        if (item == nullptr || item->type != JsonValue::STRING || !readCoord(&d, location))
+        {
+            request.error = "bad delivery " + to_string(request.deliveries.size());
+            return;
+        }
+        request.deliveries.push_back(DeliveryRequest(item->text, location));
+    }
+}
+
+static void planRequest(const StreetMap& sm, const ServerRequest& request, ServerResponse& response)
+{
+    response.sequence = request.sequence;
+    string& out = response.line;
+    out = "{\"id\":" + request.id;
+    if (!request.error.empty())
+    {
+        out += ",\"status\":\"error\",\"error\":";
+        appendJsonString(out, request.error);
+        out += "}";
+        return;
+    }
+
+    auto start = chrono::steady_clock::now();
+    DeliveryPlanner planner(&sm);
+    planner.setSnapToMap(request.snap);
+    vector<PlanCommand> commands;
+    double miles = 0;
+    RouteGeometry geometry;
+    DeliveryResult result = planner.generateCompactPlan(request.depot, request.deliveries, commands, miles,
+                                                        request.geometry ? &geometry : nullptr);
+    double ms = chrono::duration<double>(chrono::steady_clock::now() - start).count() * 1000;
+    if (result != DELIVERY_SUCCESS)
+    {
+        out += result == BAD_COORD ? ",\"status\":\"error\",\"error\":\"BAD_COORD\"}" : ",\"status\":\"error\",\"error\":\"NO_ROUTE\"}";
+        return;
+    }
+
+    string text; // One command per line
+    renderCommands(commands, sm.graph(), request.deliveries, text);
+    char numbers[96];
+    snprintf(numbers, sizeof(numbers), ",\"status\":\"ok\",\"miles\":%.2f,\"ms\":%.3f,\"commands\":[", miles, ms);
+    out += numbers;
+    out.reserve(out.size() + text.size() + 4 * commands.size() + 2);
+    size_t lineStart = 0;
+    for (size_t i = 0; i < commands.size(); i++)
+    {
+        size_t lineEnd = text.find('\n', lineStart);
+        if (i > 0)
+            out += ',';
+        appendJsonString(out, text.substr(lineStart, lineEnd - lineStart));
+        lineStart = lineEnd + 1;
+    }
+    out += "]";
+    if (request.geometry)
+    {
+        string polyline;
+        encodePolyline(geometry, 5, polyline);
+        out += ",\"polyline\":";
+        appendJsonString(out, polyline); // Polylines can have backslashes in them
+        out += ",\"leg_miles\":[";
+        for (size_t i = 0; i < geometry.legMiles.size(); i++)
+        {
+            snprintf(numbers, sizeof(numbers), i > 0 ? ",%.2f" : "%.2f", geometry.legMiles[i]);
+            out += numbers;
+        }
+        out += "]";
+    }
+    out += "}";
+}
+
+int runServer(const StreetMap& sm, istream& in, ostream& out, int planThreads)
+{
+    if (planThreads < 1)
+        planThreads = 1;
+    BlockingQueue<ServerRequest> requests(256);
+    BlockingQueue<ServerResponse> responses(256);
+
+    // Parse: read lines and turn them into requests
+    size_t count = 0;
+    thread parser([&] {
+        string line;
+        while (getline(in, line))
+        {
+            if (line.find_first_not_of(" \t\r") == string::npos) // Skip blank lines
+                continue;
+            ServerRequest request;
+            request.sequence = count++;
+            request.id = "null";
+            parseRequest(line, request);
+            requests.push(std::move(request));
+        }
+        requests.close();
+    });
+
+    // Plan: any number of threads, since planning only reads the map
+    vector<thread> planners;
+    for (int t = 0; t < planThreads; t++)
+        planners.push_back(thread([&] {
+            ServerRequest request;
+            while (requests.pop(request))
+            {
+                ServerResponse response;
+                planRequest(sm, request, response);
+                responses.push(std::move(response));
+            }
+        }));
+
+    // Write: put responses back in input order, flushing after each run of ready ones
+    thread writer([&] {
+        map<size_t, string> waiting; // Finished out of order
+        size_t next = 0;
+        ServerResponse response;
+        while (responses.pop(response))
+        {
+            waiting[response.sequence] = std::move(response.line);
+            bool wrote = false;
+            for (auto it = waiting.begin(); it != waiting.end() && it->first == next; it = waiting.erase(it), next++)
+            {
+                out << it->second << '\n';
+                wrote = true;
+            }
+            if (wrote)
+                out.flush();
+        }
+    });
+
+    parser.join();
+    for (thread& t : planners)
+        t.join();
+    responses.close();
+    writer.join();
+    return 0;
+}
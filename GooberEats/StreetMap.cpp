@@ -4,20 +4,245 @@
 #include <sstream>  // needed in addition to <iostream> for string stream I/O
 
 #include "provided.h"
+#include "support.h"
 #include <string>
 #include <vector>
 #include <functional>
+#include <algorithm>
+#include <utility>
+#include <float.h> // For DBL_MAX
+#include <climits> // For INT_MAX
+#include <cstdlib> // For strtod
+#include <cstring> // For memchr
+#include <cerrno>
+#include <chrono>
+#include <atomic>
+#include <stdexcept> // For logic_error
 using namespace std;
 
 unsigned int hasher(const GeoCoord& g)
 {
-    return std::hash<string>()(g.latitudeText + g.longitudeText);
+    // Combine the two texts' hashes rather than hashing them joined, which would build a string per lookup
+    size_t h = std::hash<string>()(g.latitudeText);
+    return (unsigned int)(h * 31 + std::hash<string>()(g.longitudeText));
 }
 
-//unsigned int hasher(const string& g)
-//{
-//    return std::hash<string>()(g);
-//}
+unsigned int hasher(const string& g)
+{
+    return std::hash<string>()(g);
+}
+
+// Hash of a coord in whole 1e-7 degree units, for the compact storage mode's node table
+static size_t fixedCoordHash(long long lat, long long lon)
+{
+    unsigned long long h = (unsigned long long)lat * 0x9E3779B97F4A7C15ULL ^ (unsigned long long)lon;
+    h ^= h >> 29;
+    h *= 0xBF58476D1CE4E5B9ULL;
+    h ^= h >> 32;
+    return (size_t)h;
+}
+
+// Distance along a Hilbert curve filling a 2^16 by 2^16 grid to cell (x, y). Points close
+// together on the grid are almost always close together along the curve.
+static unsigned long long hilbertIndex(unsigned int x, unsigned int y)
+{
+    unsigned long long d = 0;
+    for (unsigned int s = 1u << 15; s > 0; s /= 2)
+    {
+        unsigned int rx = (x & s) ? 1 : 0;
+        unsigned int ry = (y & s) ? 1 : 0;
+        d += (unsigned long long)s * s * ((3 * rx) ^ ry);
+        if (ry == 0) // Rotate quadrant so the curve stays continuous
+        {
+            if (rx == 1)
+            {
+                x = 65535 - x;
+                y = 65535 - y;
+            }
+            unsigned int t = x;
+            x = y;
+            y = t;
+        }
+    }
+    return d;
+}
+
+// Appends a segment, stored as its forward edge; the reverse is worked out from it, so the reverse of
+// edge e is always e ^ 1. Unless shapes is null, directions are worked out here once so planning only
+// has to look them up.
+static void appendSegment(vector<StreetEdge>& segments, vector<SegmentShape>* shapes, int startNode, int endNode, int street, const GeoCoord& start, const GeoCoord& end)
+{
+    segments.push_back(StreetEdge{startNode, endNode, coordDistance(start, end), street, StreetEdge::OPEN});
+    if (shapes != nullptr)
+    {
+        double angle = lineAngle(start, end);
+        double reverseAngle = lineAngle(end, start);
+        shapes->push_back(SegmentShape{distanceEarthMiles(start, end), {angle, reverseAngle},
+                                       {(unsigned char)compassDirection(angle), (unsigned char)compassDirection(reverseAngle)}});
+    }
+}
+
+//******************** Parallel loading ***************************************
+
+// The map file is read whole and split into chunks of street records, which are parsed on separate
+// threads. Node ids depend on where each coord first appears in the whole file, so chunks only keep
+// the coords of their segments; ids are handed out when the chunks are merged.
+
+const size_t MIN_CHUNK_BYTES = 1 << 16; // Smaller pieces of a file aren't worth a thread
+const int MIN_SLICE_EDGES = 1 << 14; // Same for edges when building adjacency lists
+const int COORD_SHARD_BITS = 6; // The coord table is split into 2^6 shards by the top bits of hasher()
+
+struct LoadChunk
+{
+    const char* begin; // Start of the chunk's first street record
+    const char* end; // Start of the next chunk's first record
+    vector<string> streetNames; // Name of each record, in order
+    vector<GeoCoord> coords; // Start then end coord of each segment
+    vector<vector<int>> shardCoords; // Indexes in coords of the coords in each shard of the coord table
+    vector<StreetEdge> segments; // Forward edge of each segment; from and to aren't set and street is an index in streetNames
+    vector<SegmentShape> shapes; // Length and directions of each segment
+    bool standardText; // Whether every coord is written the way compact storage needs
+};
+
+static bool isBlank(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
+
+// End of the line starting at p: its '\n', or end if it's the last line
+static const char* lineEnd(const char* p, const char* end)
+{
+    const char* newline = (const char*)memchr(p, '\n', end - p);
+    return newline == nullptr ? end : newline;
+}
+
+// Finds the next whitespace separated word in [p, end) and moves p past it; false if there isn't one
+static bool nextWord(const char*& p, const char* end, const char*& word, const char*& wordEnd)
+{
+    while (p < end && isBlank(*p))
+        p++;
+    word = p;
+    while (p < end && !isBlank(*p))
+        p++;
+    wordEnd = p;
+    return word < wordEnd;
+}
+
+// Coord from the words for its latitude and longitude, read with strtod like GeoCoord's constructor
+// (which uses stod). False wherever that constructor would throw.
+static bool parseCoord(const char* lat, const char* latEnd, const char* lon, const char* lonEnd, GeoCoord& gc)
+{
+    char* stop;
+    errno = 0;
+    gc.latitude = strtod(lat, &stop); // Stops at the blank or newline after the word
+    if (stop == lat || errno == ERANGE)
+        return false;
+    gc.longitude = strtod(lon, &stop);
+    if (stop == lon || errno == ERANGE)
+        return false;
+    gc.latitudeText.assign(lat, latEnd);
+    gc.longitudeText.assign(lon, lonEnd);
+    return true;
+}
+
+// Whether line [p, end) is just a whole number, like the segment count after a street name
+static bool isCountLine(const char* p, const char* end)
+{
+    const char* word;
+    const char* wordEnd;
+    if (!nextWord(p, end, word, wordEnd) || nextWord(p, end, word, wordEnd))
+        return false;
+    for (const char* c = word; c < wordEnd; c++)
+        if (*c < '0' || *c > '9')
+            return false;
+    return true;
+}
+
+// Whether line [p, end) looks like a segment: at least four words, the first a number
+static bool isSegmentLine(const char* p, const char* end)
+{
+    const char* word;
+    const char* wordEnd;
+    int words = 0;
+    bool numeric = false;
+    for (; nextWord(p, end, word, wordEnd); words++)
+        if (words == 0)
+            numeric = (*word >= '0' && *word <= '9') || *word == '-' || *word == '+' || *word == '.';
+    return words >= 4 && numeric;
+}
+
+// Start of the first street record after p: a line that isn't a segment followed by a line that is
+// just a count. A street name could look like anything, so this is a guess; the loader checks that
+// the records of the chunk before end exactly where this says the next one starts.
+static const char* findRecordStart(const char* p, const char* end)
+{
+    p = lineEnd(p, end); // Skip the rest of the line p is in
+    while (p < end)
+    {
+        p++; // Past the newline
+        const char* nameEnd = lineEnd(p, end);
+        if (nameEnd == end)
+            break;
+        if (isCountLine(nameEnd + 1, lineEnd(nameEnd + 1, end)) && !isSegmentLine(p, nameEnd))
+            return p;
+        p = nameEnd;
+    }
+    return end;
+}
+
+// Parses the street records from chunk.begin to chunk.end, accepting exactly what StreetMapImpl::load's
+// line by line reader accepts. Returns false if a record is malformed (the line by line reader then
+// reports it) or runs past chunk.end, meaning findRecordStart guessed wrong.
+static bool parseChunk(LoadChunk& chunk, const char* fileEnd, bool checkText)
+{
+    chunk.standardText = true;
+    chunk.shardCoords.resize(1 << COORD_SHARD_BITS);
+    const char* p = chunk.begin;
+    while (p < chunk.end) // Loop for every street
+    {
+        const char* nameEnd = lineEnd(p, fileEnd);
+        int street = (int)chunk.streetNames.size();
+        chunk.streetNames.push_back(string(p, nameEnd));
+        p = nameEnd < fileEnd ? nameEnd + 1 : fileEnd;
+        
+        while (p < fileEnd && (isBlank(*p) || *p == '\n')) // Like inf >> segments, skip any whitespace first
+            p++;
+        char* stop;
+        errno = 0;
+        long segments = strtol(p, &stop, 10);
+        if (p == fileEnd || stop == p || errno == ERANGE || segments > INT_MAX || segments < INT_MIN)
+            return false;
+        p = lineEnd(stop, fileEnd); // Skip rest of line
+        if (p < fileEnd)
+            p++;
+        
+        for (long i = 0; i < segments; i++) // Loop through all segments
+        {
+            if (p == fileEnd)
+                return false;
+            const char* end = lineEnd(p, fileEnd);
+            const char* words[4][2]; // Start and end of startLat, startLong, endLat, endLong
+            for (int w = 0; w < 4; w++)
+                if (!nextWord(p, end, words[w][0], words[w][1]))
+                    return false;
+            GeoCoord start, finish;
+            if (!parseCoord(words[0][0], words[0][1], words[1][0], words[1][1], start) ||
+                !parseCoord(words[2][0], words[2][1], words[3][0], words[3][1], finish))
+                return false;
+            p = end < fileEnd ? end + 1 : fileEnd;
+            
+            if (checkText && chunk.standardText)
+                chunk.standardText = isFixedCoordText(start.latitudeText, start.latitude) && isFixedCoordText(start.longitudeText, start.longitude) &&
+                                     isFixedCoordText(finish.latitudeText, finish.latitude) && isFixedCoordText(finish.longitudeText, finish.longitude);
+            appendSegment(chunk.segments, &chunk.shapes, -1, -1, street, start, finish);
+            chunk.shardCoords[hasher(start) >> (32 - COORD_SHARD_BITS)].push_back((int)chunk.coords.size());
+            chunk.coords.push_back(move(start));
+            chunk.shardCoords[hasher(finish) >> (32 - COORD_SHARD_BITS)].push_back((int)chunk.coords.size());
+            chunk.coords.push_back(move(finish));
+        }
+    }
+    return p == chunk.end;
+}
 
 class StreetMapImpl
 {
@@ -25,16 +250,64 @@ public:
     StreetMapImpl();
     ~StreetMapImpl();
     bool load(string mapFile);
+    void setCompactStorage(bool compact);
+    void setLoadThreads(int threads);
+    void memoryUsage(MapMemoryUsage& usage) const;
+    const LoadStats& loadStats() const;
     bool getSegmentsThatStartWith(const GeoCoord& gc, vector<StreetSegment>& segs) const;
+    const StreetGraph& graph() const;
+    int nodeAt(const GeoCoord& gc) const;
+    int streetId(const string& name) const;
+    bool snapToNode(const GeoCoord& gc, GeoCoord& snapped) const;
+    bool snapToSegment(const GeoCoord& gc, StreetSegment& seg, GeoCoord& onSegment) const;
+    int snapToNodes(vector<GeoCoord>& coords) const;
+    void getSegmentsInBox(const GeoCoord& southWest, const GeoCoord& northEast, vector<StreetSegment>& segs) const;
+    void getSegmentsWithinRadius(const GeoCoord& center, double radiusMiles, vector<StreetSegment>& segs) const;
+    void reorderForLocality();
+    bool addSegment(const GeoCoord& start, const GeoCoord& end, string streetName);
+    bool removeSegment(const GeoCoord& start, const GeoCoord& end);
+    bool setSegmentOpen(const GeoCoord& start, const GeoCoord& end, bool open);
+    bool setSegmentCostFactor(const GeoCoord& start, const GeoCoord& end, double factor);
+    void buildTurnGraph();
+    const TurnGraph* turnGraph() const;
+    const ChainGraph* chainGraph() const;
     
 private:
     // Data Members
-    ExpandableHashMap<GeoCoord, vector<StreetSegment>> m_coordToSegs;
+    ExpandableHashMap<GeoCoord, int> m_coordToNode; // Maps every segment endpoint to its node id in m_graph
+    ExpandableHashMap<string, int> m_nameToStreet; // Maps street names to their id in m_graph
+    bool m_compactStorage; // Whether the next load should use compact storage
+    int m_loadThreads; // Threads load uses, or 0 for one per core
+    // In compact storage mode these replace the two maps above, hashing the node's fixed point coords
+    // and the street's name in m_graph instead of keeping copies of them
+    IdTable m_nodeTable;
+    IdTable m_nameTable;
+    StreetGraph m_graph;
+    SpatialGrid m_grid; // Spatial index over m_graph for snapping and range queries
+    LoadStats m_loadStats; // Only filled in when built with GOOBEREATS_STATS
+    bool m_hasTurnGraph; // Whether buildTurnGraph was called, so m_turnGraph is kept up to date
+    TurnGraph m_turnGraph;
+    ChainGraph m_chainGraph; // Always kept up to date, it's cheap
     // Member functions
+    bool loadChunks(const string& text, int threads); // Loads the contents of a map file into an empty map in parallel; false if it can't
+    int addNode(const GeoCoord& gc); // Returns node id of gc, adding a new node if needed
+    int addStreet(const string& name); // Returns street id of name, adding it if needed
+    void addEdgePair(int startNode, int endNode, int street, const GeoCoord& start, const GeoCoord& end); // Adds edge pair for a segment
+    int findNode(const GeoCoord& gc) const; // Node id of gc, or -1
+    size_t nodeHash(int node) const; // Hash of a node's coords in m_nodeTable
+    void clear(); // Back to an empty map
+    void insertIntoAdjacency(int e); // Adds one edge to the end of its start node's adjacency list
+    int findSegment(const GeoCoord& start, const GeoCoord& end) const; // Forward edge of a segment joining start and end, or -1
+    void changeSegment(int e, StreetEdge::State state, double weight); // Updates both edges of a segment and logs the change
+    void buildAdjacency(const vector<int>* order = nullptr, int threads = 1); // Groups edges by start node, keeping them in id order (or the given order) within each node
 };
 
 StreetMapImpl::StreetMapImpl()
 {
+    m_compactStorage = false;
+    m_loadThreads = 0;
+    m_hasTurnGraph = false;
+    m_graph.adjStart.push_back(0); // No nodes yet
 }
 
 StreetMapImpl::~StreetMapImpl()
@@ -43,6 +316,12 @@ StreetMapImpl::~StreetMapImpl()
 
 bool StreetMapImpl::load(string mapFile)
 {
+    STATS(m_loadStats = LoadStats(); auto loadStart = chrono::steady_clock::now();)
+    // The storage mode is picked by the first load; a later one adds to the map the same way
+    bool empty = m_graph.numNodes() == 0 && m_graph.streetNames.empty();
+    if (empty)
+        m_graph.compact = m_compactStorage;
+    
     // Open map file
     ifstream inf(mapFile);
     
@@ -53,10 +332,31 @@ bool StreetMapImpl::load(string mapFile)
         return false;
     }
     
+    // Read the whole file and parse it on several threads. Anything that can't be loaded that way
+    // (including a malformed file) is read again line by line below, which reports what was wrong.
+    int threads = m_loadThreads > 0 ? m_loadThreads : hardwareThreads();
+    bool loaded = false;
+    if (empty)
+    {
+        inf.seekg(0, ios::end);
+        string text((size_t)max<streamoff>(0, inf.tellg()), '\0');
+        inf.seekg(0);
+        inf.read(&text[0], text.size());
+        loaded = inf && loadChunks(text, threads);
+        if (!loaded)
+        {
+            clear();
+            m_graph.compact = m_compactStorage;
+            inf.clear();
+            inf.seekg(0);
+        }
+    }
+    
     string line;
-    while (getline(inf, line)) // Loop for every street
+    while (!loaded && getline(inf, line)) // Loop for every street
     {
         string streetName = line; // Save first line (street name)
+        int street = addStreet(streetName); // Get id for street name
         int segments; // Set up int to record number of segments
         if (!(inf >> segments)) // Save number of segments in var
         {
@@ -81,46 +381,654 @@ bool StreetMapImpl::load(string mapFile)
             }
             
             // Create start/end coords
-            GeoCoord startCoord = GeoCoord(startLat, startLong);
-            GeoCoord endCoord = GeoCoord(endLat, endLong);
-            
-            // Insert first pair (start coord to segment)
-            StreetSegment streetSeg = StreetSegment(startCoord, endCoord, streetName);
-            if (m_coordToSegs.find(startCoord) != nullptr) // If coord already exists in map, just add on to vector
-                m_coordToSegs.find(startCoord)->push_back(streetSeg);
-            else // If coord not already in map associate new coord
+            GeoCoord startCoord, endCoord;
+            try
+            {
+                startCoord = GeoCoord(startLat, startLong);
+                endCoord = GeoCoord(endLat, endLong);
+            }
+            catch (const logic_error&) // stod found no number, or one out of range
             {
-                vector<StreetSegment> v = vector<StreetSegment>();
-                v.push_back(streetSeg);
-                m_coordToSegs.associate(startCoord, v);
+                cerr << "Bad coord in line " << line << endl;
+                return false;
             }
             
-            // Insert second pair (end coord to reversed segment)
-            StreetSegment reverseStreetSeg = StreetSegment(endCoord, startCoord, streetName);
-            if (m_coordToSegs.find(endCoord) != nullptr) // If coord already exists in map, just add on to vector
-                m_coordToSegs.find(endCoord)->push_back(reverseStreetSeg);
-            else // If coord not already in map associate new coord
+            // Compact storage rebuilds coord text from the numbers, so it only works if every coord
+            // is written the standard way. If one isn't, start over and keep the text, unless an
+            // earlier file is already stored compactly.
+            if (m_graph.compact && !(isFixedCoordText(startLat, startCoord.latitude) && isFixedCoordText(startLong, startCoord.longitude) &&
+                                     isFixedCoordText(endLat, endCoord.latitude) && isFixedCoordText(endLong, endCoord.longitude)))
             {
-                vector<StreetSegment> v = vector<StreetSegment>();
-                v.push_back(reverseStreetSeg);
-                m_coordToSegs.associate(endCoord, v);
+                if (!empty)
+                {
+                    cerr << "Coord " << line << " can't be added to a map in compact storage" << endl;
+                    return false;
+                }
+                clear();
+                m_graph.compact = false;
+                inf.clear();
+                inf.seekg(0);
+                break;
             }
+            
+            // Add segment in both directions. Start is added before end, whatever order the compiler
+            // evaluates arguments in, so node ids don't depend on the compiler.
+            int startNode = addNode(startCoord);
+            int endNode = addNode(endCoord);
+            addEdgePair(startNode, endNode, street, startCoord, endCoord);
         }
     }
     
+    buildAdjacency(nullptr, threads); // Build adjacency lists once all edges are in
+    m_grid.build(m_graph); // Index nodes and segments by location
+    if (m_hasTurnGraph)
+        m_turnGraph.build(m_graph);
+    m_chainGraph.build(m_graph);
+    if (m_graph.compact) // Drop spare capacity
+    {
+        m_graph.points.shrink_to_fit();
+        m_graph.segments.shrink_to_fit();
+        m_graph.streetNames.shrink_to_fit();
+    }
+    
+    STATS(
+        m_loadStats.seconds = chrono::duration<double>(chrono::steady_clock::now() - loadStart).count();
+        inf.clear();
+        inf.seekg(0, ios::end);
+        m_loadStats.bytes = (long long)inf.tellg();
+        m_loadStats.bytesPerSecond = m_loadStats.seconds > 0 ? m_loadStats.bytes / m_loadStats.seconds : 0;
+        m_loadStats.nodes = m_graph.numNodes();
+        m_loadStats.edges = m_graph.numEdges();
+        m_loadStats.streets = (int)m_graph.streetNames.size();
+    )
     return true; // Return true after everything is loaded
 }
 
+void StreetMapImpl::setCompactStorage(bool compact)
+{
+    m_compactStorage = compact;
+}
+
+bool StreetMapImpl::loadChunks(const string& text, int threads)
+{
+    // Split the file into a chunk per thread at street record boundaries
+    const char* fileBegin = text.data();
+    const char* fileEnd = fileBegin + text.size();
+    int numChunks = (int)max<size_t>(1, min<size_t>(threads, text.size() / MIN_CHUNK_BYTES));
+    vector<LoadChunk> chunks(numChunks);
+    for (int c = 0; c < numChunks; c++)
+        chunks[c].begin = c == 0 ? fileBegin : max(chunks[c-1].begin, findRecordStart(fileBegin + text.size() * c / numChunks, fileEnd));
+    for (int c = 0; c < numChunks; c++)
+        chunks[c].end = c + 1 < numChunks ? chunks[c+1].begin : fileEnd;
+    STATS(m_loadStats.chunks = numChunks;)
+    
+    atomic<bool> parsed(true);
+    runParallel(numChunks, threads, [&](int c) {
+        if (!parseChunk(chunks[c], fileEnd, m_graph.compact))
+            parsed = false;
+    });
+    if (!parsed)
+        return false;
+    for (const LoadChunk& chunk : chunks)
+        if (!chunk.standardText) // Compact storage can't keep this file's coord text
+            m_graph.compact = false;
+    
+    // Street ids in order of first appearance, as the line by line reader gives them. There are few
+    // enough names to do this on one thread.
+    vector<vector<int>> streetIds(numChunks);
+    for (int c = 0; c < numChunks; c++)
+        for (const string& name : chunks[c].streetNames)
+            streetIds[c].push_back(addStreet(name));
+    
+    // Find the first occurrence of every coord. Each shard of the coord table holds the coords whose
+    // hashes share their top bits and is filled by one thread going through the file in order, so no
+    // locking is needed. Coords are numbered across the whole file, chunk by chunk.
+    vector<int> coordStart(numChunks + 1, 0);
+    for (int c = 0; c < numChunks; c++)
+        coordStart[c+1] = coordStart[c] + (int)chunks[c].coords.size();
+    vector<int> firstSeen(coordStart[numChunks]); // Number of the first occurrence of each coord
+    runParallel(1 << COORD_SHARD_BITS, threads, [&](int shard) {
+        ExpandableHashMap<GeoCoord, int> seen;
+        for (int c = 0; c < numChunks; c++)
+            for (int i : chunks[c].shardCoords[shard])
+            {
+                int coord = coordStart[c] + i;
+                const int* first = seen.find(chunks[c].coords[i]);
+                if (first == nullptr)
+                    seen.associate(chunks[c].coords[i], coord);
+                firstSeen[coord] = first == nullptr ? coord : *first;
+            }
+    });
+    
+    // Give first occurrences node ids in file order, which is the order the line by line reader adds them in
+    vector<int> nodeStart(numChunks + 1, 0);
+    runParallel(numChunks, threads, [&](int c) {
+        for (int coord = coordStart[c]; coord < coordStart[c+1]; coord++)
+            if (firstSeen[coord] == coord)
+                nodeStart[c+1]++;
+    });
+    for (int c = 0; c < numChunks; c++)
+        nodeStart[c+1] += nodeStart[c];
+    int numNodes = nodeStart[numChunks];
+    vector<int> coordNode(coordStart[numChunks]); // Node id of each first occurrence
+    m_graph.points.resize(numNodes);
+    if (!m_graph.compact)
+        m_graph.nodes.resize(numNodes);
+    runParallel(numChunks, threads, [&](int c) {
+        int node = nodeStart[c];
+        for (int i = 0; i < (int)chunks[c].coords.size(); i++)
+        {
+            int coord = coordStart[c] + i;
+            if (firstSeen[coord] != coord)
+                continue;
+            GeoCoord& gc = chunks[c].coords[i];
+            coordNode[coord] = node;
+            m_graph.points[node] = NodePoint{ gc.latitude, gc.longitude };
+            if (!m_graph.compact)
+                m_graph.nodes[node] = move(gc);
+            node++;
+        }
+    });
+    
+    // Copy in the segments, now that their ends and streets have ids
+    vector<int> segmentStart(numChunks + 1, 0);
+    for (int c = 0; c < numChunks; c++)
+        segmentStart[c+1] = segmentStart[c] + (int)chunks[c].segments.size();
+    m_graph.segments.resize(segmentStart[numChunks]);
+    if (!m_graph.compact)
+        m_graph.shapes.resize(segmentStart[numChunks]);
+    runParallel(numChunks, threads, [&](int c) {
+        for (int i = 0; i < (int)chunks[c].segments.size(); i++)
+        {
+            StreetEdge segment = chunks[c].segments[i];
+            int startCoord = coordStart[c] + 2 * i; // Segment i's start, followed by its end
+            segment.from = coordNode[firstSeen[startCoord]];
+            segment.to = coordNode[firstSeen[startCoord + 1]];
+            segment.street = streetIds[c][segment.street];
+            m_graph.segments[segmentStart[c] + i] = segment;
+            if (!m_graph.compact)
+                m_graph.shapes[segmentStart[c] + i] = chunks[c].shapes[i];
+        }
+    });
+    
+    // Index the nodes for lookups by coord. This is on one thread, but only sees each coord once.
+    for (int n = 0; n < numNodes; n++)
+    {
+        if (m_graph.compact)
+            m_nodeTable.insert(nodeHash(n), n, [&](int other) { return nodeHash(other); });
+        else
+        {
+            STATS(m_loadStats.coordProbes.add(m_coordToNode.probeLength(m_graph.nodes[n]));)
+            m_coordToNode.associate(m_graph.nodes[n], n);
+        }
+    }
+    return true;
+}
+
+void StreetMapImpl::setLoadThreads(int threads)
+{
+    m_loadThreads = max(0, threads);
+}
+
+void StreetMapImpl::memoryUsage(MapMemoryUsage& usage) const
+{
+    usage = MapMemoryUsage();
+    usage.coords = vectorBytes(m_graph.nodes);
+    for (const GeoCoord& gc : m_graph.nodes)
+        usage.coords += stringBytes(gc.latitudeText) + stringBytes(gc.longitudeText);
+    usage.points = vectorBytes(m_graph.points);
+    usage.streetNames = vectorBytes(m_graph.streetNames);
+    for (const string& name : m_graph.streetNames)
+        usage.streetNames += stringBytes(name);
+    if (m_graph.compact)
+    {
+        usage.coordIndex = m_nodeTable.memoryUsage();
+        usage.nameIndex = m_nameTable.memoryUsage();
+    }
+    else
+    {
+        // The maps hold their own copies of every coord and name, text and all
+        usage.coordIndex = m_coordToNode.memoryUsage() + usage.coords - vectorBytes(m_graph.nodes);
+        usage.nameIndex = m_nameToStreet.memoryUsage() + usage.streetNames - vectorBytes(m_graph.streetNames);
+    }
+    usage.edges = vectorBytes(m_graph.segments) + vectorBytes(m_graph.shapes);
+    usage.adjacency = vectorBytes(m_graph.adjStart) + vectorBytes(m_graph.adjEdges);
+    usage.changes = vectorBytes(m_graph.changes);
+    usage.spatialGrid = m_grid.memoryUsage();
+    usage.turnGraph = m_hasTurnGraph ? m_turnGraph.memoryUsage() : 0;
+    usage.chainGraph = m_chainGraph.memoryUsage();
+}
+
+const LoadStats& StreetMapImpl::loadStats() const
+{
+    return m_loadStats;
+}
+
 bool StreetMapImpl::getSegmentsThatStartWith(const GeoCoord& gc, vector<StreetSegment>& segs) const
 {
-    const vector<StreetSegment>* assocSegs = m_coordToSegs.find(gc); // Attempt to find associated segs to gc
-    if (assocSegs == nullptr) // If we couldn't find, the key gc, return false
+    int node = nodeAt(gc); // Attempt to find node for gc
+    if (node == -1) // If we couldn't find the key gc, return false
         return false;
-    else // Otherwise copy over segments
-        segs = *assocSegs;
+    // Otherwise copy over segments leaving the node
+    segs.clear();
+    for (int i = m_graph.adjStart[node]; i < m_graph.adjStart[node+1]; i++)
+        if (m_graph.edge(m_graph.adjEdges[i]).state != StreetEdge::REMOVED)
+            segs.push_back(m_graph.segment(m_graph.adjEdges[i]));
     return true;  // Return true after successful get
 }
 
+const StreetGraph& StreetMapImpl::graph() const
+{
+    return m_graph;
+}
+
+int StreetMapImpl::nodeAt(const GeoCoord& gc) const
+{
+    int node = findNode(gc);
+    if (node == -1 || node + 1 >= (int)m_graph.adjStart.size()) // Not a node, or left over from a load that failed
+        return -1;
+    if (m_graph.isolated(node)) // Every segment at it was removed, so it's no longer part of the map
+        return -1;
+    return node;
+}
+
+int StreetMapImpl::streetId(const string& name) const
+{
+    if (m_graph.compact)
+        return m_nameTable.find(std::hash<string>()(name), [&](int street) { return m_graph.streetNames[street] == name; });
+    const int* street = m_nameToStreet.find(name);
+    return street == nullptr ? -1 : *street;
+}
+
+bool StreetMapImpl::snapToNode(const GeoCoord& gc, GeoCoord& snapped) const
+{
+    int node = nodeAt(gc);
+    if (node == -1) // Only search the grid if gc isn't already a node
+        node = m_grid.nearestNode(m_graph, gc.latitude, gc.longitude);
+    if (node == -1) // Empty map
+        return false;
+    snapped = m_graph.coord(node);
+    return true;
+}
+
+bool StreetMapImpl::snapToSegment(const GeoCoord& gc, StreetSegment& seg, GeoCoord& onSegment) const
+{
+    double t;
+    int edge = m_grid.nearestSegment(m_graph, gc.latitude, gc.longitude, t);
+    if (edge == -1) // Empty map
+        return false;
+    seg = m_graph.segment(edge);
+    // Use the exact endpoint if that's the closest point so the result can be routed from
+    if (t == 0)
+        onSegment = seg.start;
+    else if (t == 1)
+        onSegment = seg.end;
+    else
+        onSegment = makeGeoCoord(seg.start.latitude + t * (seg.end.latitude - seg.start.latitude),
+                                 seg.start.longitude + t * (seg.end.longitude - seg.start.longitude));
+    return true;
+}
+
+int StreetMapImpl::snapToNodes(vector<GeoCoord>& coords) const
+{
+    // Visit coords in grid cell order so neighboring queries hit the same cells
+    vector<pair<int, size_t>> order; // (cell, index in coords)
+    order.reserve(coords.size());
+    for (size_t i = 0; i < coords.size(); i++)
+        order.push_back(make_pair(m_grid.cellOf(coords[i].latitude, coords[i].longitude), i));
+    sort(order.begin(), order.end());
+    
+    int moved = 0;
+    for (const auto& entry : order)
+    {
+        GeoCoord& gc = coords[entry.second];
+        if (nodeAt(gc) != -1) // Already on the map
+            continue;
+        if (snapToNode(gc, gc))
+            moved++;
+    }
+    return moved;
+}
+
+void StreetMapImpl::getSegmentsInBox(const GeoCoord& southWest, const GeoCoord& northEast, vector<StreetSegment>& segs) const
+{
+    vector<int> edges;
+    m_grid.segmentsInBox(m_graph, southWest.latitude, southWest.longitude, northEast.latitude, northEast.longitude, edges);
+    segs.clear();
+    for (int e : edges)
+        segs.push_back(m_graph.segment(e));
+}
+
+void StreetMapImpl::getSegmentsWithinRadius(const GeoCoord& center, double radiusMiles, vector<StreetSegment>& segs) const
+{
+    vector<int> edges;
+    m_grid.segmentsNear(m_graph, center.latitude, center.longitude, radiusMiles, edges);
+    segs.clear();
+    for (int e : edges)
+        segs.push_back(m_graph.segment(e));
+}
+
+void StreetMapImpl::reorderForLocality()
+{
+    int numNodes = m_graph.numNodes();
+    if (numNodes == 0)
+        return;
+    
+    // Find each node's position along a Hilbert curve through a 2^16 by 2^16 grid over the map
+    double minLat = m_graph.points[0].latitude, maxLat = minLat;
+    double minLon = m_graph.points[0].longitude, maxLon = minLon;
+    for (const NodePoint& gc : m_graph.points)
+    {
+        minLat = min(minLat, gc.latitude);
+        maxLat = max(maxLat, gc.latitude);
+        minLon = min(minLon, gc.longitude);
+        maxLon = max(maxLon, gc.longitude);
+    }
+    double latScale = maxLat > minLat ? 65535 / (maxLat - minLat) : 0;
+    double lonScale = maxLon > minLon ? 65535 / (maxLon - minLon) : 0;
+    vector<pair<unsigned long long, int>> curveOrder(numNodes); // (distance along curve, old node id)
+    for (int n = 0; n < numNodes; n++)
+    {
+        unsigned int x = (unsigned int)((m_graph.points[n].longitude - minLon) * lonScale);
+        unsigned int y = (unsigned int)((m_graph.points[n].latitude - minLat) * latScale);
+        curveOrder[n] = make_pair(hilbertIndex(x, y), n);
+    }
+    sort(curveOrder.begin(), curveOrder.end());
+    
+    // Renumber nodes in curve order
+    vector<int> newNode(numNodes);
+    vector<NodePoint> points(numNodes);
+    for (int i = 0; i < numNodes; i++)
+    {
+        newNode[curveOrder[i].second] = i;
+        points[i] = m_graph.points[curveOrder[i].second];
+    }
+    m_graph.points.swap(points);
+    if (m_graph.compact) // Rebuild the node table from scratch with the new ids
+    {
+        m_nodeTable.clear();
+        for (int i = 0; i < numNodes; i++)
+            m_nodeTable.insert(nodeHash(i), i, [&](int n) { return nodeHash(n); });
+    }
+    else
+    {
+        vector<GeoCoord> nodes(numNodes);
+        for (int i = 0; i < numNodes; i++)
+        {
+            nodes[i] = m_graph.nodes[curveOrder[i].second];
+            m_coordToNode.associate(nodes[i], i);
+        }
+        m_graph.nodes.swap(nodes);
+    }
+    
+    // Renumber segments in order of their new start node. Each keeps its direction, so its edge pair
+    // keeps its shape.
+    int numSegments = (int)m_graph.segments.size();
+    vector<pair<int, int>> segmentOrder(numSegments); // (new start node, old segment id)
+    for (int i = 0; i < numSegments; i++)
+        segmentOrder[i] = make_pair(newNode[m_graph.segments[i].from], i);
+    sort(segmentOrder.begin(), segmentOrder.end());
+    vector<int> newEdge(m_graph.numEdges());
+    vector<StreetEdge> segments(numSegments);
+    vector<SegmentShape> shapes(m_graph.shapes.size());
+    for (int i = 0; i < numSegments; i++)
+    {
+        int old = segmentOrder[i].second;
+        newEdge[2*old] = 2 * i;
+        newEdge[2*old + 1] = 2 * i + 1;
+        segments[i] = m_graph.segments[old];
+        segments[i].from = newNode[segments[i].from];
+        segments[i].to = newNode[segments[i].to];
+        if (!shapes.empty())
+            shapes[i] = m_graph.shapes[old];
+    }
+    m_graph.segments.swap(segments);
+    m_graph.shapes.swap(shapes);
+    
+    // Rebuild indexes, listing each node's edges in the same order as before
+    buildAdjacency(&newEdge);
+    m_grid.build(m_graph);
+    if (m_hasTurnGraph)
+        m_turnGraph.build(m_graph);
+    m_chainGraph.build(m_graph);
+    m_graph.changes.clear(); // Logged edge ids are stale now
+}
+
+bool StreetMapImpl::addSegment(const GeoCoord& start, const GeoCoord& end, string streetName)
+{
+    if (findSegment(start, end) != -1) // Already there
+        return false;
+    if (m_graph.compact && !(isFixedCoordText(start.latitudeText, start.latitude) && isFixedCoordText(start.longitudeText, start.longitude) &&
+                             isFixedCoordText(end.latitudeText, end.latitude) && isFixedCoordText(end.longitudeText, end.longitude)))
+        return false; // Compact storage can't keep nonstandard coord text
+    int startNode = addNode(start);
+    int endNode = addNode(end);
+    addEdgePair(startNode, endNode, addStreet(streetName), start, end);
+    int e = m_graph.numEdges() - 2;
+    insertIntoAdjacency(e);
+    insertIntoAdjacency(e + 1);
+    m_grid.addSegment(m_graph, e);
+    if (m_hasTurnGraph) // New edge means new turns at both its ends
+        m_turnGraph.addSegment(m_graph, e);
+    m_chainGraph.addSegment(m_graph, e); // Its ends may no longer end a chain, or a chain may now end in the middle
+    
+    StreetChange change; // Log it as a segment going from unusable to usable
+    change.edge = e;
+    change.oldCost = DBL_MAX;
+    change.newCost = m_graph.edge(e).cost();
+    m_graph.changes.push_back(change);
+    return true;
+}
+
+void StreetMapImpl::buildTurnGraph()
+{
+    m_hasTurnGraph = true;
+    m_turnGraph.build(m_graph);
+}
+
+const TurnGraph* StreetMapImpl::turnGraph() const
+{
+    return m_hasTurnGraph ? &m_turnGraph : nullptr;
+}
+
+const ChainGraph* StreetMapImpl::chainGraph() const
+{
+    return &m_chainGraph;
+}
+
+bool StreetMapImpl::removeSegment(const GeoCoord& start, const GeoCoord& end)
+{
+    int e = findSegment(start, end);
+    if (e == -1)
+        return false;
+    // Coords left with no segments stay indexed, so adding one back gets the same node id, but
+    // nodeAt no longer finds them
+    changeSegment(e, StreetEdge::REMOVED, m_graph.edge(e).weight);
+    return true;
+}
+
+bool StreetMapImpl::setSegmentOpen(const GeoCoord& start, const GeoCoord& end, bool open)
+{
+    int e = findSegment(start, end);
+    if (e == -1)
+        return false;
+    if (m_graph.edge(e).usable() != open) // Only log real changes
+        changeSegment(e, open ? StreetEdge::OPEN : StreetEdge::CLOSED, m_graph.edge(e).weight);
+    return true;
+}
+
+bool StreetMapImpl::setSegmentCostFactor(const GeoCoord& start, const GeoCoord& end, double factor)
+{
+    int e = findSegment(start, end);
+    if (e == -1 || !(factor >= 1)) // Factors below 1 would make the A Star heuristic overestimate
+        return false;
+    StreetEdge edge = m_graph.edge(e);
+    changeSegment(e, edge.state, coordDistance(m_graph.points[edge.from], m_graph.points[edge.to]) * factor);
+    return true;
+}
+
+// Private member functions
+
+int StreetMapImpl::addNode(const GeoCoord& gc)
+{
+    STATS(if (!m_graph.compact) m_loadStats.coordProbes.add(m_coordToNode.probeLength(gc));)
+    int node = findNode(gc);
+    if (node != -1) // If coord already exists just return its id
+        return node;
+    node = m_graph.numNodes();
+    NodePoint point = { gc.latitude, gc.longitude };
+    m_graph.points.push_back(point);
+    if (m_graph.compact)
+        m_nodeTable.insert(nodeHash(node), node, [&](int n) { return nodeHash(n); });
+    else
+    {
+        m_graph.nodes.push_back(gc);
+        m_coordToNode.associate(gc, node);
+    }
+    return node;
+}
+
+int StreetMapImpl::findNode(const GeoCoord& gc) const
+{
+    if (!m_graph.compact)
+    {
+        const int* node = m_coordToNode.find(gc);
+        return node == nullptr ? -1 : *node;
+    }
+    // Every node's text is in standard form, so nothing else can match
+    if (!isFixedCoordText(gc.latitudeText, gc.latitude) || !isFixedCoordText(gc.longitudeText, gc.longitude))
+        return -1;
+    long long lat = toFixedCoord(gc.latitude), lon = toFixedCoord(gc.longitude);
+    return m_nodeTable.find(fixedCoordHash(lat, lon), [&](int n) {
+        return toFixedCoord(m_graph.points[n].latitude) == lat && toFixedCoord(m_graph.points[n].longitude) == lon;
+    });
+}
+
+size_t StreetMapImpl::nodeHash(int node) const
+{
+    return fixedCoordHash(toFixedCoord(m_graph.points[node].latitude), toFixedCoord(m_graph.points[node].longitude));
+}
+
+int StreetMapImpl::addStreet(const string& name)
+{
+    STATS(if (!m_graph.compact) m_loadStats.nameProbes.add(m_nameToStreet.probeLength(name));)
+    int street = streetId(name);
+    if (street != -1) // If name already exists just return its id
+        return street;
+    street = (int)m_graph.streetNames.size();
+    m_graph.streetNames.push_back(name);
+    if (m_graph.compact) // Table only refers to the name in m_graph
+        m_nameTable.insert(std::hash<string>()(name), street, [&](int other) { return std::hash<string>()(m_graph.streetNames[other]); });
+    else
+        m_nameToStreet.associate(name, street);
+    return street;
+}
+
+void StreetMapImpl::clear()
+{
+    bool compact = m_graph.compact;
+    m_graph = StreetGraph();
+    m_graph.compact = compact;
+    m_graph.adjStart.push_back(0); // No nodes yet
+    m_coordToNode.reset();
+    m_nameToStreet.reset();
+    m_nodeTable.clear();
+    m_nameTable.clear();
+    m_grid = SpatialGrid();
+    m_turnGraph = TurnGraph();
+    m_chainGraph = ChainGraph();
+}
+
+void StreetMapImpl::addEdgePair(int startNode, int endNode, int street, const GeoCoord& start, const GeoCoord& end)
+{
+    appendSegment(m_graph.segments, m_graph.compact ? nullptr : &m_graph.shapes, startNode, endNode, street, start, end);
+}
+
+void StreetMapImpl::insertIntoAdjacency(int e)
+{
+    int from = m_graph.edge(e).from;
+    while ((int)m_graph.adjStart.size() < m_graph.numNodes() + 1) // New nodes start with no edges
+        m_graph.adjStart.push_back(m_graph.adjStart.back());
+    m_graph.adjEdges.insert(m_graph.adjEdges.begin() + m_graph.adjStart[from + 1], e);
+    for (int n = from + 1; n <= m_graph.numNodes(); n++) // Shift the lists of every later node along by one
+        m_graph.adjStart[n]++;
+}
+
+int StreetMapImpl::findSegment(const GeoCoord& start, const GeoCoord& end) const
+{
+    int startNode = nodeAt(start), endNode = nodeAt(end);
+    if (startNode == -1 || endNode == -1)
+        return -1;
+    for (int i = m_graph.adjStart[startNode]; i < m_graph.adjStart[startNode+1]; i++)
+    {
+        int e = m_graph.adjEdges[i];
+        if (m_graph.edge(e).to == endNode && m_graph.edge(e).state != StreetEdge::REMOVED)
+            return e & ~1; // Forward edge of the pair
+    }
+    return -1;
+}
+
+void StreetMapImpl::changeSegment(int e, StreetEdge::State state, double weight)
+{
+    StreetChange change;
+    change.edge = e;
+    change.oldCost = m_graph.edge(e).cost();
+    m_graph.segments[e >> 1].state = state; // Both edges of the pair are read from it
+    m_graph.segments[e >> 1].weight = weight;
+    change.newCost = m_graph.edge(e).cost();
+    m_graph.changes.push_back(change);
+}
+
+void StreetMapImpl::buildAdjacency(const vector<int>* order, int threads)
+{
+    // Counting sort of edge ids by start node. Each thread counts and then places the edges of one
+    // slice of the ids; a node's slots go to the slices in order, so its edges keep their order.
+    int numNodes = m_graph.numNodes(), numEdges = m_graph.numEdges();
+    int slices = max(1, min(threads, numEdges / MIN_SLICE_EDGES));
+    auto first = [&](int slice) { return (int)((long long)numEdges * slice / slices); }; // First edge index of a slice
+    auto edgeAt = [&](int i) { return order == nullptr ? i : (*order)[i]; };
+    vector<vector<int>> next(slices, vector<int>(numNodes, 0)); // Per slice, edges leaving each node, then where the next one goes
+    runParallel(slices, threads, [&](int s) {
+        for (int i = first(s); i < first(s + 1); i++) // Count edges leaving each node
+            next[s][m_graph.edge(edgeAt(i)).from]++;
+    });
+    
+    m_graph.adjStart.assign(numNodes + 1, 0);
+    auto nodeRange = [&](int s, int& begin, int& end) {
+        begin = (int)((long long)numNodes * s / slices);
+        end = (int)((long long)numNodes * (s + 1) / slices);
+    };
+    runParallel(slices, threads, [&](int s) {
+        int begin, end;
+        nodeRange(s, begin, end);
+        for (int n = begin; n < end; n++)
+            for (int t = 0; t < slices; t++)
+                m_graph.adjStart[n + 1] += next[t][n];
+    });
+    for (int n = 0; n < numNodes; n++) // Turn counts into starting offsets
+        m_graph.adjStart[n + 1] += m_graph.adjStart[n];
+    runParallel(slices, threads, [&](int s) {
+        int begin, end;
+        nodeRange(s, begin, end);
+        for (int n = begin; n < end; n++)
+            for (int t = 0, slot = m_graph.adjStart[n]; t < slices; t++) // Each slice's first slot at this node
+            {
+                int count = next[t][n];
+                next[t][n] = slot;
+                slot += count;
+            }
+    });
+    
+    m_graph.adjEdges.resize(numEdges);
+    runParallel(slices, threads, [&](int s) {
+        for (int i = first(s); i < first(s + 1); i++)
+        {
+            int e = edgeAt(i);
+            m_graph.adjEdges[next[s][m_graph.edge(e).from]++] = e;
+        }
+    });
+}
+
 //******************** StreetMap functions ************************************
 
 // These functions simply delegate to StreetMapImpl's functions.
@@ -141,7 +1049,107 @@ bool StreetMap::load(string mapFile)
     return m_impl->load(mapFile);
 }
 
+void StreetMap::setCompactStorage(bool compact)
+{
+    m_impl->setCompactStorage(compact);
+}
+
+void StreetMap::setLoadThreads(int threads)
+{
+    m_impl->setLoadThreads(threads);
+}
+
+void StreetMap::memoryUsage(MapMemoryUsage& usage) const
+{
+    m_impl->memoryUsage(usage);
+}
+
+const LoadStats& StreetMap::loadStats() const
+{
+    return m_impl->loadStats();
+}
+
 bool StreetMap::getSegmentsThatStartWith(const GeoCoord& gc, vector<StreetSegment>& segs) const
 {
    return m_impl->getSegmentsThatStartWith(gc, segs);
 }
+
+const StreetGraph& StreetMap::graph() const
+{
+    return m_impl->graph();
+}
+
+int StreetMap::nodeAt(const GeoCoord& gc) const
+{
+    return m_impl->nodeAt(gc);
+}
+
+int StreetMap::streetId(const string& name) const
+{
+    return m_impl->streetId(name);
+}
+
+bool StreetMap::snapToNode(const GeoCoord& gc, GeoCoord& snapped) const
+{
+    return m_impl->snapToNode(gc, snapped);
+}
+
+bool StreetMap::snapToSegment(const GeoCoord& gc, StreetSegment& seg, GeoCoord& onSegment) const
+{
+    return m_impl->snapToSegment(gc, seg, onSegment);
+}
+
+int StreetMap::snapToNodes(vector<GeoCoord>& coords) const
+{
+    return m_impl->snapToNodes(coords);
+}
+
+void StreetMap::getSegmentsInBox(const GeoCoord& southWest, const GeoCoord& northEast, vector<StreetSegment>& segs) const
+{
+    m_impl->getSegmentsInBox(southWest, northEast, segs);
+}
+
+void StreetMap::getSegmentsWithinRadius(const GeoCoord& center, double radiusMiles, vector<StreetSegment>& segs) const
+{
+    m_impl->getSegmentsWithinRadius(center, radiusMiles, segs);
+}
+
+void StreetMap::reorderForLocality()
+{
+    m_impl->reorderForLocality();
+}
+
+bool StreetMap::addSegment(const GeoCoord& start, const GeoCoord& end, string streetName)
+{
+    return m_impl->addSegment(start, end, streetName);
+}
+
+bool StreetMap::removeSegment(const GeoCoord& start, const GeoCoord& end)
+{
+    return m_impl->removeSegment(start, end);
+}
+
+bool StreetMap::setSegmentOpen(const GeoCoord& start, const GeoCoord& end, bool open)
+{
+    return m_impl->setSegmentOpen(start, end, open);
+}
+
+bool StreetMap::setSegmentCostFactor(const GeoCoord& start, const GeoCoord& end, double factor)
+{
+    return m_impl->setSegmentCostFactor(start, end, factor);
+}
+
+void StreetMap::buildTurnGraph()
+{
+    m_impl->buildTurnGraph();
+}
+
+const TurnGraph* StreetMap::turnGraph() const
+{
+    return m_impl->turnGraph();
+}
+
+const ChainGraph* StreetMap::chainGraph() const
+{
+    return m_impl->chainGraph();
+}
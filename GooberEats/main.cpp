@@ -1,19 +1,51 @@
 #include "provided.h"
+#include "support.h"
 #include <iostream>
 #include <fstream>
 #include <sstream>
 #include <string>
 #include <vector>
+#include <cstdlib>
 using namespace std;
 
 bool loadDeliveryRequests(string deliveriesFile, GeoCoord& depot, vector<DeliveryRequest>& v);
-bool parseDelivery(string line, string& lat, string& lon, string& item);
 
 int main(int argc, char *argv[])
 {
-    if (argc != 3)
+    if (argc >= 3 && string(argv[1]) == "-bench")
+        return runBenchmarks(argv[2], vector<string>(argv + 3, argv + argc));
+    if (argc >= 3 && string(argv[1]) == "-check")
+        return runChecks(argv[2], vector<string>(argv + 3, argv + argc));
+    if ((argc == 3 || argc == 4) && string(argv[1]) == "-serve")
     {
-        cout << "Usage: " << argv[0] << " mapdata.txt deliveries.txt" << endl;
+        StreetMap sm;
+        if (!sm.load(argv[2]))
+        {
+            cerr << "Unable to load map data file " << argv[2] << endl;
+            return 1;
+        }
+        ios::sync_with_stdio(false);
+        return runServer(sm, cin, cout, argc == 4 ? atoi(argv[3]) : 2);
+    }
+
+    bool snap = false, polyline = false;
+    bool badOption = argc < 3;
+    for (int i = 3; i < argc; i++)
+    {
+        string option = argv[i];
+        if (option == "-snap")
+            snap = true;
+        else if (option == "-polyline") // Print the route to draw instead of directions
+            polyline = true;
+        else
+            badOption = true;
+    }
+    if (badOption)
+    {
+        cout << "Usage: " << argv[0] << " mapdata.txt deliveries.txt [-snap] [-polyline]" << endl;
+        cout << "       " << argv[0] << " -bench mapdata.txt [-sizes 1,10,100,1000] [benchmark...]" << endl;
+        cout << "       " << argv[0] << " -check mapdata.txt [check...]" << endl;
+        cout << "       " << argv[0] << " -serve mapdata.txt [threads]" << endl;
         return 1;
     }
 
@@ -36,9 +68,11 @@ int main(int argc, char *argv[])
     cout << "Generating route...\n\n";
 
     DeliveryPlanner dp(&sm);
-    vector<DeliveryCommand> dcs;
+    dp.setSnapToMap(snap); // Move off-map coords to the nearest map node instead of failing
+    vector<PlanCommand> plan;
     double totalMiles;
-    DeliveryResult result = dp.generateDeliveryPlan(depot, deliveries, dcs, totalMiles);
+    RouteGeometry geometry;
+    DeliveryResult result = dp.generateCompactPlan(depot, deliveries, plan, totalMiles, polyline ? &geometry : nullptr);
     if (result == BAD_COORD)
     {
         cout << "One or more depot or delivery coordinates are invalid." << endl;
@@ -49,32 +83,32 @@ int main(int argc, char *argv[])
         cout << "No route can be found to deliver all items." << endl;
         return 1;
     }
-    cout << "Starting at the depot...\n";
-    for (const auto& dc : dcs)
-        cout << dc.description() << endl;
-    cout << "You are back at the depot and your deliveries are done!\n";
     cout.setf(ios::fixed);
     cout.precision(2);
+    if (polyline)
+    {
+        string encoded;
+        encodePolyline(geometry, 5, encoded);
+        cout << encoded << "\n";
+        for (size_t i = 0; i < geometry.legMiles.size(); i++)
+            cout << "Leg " << i + 1 << ": " << geometry.legMiles[i] << " miles\n";
+        cout << totalMiles << " miles travelled for all deliveries." << endl;
+        return 0;
+    }
+    string directions; // Render all commands into one buffer
+    renderCommands(plan, sm.graph(), deliveries, directions);
+    cout << "Starting at the depot...\n" << directions;
+    cout << "You are back at the depot and your deliveries are done!\n";
     cout << totalMiles << " miles travelled for all deliveries." << endl;
 }
 
 bool loadDeliveryRequests(string deliveriesFile, GeoCoord& depot, vector<DeliveryRequest>& v)
 {
-    ifstream inf(deliveriesFile);
-    if (!inf)
+    DeliveryFile file; // Parsed in place, without copying lines
+    if (!file.open(deliveriesFile))
         return false;
-    string lat;
-    string lon;
-    inf >> lat >> lon;
-    inf.ignore(10000, '\n');
-    depot = GeoCoord(lat, lon);
-    string line;
-    while (getline(inf, line))
-    {
-        string item;
-        if (parseDelivery(line, lat, lon, item))
-            v.push_back(DeliveryRequest(item, GeoCoord(lat, lon)));
-    }
+    depot = file.depot();
+    file.toRequests(v);
     return true;
 }
 
@@ -72,6 +72,11 @@ bool operator==(const StreetSegment& lhs, const StreetSegment& rhs)
 }
 
 class StreetMapImpl;
+struct StreetGraph;
+struct LoadStats;
+struct MapMemoryUsage;
+struct TurnGraph;
+struct ChainGraph;
 
 class StreetMap
 {
@@ -79,7 +84,57 @@ public:
     StreetMap();
     ~StreetMap();
     bool load(std::string mapFile);
+      // Compact storage (call before the first load; later loads keep what the map already uses):
+      // no GeoCoord text is kept, nodes are looked up by their coords in 1e-7 degree units, and
+      // street names are stored once.  Needs every coord in the file written with exactly seven
+      // decimals, as in mapdata.txt; otherwise the first load falls back to normal storage, and a
+      // later one fails.  GeoCoords handed out are rebuilt from the numbers and compare equal.
+    void setCompactStorage(bool compact);
+      // Threads load parses the file and builds the graph on (call before load); 0, the default,
+      // means one per core.  The loaded map is the same whatever the number.
+    void setLoadThreads(int threads);
+      // Bytes held by each part of the map (see support.h)
+    void memoryUsage(MapMemoryUsage& usage) const;
+      // Timings and counts from the last load (only collected in GOOBEREATS_STATS builds, see support.h)
+    const LoadStats& loadStats() const;
     bool getSegmentsThatStartWith(const GeoCoord& gc, std::vector<StreetSegment>& segs) const;
+      // Flat node/edge view of the loaded map (see support.h)
+    const StreetGraph& graph() const;
+      // Node id of gc in graph(), or -1 if gc is not a segment endpoint
+    int nodeAt(const GeoCoord& gc) const;
+      // Index of a street name in graph().streetNames, or -1 if no street has that name
+    int streetId(const std::string& name) const;
+      // Closest segment endpoint to gc, for coords that don't exactly match the map
+    bool snapToNode(const GeoCoord& gc, GeoCoord& snapped) const;
+      // Closest street segment to gc, and the point on it closest to gc
+    bool snapToSegment(const GeoCoord& gc, StreetSegment& seg, GeoCoord& onSegment) const;
+      // snapToNode for a whole batch in place; returns how many coords moved
+    int snapToNodes(std::vector<GeoCoord>& coords) const;
+      // All segments with any part inside the box with corners southWest and northEast
+    void getSegmentsInBox(const GeoCoord& southWest, const GeoCoord& northEast, std::vector<StreetSegment>& segs) const;
+      // All segments that pass within radiusMiles of center
+    void getSegmentsWithinRadius(const GeoCoord& center, double radiusMiles, std::vector<StreetSegment>& segs) const;
+      // Renumber nodes and edges along a Hilbert curve so nodes close on the map are close in
+      // memory.  Optional; call after load and before creating routers for this map.
+    void reorderForLocality();
+      // Runtime updates, without reloading.  A segment is named by its two end coords (in
+      // either order) and the change applies in both directions.  Routers built on this map
+      // patch whatever they have precomputed the next time they are used.  A coord whose last
+      // segment is removed is no longer found by nodeAt, but keeps its node id if one is added back.
+    bool addSegment(const GeoCoord& start, const GeoCoord& end, std::string streetName);
+    bool removeSegment(const GeoCoord& start, const GeoCoord& end);
+      // Temporarily close (or reopen) a segment, e.g. for construction
+    bool setSegmentOpen(const GeoCoord& start, const GeoCoord& end, bool open);
+      // Routing cost of a segment becomes its length times factor (factor must be >= 1)
+    bool setSegmentCostFactor(const GeoCoord& start, const GeoCoord& end, double factor);
+      // Build the edge based graph used for routing with turn costs (see support.h) once, to be
+      // shared by every router; it is kept up to date through later changes.  Routers that need
+      // one when none was built make their own.
+    void buildTurnGraph();
+    const TurnGraph* turnGraph() const; // nullptr until buildTurnGraph is called
+      // The map with chains of segments between intersections collapsed (see support.h), built
+      // at load and kept up to date.  Routers search it instead of the full graph.
+    const ChainGraph* chainGraph() const;
       // We prevent a StreetMap object from being copied or assigned.
     StreetMap(const StreetMap&) = delete;
     StreetMap& operator=(const StreetMap&) = delete;
@@ -88,6 +143,10 @@ private:
 };
 
 class PointToPointRouterImpl;
+struct RoutePath;
+struct RouterStats;
+class MonotonicArena;
+struct TurnCosts;
 
 class PointToPointRouter
 {
@@ -99,6 +158,38 @@ public:
         const GeoCoord& end,
         std::list<StreetSegment>& route,
         double& totalDistanceTravelled) const;
+      // Same route as edge ids with running distances (see support.h), appended to path
+    DeliveryResult generatePointToPointPath(
+        const GeoCoord& start,
+        const GeoCoord& end,
+        RoutePath& path) const;
+      // Faster, approximate version: the route found costs at most bound (>= 1) times the
+      // shortest one, in the router's cost (StreetEdge::weight, so miles can be off a bit more).
+      // Suboptimality is set to the factor this route is guaranteed to be within, which is
+      // often well under bound (1 when the route is known to be shortest).
+    DeliveryResult generateApproximatePath(
+        const GeoCoord& start,
+        const GeoCoord& end,
+        double bound,
+        RoutePath& path,
+        double& suboptimality) const;
+      // Precompute shortest path trees to and from depot so routes that start or end there
+      // need no search.  Returns false if depot is not on the map.
+    bool registerDepot(const GeoCoord& depot);
+      // Bytes held by the trees of all registered depots
+    size_t depotMemoryUsage() const;
+      // Counters from the last query (only collected in GOOBEREATS_STATS builds, see support.h)
+    const RouterStats& stats() const;
+      // Take search scratch space from arena instead of the heap (nullptr for the heap again).
+      // The arena must outlive the router or be swapped out before it is released.
+    void setArena(MonotonicArena* arena);
+      // Route so that turns and U-turns cost extra (see support.h), over the map's turn graph.
+      // A U-turn left unpriced costs twice the dearer turn.  Depot trees are skipped while turn
+      // costs are on.
+    void setTurnCosts(const TurnCosts& costs);
+      // Search the map's chain graph (the default) or every node of the full graph.  Routes come
+      // out the same either way; the chain graph just has far fewer nodes to expand.
+    void setChainShortcuts(bool enabled);
       // We prevent a PointToPointRouter object from being copied or assigned.
     PointToPointRouter(const PointToPointRouter&) = delete;
     PointToPointRouter& operator=(const PointToPointRouter&) = delete;
@@ -116,6 +207,7 @@ struct DeliveryRequest
 };
 
 class DeliveryOptimizerImpl;
+struct OptimizerStats;
 
 class DeliveryOptimizer
 {
@@ -127,6 +219,22 @@ public:
         std::vector<DeliveryRequest>& deliveries,
         double& oldCrowDistance,
         double& newCrowDistance) const;
+      // Same, but leaves deliveries alone and gives the new order as indexes into it
+    void optimizeDeliveryOrder(
+        const GeoCoord& depot,
+        const std::vector<DeliveryRequest>& deliveries,
+        std::vector<int>& order,
+        double& oldCrowDistance,
+        double& newCrowDistance) const;
+      // Counters from the last call (only collected in GOOBEREATS_STATS builds, see support.h)
+    const OptimizerStats& stats() const;
+      // Take temporaries from arena instead of the heap (nullptr for the heap again)
+    void setArena(MonotonicArena* arena);
+      // For batches of thousands of stops, which the one by one search is too slow for: more
+      // than maxZoneStops deliveries are split into zones of nearby stops, each zone's tour is
+      // found on one of threads threads (0 means one per core), and the zones are visited in
+      // turn.  0, the default, never splits.  The arena isn't used for zones.
+    void setZones(int maxZoneStops, int threads = 0);
       // We prevent a DeliveryOptimizer object from being copied or assigned.
     DeliveryOptimizer(const DeliveryOptimizer&) = delete;
     DeliveryOptimizer& operator=(const DeliveryOptimizer&) = delete;
@@ -209,6 +317,8 @@ private:
 };
 
 class DeliveryPlannerImpl;
+struct PlanCommand;
+struct RouteGeometry;
 
 class DeliveryPlanner
 {
@@ -220,6 +330,27 @@ public:
         const std::vector<DeliveryRequest>& deliveries,
         std::vector<DeliveryCommand>& commands,
         double& totalDistanceTravelled) const;
+      // Same plan as compact PlanCommands (see support.h) that refer to streets and deliveries
+      // by index instead of holding strings; render them with renderCommands. If geometry isn't
+      // null it's filled in with the route's points and per leg miles, for drawing the route
+      // (encode it with encodePolyline or encodeBinaryGeometry).
+    DeliveryResult generateCompactPlan(
+        const GeoCoord& depot,
+        const std::vector<DeliveryRequest>& deliveries,
+        std::vector<PlanCommand>& commands,
+        double& totalDistanceTravelled,
+        RouteGeometry* geometry = nullptr) const;
+      // When on, the depot and delivery coords are snapped to the nearest map node before
+      // planning instead of failing with BAD_COORD (off by default)
+    void setSnapToMap(bool snap);
+      // Route every leg with these turn costs (see PointToPointRouter::setTurnCosts); call
+      // StreetMap::buildTurnGraph first so plans don't each build their own turn graph
+    void setTurnCosts(const TurnCosts& costs);
+      // Order big batches by zones (see DeliveryOptimizer::setZones)
+    void setZones(int maxZoneStops, int threads = 0);
+      // Take each plan's temporaries from one arena freed when the plan is done (the default),
+      // or from the heap one by one, to compare the two
+    void setArenaEnabled(bool enabled);
       // We prevent a DeliveryPlanner object from being copied or assigned.
     DeliveryPlanner(const DeliveryPlanner&) = delete;
     DeliveryPlanner& operator=(const DeliveryPlanner&) = delete;
@@ -227,6 +358,48 @@ private:
     DeliveryPlannerImpl* m_impl;
 };
 
+class DeliverySessionImpl;
+
+// A delivery plan kept up to date while the driver is out, so an order added or cancelled on the
+// way doesn't mean planning again from scratch.  The session holds the stops still to make in
+// tour order, where the driver is, and the route of every leg.  A new stop goes where it adds the
+// least straight line distance, the stops around a change are then reordered if that shortens the
+// tour, and only legs whose ends changed are routed again, along with any a map change spoiled.
+class DeliverySession
+{
+public:
+    DeliverySession(const StreetMap* sm);
+    ~DeliverySession();
+      // Plans the tour from scratch, the same way DeliveryPlanner does, with the driver at the
+      // depot.  Delivery ids are indexes in deliveries.
+    DeliveryResult start(const GeoCoord& depot, const std::vector<DeliveryRequest>& deliveries);
+      // Adds a stop to the rest of the tour and sets id to the delivery's id.  The tour is left
+      // as it was if the delivery can't be reached.
+    DeliveryResult addDelivery(const DeliveryRequest& delivery, int& id);
+      // Drops a delivery not yet made; false if there is no such delivery waiting
+    bool cancelDelivery(int id);
+      // The driver has made the next delivery on the tour; false if there are none left
+    bool deliverNext();
+      // The driver is now at location (a map node), somewhere before the next stop
+    DeliveryResult moveDriver(const GeoCoord& location);
+      // Commands and distance from where the driver is, through every delivery left, back to
+      // the depot
+    DeliveryResult currentPlan(std::vector<DeliveryCommand>& commands, double& totalDistanceTravelled) const;
+      // Same as compact commands (see support.h); delivery indexes in them are ids in deliveries()
+    DeliveryResult currentCompactPlan(std::vector<PlanCommand>& commands, double& totalDistanceTravelled) const;
+      // Every delivery the session has been given, indexed by id
+    const std::vector<DeliveryRequest>& deliveries() const;
+      // Ids of the deliveries still to make, in the order they will be made
+    const std::vector<int>& remainingDeliveries() const;
+      // Legs routed by the last call that changed the tour (the rest were reused)
+    int legsRouted() const;
+      // We prevent a DeliverySession object from being copied or assigned.
+    DeliverySession(const DeliverySession&) = delete;
+    DeliverySession& operator=(const DeliverySession&) = delete;
+private:
+    DeliverySessionImpl* m_impl;
+};
+
 // Tools for computing distance between GeoCoords, angle of a StreetSegment,
 // and angle between two StreetSegments 
 
@@ -7,3 +7,1336 @@
 //
 
 #include "support.h"
+#include <cmath>
+#include <algorithm>
+#include <float.h>
+#include <sstream>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <climits>
+#include <unordered_map>
+#include <unordered_set>
+#include <thread>
+#include <atomic>
+using namespace std;
+
+GeoCoord StreetGraph::coord(int n) const
+{
+    if (!compact)
+        return nodes[n];
+    char lat[32], lon[32]; // Text wasn't kept, but every coord was written exactly like this
+    writeFixedCoord(toFixedCoord(points[n].latitude), lat);
+    writeFixedCoord(toFixedCoord(points[n].longitude), lon);
+    return GeoCoord(lat, lon);
+}
+
+StreetSegment StreetGraph::segment(int e) const
+{
+    StreetEdge forward = edge(e);
+    return StreetSegment(coord(forward.from), coord(forward.to), streetNames[forward.street]);
+}
+
+double StreetGraph::miles(int e) const
+{
+    if (!compact)
+        return shapes[e >> 1].miles;
+    const StreetEdge& segment = segments[e >> 1]; // The same either way, so no need to turn it around
+    return distanceEarthMiles(points[segment.from], points[segment.to]);
+}
+
+double StreetGraph::angle(int e) const
+{
+    if (!compact)
+        return shapes[e >> 1].angles[e & 1];
+    StreetEdge directed = edge(e);
+    return lineAngle(points[directed.from], points[directed.to]);
+}
+
+int StreetGraph::compass(int e) const
+{
+    return compact ? (int)compassDirection(angle(e)) : shapes[e >> 1].compass[e & 1];
+}
+
+bool StreetGraph::isolated(int n) const
+{
+    for (int i = adjStart[n]; i < adjStart[n+1]; i++)
+        if (segments[adjEdges[i] >> 1].state != StreetEdge::REMOVED)
+            return false;
+    return true;
+}
+
+double StreetEdge::cost() const
+{
+    return usable() ? weight : DBL_MAX;
+}
+
+double coordDistance(const GeoCoord& start, const GeoCoord& end)
+{
+    // Uses pythagorean theorem
+    return std::sqrt((end.latitude - start.latitude) * (end.latitude - start.latitude) + (end.longitude - start.longitude) * (end.longitude - start.longitude));
+}
+
+double coordDistance(const NodePoint& start, const NodePoint& end)
+{
+    return std::sqrt((end.latitude - start.latitude) * (end.latitude - start.latitude) + (end.longitude - start.longitude) * (end.longitude - start.longitude));
+}
+
+double distanceEarthMiles(const NodePoint& start, const NodePoint& end)
+{
+    // distanceEarthKM and distanceEarthMiles step for step, so the result is the same to the bit
+    const double earthRadiusKm = 6371.0;
+    const double milesPerKm = 1 / 1.609344;
+    double lat1r = deg2rad(start.latitude);
+    double lon1r = deg2rad(start.longitude);
+    double lat2r = deg2rad(end.latitude);
+    double lon2r = deg2rad(end.longitude);
+    double u = std::sin((lat2r - lat1r) / 2);
+    double v = std::sin((lon2r - lon1r) / 2);
+    return 2.0 * earthRadiusKm * std::asin(std::sqrt(u * u + std::cos(lat1r) * std::cos(lat2r) * v * v)) * milesPerKm;
+}
+
+long long toFixedCoord(double degrees)
+{
+    return llround(degrees * 1e7);
+}
+
+void writeFixedCoord(long long fixed, char* text)
+{
+    // Sign, whole degrees, then exactly seven decimal places
+    unsigned long long magnitude = fixed < 0 ? -(unsigned long long)fixed : fixed;
+    snprintf(text, 32, "%s%llu.%07llu", fixed < 0 ? "-" : "", magnitude / 10000000, magnitude % 10000000);
+}
+
+bool isFixedCoordText(const string& text, double degrees)
+{
+    char canonical[32];
+    writeFixedCoord(toFixedCoord(degrees), canonical);
+    return text == canonical;
+}
+
+GeoCoord makeGeoCoord(double lat, double lon)
+{
+    ostringstream latText, lonText;
+    latText.setf(ios::fixed);
+    latText.precision(7);
+    lonText.setf(ios::fixed);
+    lonText.precision(7);
+    latText << lat;
+    lonText << lon;
+    return GeoCoord(latText.str(), lonText.str());
+}
+
+void runParallel(int tasks, int threads, const function<void(int)>& task)
+{
+    threads = max(1, min(threads, tasks));
+    atomic<int> next(0);
+    auto work = [&] {
+        for (int t = next++; t < tasks; t = next++)
+            task(t);
+    };
+    vector<thread> helpers;
+    for (int i = 1; i < threads; i++)
+        helpers.push_back(thread(work));
+    work();
+    for (thread& helper : helpers)
+        helper.join();
+}
+
+int hardwareThreads()
+{
+    return max(1, (int)thread::hardware_concurrency());
+}
+
+//******************** MapMemoryUsage functions *******************************
+
+size_t MapMemoryUsage::total() const
+{
+    return coords + points + coordIndex + streetNames + nameIndex + edges + adjacency + changes + spatialGrid + turnGraph + chainGraph;
+}
+
+string MapMemoryUsage::toJson() const
+{
+    ostringstream out;
+    out << "{\"coords\":" << coords << ",\"points\":" << points << ",\"coord_index\":" << coordIndex
+        << ",\"street_names\":" << streetNames << ",\"name_index\":" << nameIndex << ",\"edges\":" << edges
+        << ",\"adjacency\":" << adjacency << ",\"changes\":" << changes << ",\"spatial_grid\":" << spatialGrid
+        << ",\"turn_graph\":" << turnGraph << ",\"chain_graph\":" << chainGraph
+        << ",\"total\":" << total() << "}";
+    return out.str();
+}
+
+size_t stringBytes(const string& s)
+{
+    const char* object = reinterpret_cast<const char*>(&s);
+    if (s.data() >= object && s.data() < object + sizeof(s)) // Short string stored inside the object
+        return 0;
+    return s.capacity() + 1;
+}
+
+//******************** WeightPerMile functions ********************************
+
+void WeightPerMile::count(const StreetGraph& graph, int upTo)
+{
+    for (; edges < upTo; edges++)
+    {
+        StreetEdge e = graph.edge(edges);
+        degrees += coordDistance(graph.points[e.from], graph.points[e.to]);
+        miles += graph.miles(edges);
+    }
+}
+
+//******************** TurnGraph functions ************************************
+
+void TurnGraph::build(const StreetGraph& graph)
+{
+    turnStart.assign(1, 0);
+    turnStart.reserve(graph.numEdges() + 1);
+    turnEdges.clear();
+    turnAngles.clear();
+    turnEdges.reserve(graph.adjEdges.size() * 2);
+    turnAngles.reserve(graph.adjEdges.size() * 2);
+    for (int e = 0; e < graph.numEdges(); e++)
+    {
+        // Every edge leaving the node e ends at, removed ones too since they can come back
+        int node = graph.edge(e).to;
+        for (int i = graph.adjStart[node]; i < graph.adjStart[node+1]; i++)
+        {
+            turnEdges.push_back(graph.adjEdges[i]);
+            turnAngles.push_back((float)turnAngle(graph, e, graph.adjEdges[i]));
+        }
+        turnStart.push_back((int)turnEdges.size());
+    }
+    weightPerMile = WeightPerMile();
+    weightPerMile.count(graph, graph.numEdges());
+}
+
+void TurnGraph::addSegment(const StreetGraph& graph, int e)
+{
+    // Edges already here that end where a new edge starts can now turn onto it. Adjacency lists keep
+    // edges in id order, so it goes last in their lists, as build would put it.
+    for (int half = 0; half < 2; half++)
+    {
+        int next = e + half;
+        int node = graph.edge(next).from;
+        for (int i = graph.adjStart[node]; i < graph.adjStart[node+1]; i++)
+        {
+            int before = graph.adjEdges[i] ^ 1; // Ends at node
+            if (before >= e) // The new pair, or one added after it that a later call will see to
+                continue;
+            int at = turnStart[before+1];
+            turnEdges.insert(turnEdges.begin() + at, next);
+            turnAngles.insert(turnAngles.begin() + at, (float)turnAngle(graph, before, next));
+            for (size_t k = before + 1; k < turnStart.size(); k++)
+                turnStart[k]++;
+        }
+    }
+    // And the new edges' own lists, leaving out any edges added after them
+    for (int half = 0; half < 2; half++)
+    {
+        int node = graph.edge(e + half).to;
+        for (int i = graph.adjStart[node]; i < graph.adjStart[node+1]; i++)
+            if (graph.adjEdges[i] <= e + 1)
+            {
+                turnEdges.push_back(graph.adjEdges[i]);
+                turnAngles.push_back((float)turnAngle(graph, e + half, graph.adjEdges[i]));
+            }
+        turnStart.push_back((int)turnEdges.size());
+    }
+    weightPerMile.count(graph, e + 2);
+}
+
+double TurnGraph::turnAngle(const StreetGraph& graph, int e, int next)
+{
+    double angle = graph.angle(next) - graph.angle(e); // Same as angleBetween2Lines
+    if (angle < 0)
+        angle += 360;
+    return angle;
+}
+
+
+size_t TurnGraph::memoryUsage() const
+{
+    return vectorBytes(turnStart) + vectorBytes(turnEdges) + vectorBytes(turnAngles);
+}
+
+//******************** ChainGraph functions ************************************
+
+// A node can be interior if it has exactly two neighbors, neither of them itself. Parallel segments
+// or a loop back to the same node make it an end, so every shortcut is a plain run of nodes.
+static bool canBeInterior(const StreetGraph& graph, int n)
+{
+    if (graph.adjStart[n+1] - graph.adjStart[n] != 2)
+        return false;
+    int a = graph.edge(graph.adjEdges[graph.adjStart[n]]).to;
+    int b = graph.edge(graph.adjEdges[graph.adjStart[n]+1]).to;
+    return a != b && a != n && b != n;
+}
+
+void ChainGraph::build(const StreetGraph& graph)
+{
+    int numNodes = graph.numNodes();
+    nodeShortcut.assign(numNodes, -1);
+    vector<char> isInterior(numNodes, 0);
+    for (int n = 0; n < numNodes; n++)
+        isInterior[n] = canBeInterior(graph, n);
+    nodePosition.assign(numNodes, 0);
+    shortcuts.clear();
+    chainEdges.clear();
+    chainEdges.reserve(graph.numEdges());
+    vector<int> edgeShortcut(graph.numEdges(), -1); // Shortcut each edge was put in, in driving order
+    vector<int> run;
+
+    // Follow every edge out of an end node along its chain to the next end node. A ring of interior
+    // nodes has no end node to start from, so its first node is made one.
+    for (int pass = 0; pass < 2; pass++)
+        for (int n = 0; n < numNodes; n++)
+        {
+            if (isInterior[n])
+            {
+                if (pass == 0 || nodeShortcut[n] != -1)
+                    continue;
+                isInterior[n] = 0; // Still unvisited on the second pass, so on a ring
+            }
+            for (int i = graph.adjStart[n]; i < graph.adjStart[n+1]; i++)
+            {
+                int e = graph.adjEdges[i];
+                if (edgeShortcut[e] != -1) // Already walked from the other end
+                    continue;
+                run.assign(1, e);
+                int node = graph.edge(e).to;
+                while (isInterior[node])
+                {
+                    int next = graph.adjEdges[graph.adjStart[node]];
+                    if (next == (run.back() ^ 1)) // Don't turn back the way we came
+                        next = graph.adjEdges[graph.adjStart[node]+1];
+                    run.push_back(next);
+                    node = graph.edge(next).to;
+                }
+                // The forward shortcut, then the same edges' twins backwards
+                int s = (int)shortcuts.size();
+                int count = (int)run.size();
+                shortcuts.push_back(Shortcut{n, node, (int)chainEdges.size(), count});
+                for (int p = 0; p < count; p++)
+                {
+                    chainEdges.push_back(run[p]);
+                    edgeShortcut[run[p]] = s;
+                    if (p > 0)
+                    {
+                        nodeShortcut[graph.edge(run[p]).from] = s;
+                        nodePosition[graph.edge(run[p]).from] = p;
+                    }
+                }
+                shortcuts.push_back(Shortcut{node, n, (int)chainEdges.size(), count});
+                for (int p = count - 1; p >= 0; p--)
+                {
+                    chainEdges.push_back(run[p] ^ 1);
+                    edgeShortcut[run[p] ^ 1] = s + 1;
+                }
+            }
+        }
+
+    // Shortcuts leaving each end node, in the same order as its edges
+    adjStart.assign(numNodes + 1, 0);
+    adjShortcuts.clear();
+    adjShortcuts.reserve(shortcuts.size());
+    for (int n = 0; n < numNodes; n++)
+    {
+        if (!interior(n))
+            for (int i = graph.adjStart[n]; i < graph.adjStart[n+1]; i++)
+                adjShortcuts.push_back(edgeShortcut[graph.adjEdges[i]]);
+        adjStart[n+1] = (int)adjShortcuts.size();
+    }
+}
+
+void ChainGraph::addSegment(const StreetGraph& graph, int e)
+{
+    int numNodes = graph.numNodes();
+    nodeShortcut.resize(numNodes, -1); // New nodes start out as ends with no shortcuts
+    nodePosition.resize(numNodes, 0);
+    adjStart.resize(numNodes + 1, adjStart.back());
+    int ends[2] = { graph.edge(e).from, graph.edge(e).to };
+
+    // The chains that change: one through an end of the new segment, which makes it an end, and one
+    // ending at a dead end the new segment carries on from, which makes that interior
+    vector<int> removed; // Lower ids of the shortcut pairs to walk again
+    for (int n : ends)
+        if (interior(n))
+            removed.push_back(nodeShortcut[n]);
+        else if (canBeInterior(graph, n))
+            removed.push_back(adjShortcuts[adjStart[n]] & ~1);
+    sort(removed.begin(), removed.end());
+    removed.erase(unique(removed.begin(), removed.end()), removed.end());
+    vector<int> madeEnds; // Nodes on a ring of interior nodes the new segment closed, made ends like build does
+    auto interiorNow = [&](int n) {
+        if (find(madeEnds.begin(), madeEnds.end(), n) != madeEnds.end())
+            return false;
+        return n == ends[0] || n == ends[1] ? canBeInterior(graph, n) : interior(n);
+    };
+
+    // Walk those chains again, along with the new segment, from end node to end node
+    vector<int> pool(1, e);
+    for (int s : removed)
+        pool.insert(pool.end(), chainEdges.begin() + shortcuts[s].first, chainEdges.begin() + shortcuts[s].first + shortcuts[s].count);
+    unordered_set<int> walked;
+    vector<vector<int>> runs;
+    for (int start : pool)
+    {
+        if (walked.count(start))
+            continue;
+        int first = start; // Back up to the end node its chain starts from
+        while (interiorNow(graph.edge(first).from))
+        {
+            int node = graph.edge(first).from;
+            int other = graph.adjEdges[graph.adjStart[node]];
+            if (other == first)
+                other = graph.adjEdges[graph.adjStart[node]+1];
+            first = other ^ 1;
+            if (first == start) // All the way around a ring
+            {
+                madeEnds.push_back(graph.edge(start).from);
+                break;
+            }
+        }
+        vector<int> run(1, first);
+        int node = graph.edge(first).to;
+        while (interiorNow(node))
+        {
+            int next = graph.adjEdges[graph.adjStart[node]];
+            if (next == (run.back() ^ 1)) // Don't turn back the way we came
+                next = graph.adjEdges[graph.adjStart[node]+1];
+            run.push_back(next);
+            node = graph.edge(next).to;
+        }
+        for (int r : run)
+        {
+            walked.insert(r);
+            walked.insert(r ^ 1);
+        }
+        runs.push_back(move(run));
+    }
+
+    // Take the old chains' edges out of chainEdges, closing up the gaps
+    for (int s : removed)
+    {
+        int at = shortcuts[s].first, length = 2 * shortcuts[s].count; // A pair's edges are side by side
+        chainEdges.erase(chainEdges.begin() + at, chainEdges.begin() + at + length);
+        for (Shortcut& shortcut : shortcuts)
+            if (shortcut.first > at)
+                shortcut.first -= length;
+    }
+    for (int n : ends)
+        if (!interiorNow(n))
+            nodeShortcut[n] = -1;
+    for (int n : madeEnds)
+        nodeShortcut[n] = -1;
+
+    // Put the new chains in the old ones' places, then on the end
+    unordered_map<int, int> startShortcut; // First edge of each new shortcut -> its id
+    for (size_t i = 0; i < runs.size(); i++)
+    {
+        const vector<int>& run = runs[i];
+        int s = i < removed.size() ? removed[i] : (int)shortcuts.size();
+        if (s == (int)shortcuts.size())
+            shortcuts.resize(s + 2);
+        int from = graph.edge(run[0]).from, to = graph.edge(run.back()).to, count = (int)run.size();
+        shortcuts[s] = Shortcut{from, to, (int)chainEdges.size(), count};
+        for (int p = 0; p < count; p++)
+        {
+            chainEdges.push_back(run[p]);
+            if (p > 0)
+            {
+                nodeShortcut[graph.edge(run[p]).from] = s;
+                nodePosition[graph.edge(run[p]).from] = p;
+            }
+        }
+        shortcuts[s + 1] = Shortcut{to, from, (int)chainEdges.size(), count};
+        for (int p = count - 1; p >= 0; p--)
+            chainEdges.push_back(run[p] ^ 1);
+        startShortcut[run[0]] = s;
+        startShortcut[run.back() ^ 1] = s + 1;
+    }
+
+    // The new segment's ends, and any node made an end, get their shortcut lists redone. Elsewhere
+    // a new shortcut just takes the place of the old one that started with the same edge.
+    vector<int> relist(ends, ends + 2);
+    relist.insert(relist.end(), madeEnds.begin(), madeEnds.end());
+    sort(relist.begin(), relist.end());
+    relist.erase(unique(relist.begin(), relist.end()), relist.end());
+    for (int n : relist)
+    {
+        vector<int> list;
+        if (!interior(n))
+            for (int i = graph.adjStart[n]; i < graph.adjStart[n+1]; i++)
+            {
+                auto it = startShortcut.find(graph.adjEdges[i]);
+                list.push_back(it != startShortcut.end() ? it->second : adjShortcuts[adjStart[n] + i - graph.adjStart[n]]);
+            }
+        int oldLength = adjStart[n+1] - adjStart[n];
+        adjShortcuts.erase(adjShortcuts.begin() + adjStart[n], adjShortcuts.begin() + adjStart[n+1]);
+        adjShortcuts.insert(adjShortcuts.begin() + adjStart[n], list.begin(), list.end());
+        for (int m = n + 1; m <= numNodes; m++) // Shift the lists of every later node along
+            adjStart[m] += (int)list.size() - oldLength;
+    }
+    for (const auto& started : startShortcut)
+    {
+        int n = shortcuts[started.second].from;
+        if (binary_search(relist.begin(), relist.end(), n))
+            continue;
+        for (int i = graph.adjStart[n]; i < graph.adjStart[n+1]; i++)
+            if (graph.adjEdges[i] == started.first)
+                adjShortcuts[adjStart[n] + i - graph.adjStart[n]] = started.second;
+    }
+
+    // Fewer chains than before (two joined into one): move the last pairs into the spare places so
+    // ids stay dense
+    for (size_t i = removed.size(); i-- > runs.size(); )
+    {
+        int spare = removed[i], last = (int)shortcuts.size() - 2;
+        if (spare != last)
+        {
+            shortcuts[spare] = shortcuts[last];
+            shortcuts[spare + 1] = shortcuts[last + 1];
+            const Shortcut& moved = shortcuts[spare];
+            for (int p = 1; p < moved.count; p++)
+                nodeShortcut[graph.edge(chainEdges[moved.first + p]).from] = spare;
+            int movedEnds[2] = { moved.from, moved.to };
+            for (int n : movedEnds)
+                for (int i = adjStart[n]; i < adjStart[n+1]; i++)
+                    if ((adjShortcuts[i] & ~1) == last)
+                        adjShortcuts[i] = spare + (adjShortcuts[i] & 1);
+        }
+        shortcuts.resize(last);
+    }
+}
+
+int ChainGraph::position(int n, int s) const
+{
+    return s == nodeShortcut[n] ? nodePosition[n] : shortcuts[s].count - nodePosition[n];
+}
+
+size_t ChainGraph::memoryUsage() const
+{
+    return vectorBytes(adjStart) + vectorBytes(adjShortcuts) + vectorBytes(shortcuts) + vectorBytes(chainEdges)
+        + vectorBytes(nodeShortcut) + vectorBytes(nodePosition);
+}
+
+//******************** MonotonicArena functions *******************************
+
+MonotonicArena::MonotonicArena(size_t firstBlock)
+ : m_next(nullptr), m_end(nullptr), m_nextBlock(firstBlock), m_used(0)
+{
+}
+
+MonotonicArena::~MonotonicArena()
+{
+    for (const Block& b : m_blocks)
+        ::operator delete(b.data);
+}
+
+void* MonotonicArena::allocate(size_t bytes, size_t align)
+{
+    size_t pad = (align - reinterpret_cast<uintptr_t>(m_next) % align) % align;
+    if (m_next == nullptr || pad + bytes > (size_t)(m_end - m_next))
+    {
+        // Out of room: start a new block, doubling each time so there are few of them
+        while (m_nextBlock < bytes + align)
+            m_nextBlock *= 2;
+        Block b = { static_cast<char*>(::operator new(m_nextBlock)), m_nextBlock };
+        m_blocks.push_back(b);
+        m_next = b.data;
+        m_end = b.data + b.size;
+        m_nextBlock *= 2;
+        pad = (align - reinterpret_cast<uintptr_t>(m_next) % align) % align;
+    }
+    void* p = m_next + pad;
+    m_next += pad + bytes;
+    m_used += bytes;
+    return p;
+}
+
+void MonotonicArena::release()
+{
+    if (m_blocks.empty())
+        return;
+    auto biggest = max_element(m_blocks.begin(), m_blocks.end(), [](const Block& a, const Block& b) { return a.size < b.size; });
+    Block keep = *biggest;
+    for (const Block& b : m_blocks)
+        if (b.data != keep.data)
+            ::operator delete(b.data);
+    m_blocks.assign(1, keep);
+    m_next = keep.data;
+    m_end = keep.data + keep.size;
+    m_used = 0;
+}
+
+//******************** RoutePath functions ************************************
+
+void RoutePath::append(const StreetGraph& graph, int e)
+{
+    edges.push_back(e);
+    cumulativeMiles.push_back(miles() + graph.miles(e));
+}
+
+void appendSegments(const StreetGraph& graph, const RoutePath& path, list<StreetSegment>& segs)
+{
+    for (int e : path.edges)
+        segs.push_back(graph.segment(e));
+}
+
+//******************** PlanCommand functions **********************************
+
+const char* directionName(PlanCommand::Direction dir)
+{
+    static const char* const names[] = { "east", "northeast", "north", "northwest", "west", "southwest", "south", "southeast", "left", "right", "around" };
+    return names[dir];
+}
+
+double lineAngle(const GeoCoord& start, const GeoCoord& end)
+{
+    double result = rad2deg(atan2(end.latitude - start.latitude, end.longitude - start.longitude));
+    if (result < 0)
+        result += 360;
+    return result;
+}
+
+double lineAngle(const NodePoint& start, const NodePoint& end)
+{
+    double result = rad2deg(atan2(end.latitude - start.latitude, end.longitude - start.longitude));
+    if (result < 0)
+        result += 360;
+    return result;
+}
+
+PlanCommand::Direction compassDirection(double angle)
+{
+    // Determine which direction angle is in
+    if (angle < 22.5)
+        return PlanCommand::EAST;
+    else if (angle < 67.5)
+        return PlanCommand::NORTHEAST;
+    else if (angle < 112.5)
+        return PlanCommand::NORTH;
+    else if (angle < 157.5)
+        return PlanCommand::NORTHWEST;
+    else if (angle < 202.5)
+        return PlanCommand::WEST;
+    else if (angle < 247.5)
+        return PlanCommand::SOUTHWEST;
+    else if (angle < 292.5)
+        return PlanCommand::SOUTH;
+    else if (angle < 337.5)
+        return PlanCommand::SOUTHEAST;
+    else
+        return PlanCommand::EAST;
+}
+
+// Proceed commands are named after the last edge but point the way the first one did
+static PlanCommand proceedCommand(const StreetGraph& graph, int e, int streetStart, double dist)
+{
+    PlanCommand cmd;
+    cmd.type = PlanCommand::PROCEED;
+    cmd.direction = (PlanCommand::Direction)graph.compass(streetStart);
+    cmd.id = graph.edge(e).street;
+    cmd.distance = dist;
+    return cmd;
+}
+
+static PlanCommand turnCommand(const StreetGraph& graph, PlanCommand::Direction dir, int e)
+{
+    PlanCommand cmd;
+    cmd.type = PlanCommand::TURN;
+    cmd.direction = dir;
+    cmd.id = graph.edge(e).street;
+    cmd.distance = 0;
+    return cmd;
+}
+
+static PlanCommand deliverCommand(int delivery)
+{
+    PlanCommand cmd;
+    cmd.type = PlanCommand::DELIVER;
+    cmd.direction = PlanCommand::EAST; // Unused
+    cmd.id = delivery;
+    cmd.distance = 0;
+    return cmd;
+}
+
+void generateCommands(const StreetGraph& graph, const RoutePath& route, int depotNode,
+                      const vector<int>& stopNodes, const vector<int>& order, vector<PlanCommand>& commands)
+{
+    size_t deliveryIndex = 0; // Set up counter for which delivery we are on currently (start at first element)
+    
+    // First check all the beginning deliveries that are at the starting depot
+    while (deliveryIndex < stopNodes.size() && depotNode == stopNodes[deliveryIndex])
+    {
+        commands.push_back(deliverCommand(order[deliveryIndex])); // Create deliver command
+        deliveryIndex++; // Increment deliveries made
+    }
+    
+    if (route.empty()) // If thats all deliveries (a route with none left still gets its commands)
+        return;
+    
+    // One pass over the route, looking at each edge and the one after it
+    const vector<int>& edges = route.edges;
+    double currentStreetDist = 0; // Set up tracker for distance in current path
+    int streetStart = edges[0]; // Set up var to track the first edge in current proceed path
+    size_t k = 0;
+    for (; k + 1 < edges.size(); k++)
+    {
+        StreetEdge cur = graph.edge(edges[k]);
+        StreetEdge next = graph.edge(edges[k+1]);
+        
+        // Check if delivery is to be made at curent location, and do all of them (if > 1)
+        bool justDelivered = false;
+        while (deliveryIndex < stopNodes.size() && next.from == stopNodes[deliveryIndex])
+        {
+            // Conclude previous proceed command (if there is one)
+            if (currentStreetDist != 0) // If there is a current route
+            {
+                currentStreetDist += graph.miles(edges[k]); // Add to current path distance
+                commands.push_back(proceedCommand(graph, edges[k], streetStart, currentStreetDist)); // Generate previous proceed command
+                streetStart = edges[k+1]; // Update first edge
+            }
+            commands.push_back(deliverCommand(order[deliveryIndex])); // Create deliver command
+            // Reset curr path distance and increment deliveryIndex
+            currentStreetDist = 0;
+            deliveryIndex++;
+            justDelivered = true;
+        }
+        if (justDelivered) // If we just finished delivering, move on
+            continue;
+        
+        // If we don't deliver this turn, we continue path
+        currentStreetDist += graph.miles(edges[k]); // Add to current path distance
+        // A U-turn stays on the same street, but it can't be folded into one proceed command with the way back
+        bool uTurn = edges[k+1] == (edges[k] ^ 1);
+        if (cur.street != next.street || uTurn) // If we go on a new street or turn around
+        {
+            // Conclude previous proceed command
+            commands.push_back(proceedCommand(graph, edges[k], streetStart, currentStreetDist)); // Generate previous proceed command
+            // Reset counter and update starting edge
+            currentStreetDist = 0;
+            streetStart = edges[k+1];
+            
+            // Test for turn, using the edges' angles (same as angleBetween2Lines)
+            double angleBtwn = graph.angle(edges[k+1]) - graph.angle(edges[k]);
+            if (angleBtwn < 0)
+                angleBtwn += 360;
+            if (uTurn)
+                commands.push_back(turnCommand(graph, PlanCommand::AROUND, edges[k+1]));
+            else if (angleBtwn < 1.0 || angleBtwn > 359.0) // No turn
+            {}
+            else if (angleBtwn < 180.0) // Left turn
+                commands.push_back(turnCommand(graph, PlanCommand::LEFT, edges[k+1]));
+            else // Right turn
+                commands.push_back(turnCommand(graph, PlanCommand::RIGHT, edges[k+1]));
+        }
+    }
+    
+    // Conclude last proceed command
+    currentStreetDist += graph.miles(edges[k]); // Add to current path distance
+    commands.push_back(proceedCommand(graph, edges[k], edges[k], currentStreetDist)); // Generate last proceed command
+    
+    // Repeatedly check deliveries for last point until the end
+    while (deliveryIndex < stopNodes.size() && graph.edge(edges[k]).to == stopNodes[deliveryIndex])
+    {
+        commands.push_back(deliverCommand(order[deliveryIndex])); // Create deliver command
+        deliveryIndex++;
+    }
+}
+
+DeliveryCommand toDeliveryCommand(const PlanCommand& cmd, const StreetGraph& graph, const vector<DeliveryRequest>& deliveries)
+{
+    DeliveryCommand dc;
+    switch (cmd.type)
+    {
+      case PlanCommand::PROCEED:
+        dc.initAsProceedCommand(directionName(cmd.direction), graph.streetNames[cmd.id], cmd.distance);
+        break;
+      case PlanCommand::TURN:
+        dc.initAsTurnCommand(directionName(cmd.direction), graph.streetNames[cmd.id]);
+        break;
+      case PlanCommand::DELIVER:
+        dc.initAsDeliverCommand(deliveries[cmd.id].item);
+        break;
+    }
+    return dc;
+}
+
+void renderCommands(const vector<PlanCommand>& commands, const StreetGraph& graph, const vector<DeliveryRequest>& deliveries, string& out)
+{
+    // Work out the exact length first so the buffer is allocated once
+    size_t length = 0;
+    for (const PlanCommand& cmd : commands)
+    {
+        if (cmd.type == PlanCommand::DELIVER)
+            length += 8 + deliveries[cmd.id].item.size() + 1; // "DELIVER " item
+        else
+            length += 32 + strlen(directionName(cmd.direction)) + graph.streetNames[cmd.id].size(); // Words, miles and newline fit in 32 for any sane distance
+    }
+    out.reserve(out.size() + length);
+    
+    char miles[32];
+    for (const PlanCommand& cmd : commands)
+    {
+        switch (cmd.type)
+        {
+          case PlanCommand::TURN:
+            out += "Turn ";
+            out += directionName(cmd.direction);
+            out += " on ";
+            out += graph.streetNames[cmd.id];
+            break;
+          case PlanCommand::PROCEED:
+            snprintf(miles, sizeof(miles), "%.2f", cmd.distance); // Same as the fixed, precision 2 stream in description()
+            out += "Proceed ";
+            out += directionName(cmd.direction);
+            out += " on ";
+            out += graph.streetNames[cmd.id];
+            out += " for ";
+            out += miles;
+            out += " miles";
+            break;
+          case PlanCommand::DELIVER:
+            out += "DELIVER ";
+            out += deliveries[cmd.id].item;
+            break;
+        }
+        out += '\n';
+    }
+}
+
+//******************** RouteGeometry functions ********************************
+
+static RouteGeometry::Point fixedPoint(const StreetGraph& graph, int n)
+{
+    RouteGeometry::Point pt;
+    pt.latitude = (int)toFixedCoord(graph.points[n].latitude);
+    pt.longitude = (int)toFixedCoord(graph.points[n].longitude);
+    return pt;
+}
+
+void buildRouteGeometry(const StreetGraph& graph, const RoutePath& route, int startNode,
+                        const vector<size_t>& legEdges, RouteGeometry& geometry)
+{
+    geometry.clear();
+    geometry.points.reserve(route.size() + 1);
+    geometry.legEnds.reserve(legEdges.size());
+    geometry.legMiles.reserve(legEdges.size());
+    geometry.points.push_back(fixedPoint(graph, startNode));
+    size_t e = 0;
+    double milesBefore = 0; // Miles driven before the current leg
+    for (size_t legEnd : legEdges)
+    {
+        for (; e < legEnd; e++)
+            geometry.points.push_back(fixedPoint(graph, graph.edge(route.edges[e]).to));
+        double milesAfter = e == 0 ? 0 : route.cumulativeMiles[e-1];
+        geometry.legEnds.push_back((int)geometry.points.size() - 1);
+        geometry.legMiles.push_back(milesAfter - milesBefore);
+        milesBefore = milesAfter;
+    }
+}
+
+// Signed value in the polyline algorithm's 5 bits per character, printable from '?' on
+static void appendPolylineValue(long long value, string& out)
+{
+    unsigned long long bits = value < 0 ? ~((unsigned long long)value << 1) : (unsigned long long)value << 1;
+    while (bits >= 0x20)
+    {
+        out += (char)((0x20 | (bits & 0x1f)) + 63);
+        bits >>= 5;
+    }
+    out += (char)(bits + 63);
+}
+
+void encodePolyline(const RouteGeometry& geometry, int precision, string& out)
+{
+    precision = max(0, min(7, precision));
+    long long scale = 1;
+    for (int i = precision; i < 7; i++)
+        scale *= 10;
+    // Round half away from zero, then encode the change from the last rounded point so rounding
+    // errors don't add up along the line
+    auto rounded = [scale](long long fixed) {
+        return fixed < 0 ? -((-fixed + scale / 2) / scale) : (fixed + scale / 2) / scale;
+    };
+    out.reserve(out.size() + geometry.points.size() * 6);
+    long long lastLat = 0, lastLon = 0;
+    for (const RouteGeometry::Point& pt : geometry.points)
+    {
+        long long lat = rounded(pt.latitude), lon = rounded(pt.longitude);
+        appendPolylineValue(lat - lastLat, out);
+        appendPolylineValue(lon - lastLon, out);
+        lastLat = lat;
+        lastLon = lon;
+    }
+}
+
+static void appendVarint(unsigned long long value, string& out)
+{
+    while (value >= 0x80)
+    {
+        out += (char)(0x80 | (value & 0x7f));
+        value >>= 7;
+    }
+    out += (char)value;
+}
+
+static void appendZigzag(long long value, string& out)
+{
+    appendVarint(value < 0 ? ~((unsigned long long)value << 1) : (unsigned long long)value << 1, out);
+}
+
+static bool readVarint(const unsigned char*& p, const unsigned char* end, unsigned long long& value)
+{
+    value = 0;
+    for (int shift = 0; shift < 64; shift += 7)
+    {
+        if (p == end)
+            return false;
+        unsigned char byte = *p++;
+        value |= (unsigned long long)(byte & 0x7f) << shift;
+        if (byte < 0x80)
+            return true;
+    }
+    return false; // Longer than any value we write
+}
+
+static bool readZigzag(const unsigned char*& p, const unsigned char* end, long long& value)
+{
+    unsigned long long bits;
+    if (!readVarint(p, end, bits))
+        return false;
+    value = (bits & 1) ? (long long)~(bits >> 1) : (long long)(bits >> 1);
+    return true;
+}
+
+void encodeBinaryGeometry(const RouteGeometry& geometry, string& out)
+{
+    out.reserve(out.size() + 8 + geometry.legEnds.size() * 10 + geometry.points.size() * 4);
+    out += (char)1; // Version
+    appendVarint(geometry.points.size(), out);
+    appendVarint(geometry.legEnds.size(), out);
+    int lastEnd = 0;
+    for (size_t i = 0; i < geometry.legEnds.size(); i++)
+    {
+        appendVarint(geometry.legEnds[i] - lastEnd, out);
+        lastEnd = geometry.legEnds[i];
+        uint64_t bits;
+        memcpy(&bits, &geometry.legMiles[i], sizeof(bits));
+        for (int b = 0; b < 8; b++) // Little endian whatever the machine is
+            out += (char)(bits >> (8 * b));
+    }
+    long long lastLat = 0, lastLon = 0;
+    for (const RouteGeometry::Point& pt : geometry.points)
+    {
+        appendZigzag(pt.latitude - lastLat, out);
+        appendZigzag(pt.longitude - lastLon, out);
+        lastLat = pt.latitude;
+        lastLon = pt.longitude;
+    }
+}
+
+bool decodeBinaryGeometry(const char* data, size_t size, RouteGeometry& geometry)
+{
+    geometry.clear();
+    const unsigned char* p = (const unsigned char*)data;
+    const unsigned char* end = p + size;
+    unsigned long long numPoints, numLegs;
+    if (p == end || *p++ != 1 || !readVarint(p, end, numPoints) || !readVarint(p, end, numLegs))
+        return false;
+    // Every point and leg takes at least two bytes and nine, so bigger counts can't be right
+    if (numPoints > size / 2 || numLegs > size / 9)
+        return false;
+    geometry.legEnds.reserve(numLegs);
+    geometry.legMiles.reserve(numLegs);
+    unsigned long long lastEnd = 0;
+    for (unsigned long long i = 0; i < numLegs; i++)
+    {
+        unsigned long long points;
+        if (!readVarint(p, end, points) || points >= numPoints - lastEnd || end - p < 8) // Leg has to end on a point
+            return false;
+        lastEnd += points;
+        uint64_t bits = 0;
+        for (int b = 0; b < 8; b++)
+            bits |= (uint64_t)*p++ << (8 * b);
+        double miles;
+        memcpy(&miles, &bits, sizeof(miles));
+        geometry.legEnds.push_back((int)lastEnd);
+        geometry.legMiles.push_back(miles);
+    }
+    geometry.points.reserve(numPoints);
+    long long lat = 0, lon = 0;
+    for (unsigned long long i = 0; i < numPoints; i++)
+    {
+        long long dLat, dLon;
+        if (!readZigzag(p, end, dLat) || !readZigzag(p, end, dLon))
+            return false;
+        const long long maxChange = 1LL << 32; // Between any two ints; also keeps the sums from overflowing
+        if (dLat < -maxChange || dLat > maxChange || dLon < -maxChange || dLon > maxChange)
+            return false;
+        lat += dLat;
+        lon += dLon;
+        if (lat < INT_MIN || lat > INT_MAX || lon < INT_MIN || lon > INT_MAX)
+            return false;
+        RouteGeometry::Point pt;
+        pt.latitude = (int)lat;
+        pt.longitude = (int)lon;
+        geometry.points.push_back(pt);
+    }
+    return p == end;
+}
+
+//******************** SpatialGrid functions **********************************
+
+// Calls visit(cell) for every cell of the grid exactly r cells (in the max norm) away from (cx, cy)
+template<typename Visit>
+static void forEachCellOnRing(int cx, int cy, int r, int rows, int cols, Visit visit)
+{
+    for (int y = std::max(cy - r, 0); y <= std::min(cy + r, rows - 1); y++)
+    {
+        int step = (y == cy - r || y == cy + r) ? 1 : 2 * r; // Rows in the middle of the ring only have their two ends on it
+        for (int x = cx - r; x <= cx + r; x += step)
+        {
+            if (x >= 0 && x < cols)
+                visit(y * cols + x);
+        }
+    }
+}
+
+SpatialGrid::SpatialGrid()
+ : m_minLat(0), m_minX(0), m_lonScale(1), m_cellSize(1), m_rows(0), m_cols(0)
+{
+}
+
+void SpatialGrid::build(const StreetGraph& graph)
+{
+    m_rows = m_cols = 0;
+    m_nodeStart.clear(); m_nodeIds.clear();
+    m_segStart.clear(); m_segIds.clear();
+    m_extraNodes.clear(); m_extraSegs.clear();
+    if (graph.numNodes() == 0)
+        return;
+
+    // Find bounding box of all nodes
+    double minLat = DBL_MAX, maxLat = -DBL_MAX, minLon = DBL_MAX, maxLon = -DBL_MAX;
+    for (const NodePoint& gc : graph.points)
+    {
+        minLat = std::min(minLat, gc.latitude);
+        maxLat = std::max(maxLat, gc.latitude);
+        minLon = std::min(minLon, gc.longitude);
+        maxLon = std::max(maxLon, gc.longitude);
+    }
+    m_lonScale = std::cos(deg2rad((minLat + maxLat) / 2));
+    m_minLat = minLat;
+    m_minX = minLon * m_lonScale;
+    double width = (maxLon - minLon) * m_lonScale;
+    double height = maxLat - minLat;
+
+    // Size cells so there are about two nodes per cell
+    m_cellSize = std::sqrt(width * height / std::max(1, graph.numNodes() / 2));
+    if (m_cellSize <= 0) // All nodes in a line or on one point
+        m_cellSize = std::max(std::max(width, height), 1e-6);
+    m_cols = (int)(width / m_cellSize) + 1;
+    m_rows = (int)(height / m_cellSize) + 1;
+    int numCells = m_rows * m_cols;
+
+    // Counting sort nodes into cells
+    m_nodeStart.assign(numCells + 1, 0);
+    vector<int> nodeCell(graph.numNodes());
+    for (int n = 0; n < graph.numNodes(); n++)
+    {
+        nodeCell[n] = row(graph.points[n].latitude) * m_cols + column(graph.points[n].longitude * m_lonScale);
+        m_nodeStart[nodeCell[n] + 1]++;
+    }
+    for (int c = 0; c < numCells; c++)
+        m_nodeStart[c + 1] += m_nodeStart[c];
+    m_nodeIds.resize(graph.numNodes());
+    vector<int> next(m_nodeStart.begin(), m_nodeStart.end() - 1);
+    for (int n = 0; n < graph.numNodes(); n++)
+        m_nodeIds[next[nodeCell[n]]++] = n;
+
+    // Segments go in every cell their bounding box touches, so count in one pass and fill in a second
+    m_segStart.assign(numCells + 1, 0);
+    for (int pass = 0; pass < 2; pass++)
+    {
+        for (int e = 0; e < graph.numEdges(); e += 2) // Forward edges only, the odd ones are the same segments reversed
+        {
+            const NodePoint& a = graph.points[graph.edge(e).from];
+            const NodePoint& b = graph.points[graph.edge(e).to];
+            int x0 = column(std::min(a.longitude, b.longitude) * m_lonScale), x1 = column(std::max(a.longitude, b.longitude) * m_lonScale);
+            int y0 = row(std::min(a.latitude, b.latitude)), y1 = row(std::max(a.latitude, b.latitude));
+            for (int y = y0; y <= y1; y++)
+                for (int x = x0; x <= x1; x++)
+                {
+                    if (pass == 0)
+                        m_segStart[y * m_cols + x + 1]++;
+                    else
+                        m_segIds[next[y * m_cols + x]++] = e;
+                }
+        }
+        if (pass == 0) // Turn counts into offsets before filling
+        {
+            for (int c = 0; c < numCells; c++)
+                m_segStart[c + 1] += m_segStart[c];
+            m_segIds.resize(m_segStart[numCells]);
+            next.assign(m_segStart.begin(), m_segStart.end() - 1);
+        }
+    }
+}
+
+size_t SpatialGrid::memoryUsage() const
+{
+    return vectorBytes(m_nodeStart) + vectorBytes(m_nodeIds) + vectorBytes(m_segStart) + vectorBytes(m_segIds)
+         + vectorBytes(m_extraNodes) + vectorBytes(m_extraSegs);
+}
+
+int SpatialGrid::nearestNode(const StreetGraph& graph, double lat, double lon) const
+{
+    if (empty())
+        return -1;
+    double x = lon * m_lonScale;
+    int cx = column(x), cy = row(lat);
+    int best = -1;
+    double bestDist2 = DBL_MAX;
+    auto check = [&](int n) {
+        const NodePoint& gc = graph.points[n];
+        double dLat = gc.latitude - lat, dX = gc.longitude * m_lonScale - x;
+        if (dLat * dLat + dX * dX < bestDist2 && !graph.isolated(n)) // Skip nodes left behind by removed segments
+        {
+            bestDist2 = dLat * dLat + dX * dX;
+            best = n;
+        }
+    };
+    for (int n : m_extraNodes)
+        check(n);
+    for (int r = 0; m_cols > 0 && r <= std::max(m_rows, m_cols); r++) // Search rings of cells outward from the point's cell
+    {
+        forEachCellOnRing(cx, cy, r, m_rows, m_cols, [&](int c) {
+            for (int i = m_nodeStart[c]; i < m_nodeStart[c + 1]; i++)
+                check(m_nodeIds[i]);
+        });
+        // Anything in the next ring is at least r cells away, so stop once we have something closer
+        if (best != -1 && bestDist2 <= (r * m_cellSize) * (r * m_cellSize))
+            break;
+    }
+    return best;
+}
+
+int SpatialGrid::nearestSegment(const StreetGraph& graph, double lat, double lon, double& t) const
+{
+    if (empty())
+        return -1;
+    double x = lon * m_lonScale;
+    int cx = column(x), cy = row(lat);
+    int best = -1;
+    double bestDist2 = DBL_MAX;
+    auto check = [&](int e) {
+        if (graph.edge(e).state == StreetEdge::REMOVED)
+            return;
+        double segT;
+        double dist2 = segmentDistance2(graph, e, lat, x, segT);
+        if (dist2 < bestDist2)
+        {
+            bestDist2 = dist2;
+            best = e;
+            t = segT;
+        }
+    };
+    for (int e : m_extraSegs)
+        check(e);
+    for (int r = 0; m_cols > 0 && r <= std::max(m_rows, m_cols); r++) // Same ring search as nearestNode
+    {
+        forEachCellOnRing(cx, cy, r, m_rows, m_cols, [&](int c) {
+            for (int i = m_segStart[c]; i < m_segStart[c + 1]; i++)
+                check(m_segIds[i]);
+        });
+        if (best != -1 && bestDist2 <= (r * m_cellSize) * (r * m_cellSize))
+            break;
+    }
+    return best;
+}
+
+void SpatialGrid::segmentsInBox(const StreetGraph& graph, double minLat, double minLon, double maxLat, double maxLon, vector<int>& edges) const
+{
+    if (empty())
+        return;
+    vector<int> candidates;
+    segmentsInCells(graph, column(minLon * m_lonScale), row(minLat), column(maxLon * m_lonScale), row(maxLat), candidates);
+    for (int e : candidates)
+    {
+        // Clip the segment against the box (Liang-Barsky) and keep it if anything is left
+        const NodePoint& a = graph.points[graph.edge(e).from];
+        const NodePoint& b = graph.points[graph.edge(e).to];
+        double dLat = b.latitude - a.latitude, dLon = b.longitude - a.longitude;
+        double p[4] = { -dLat, dLat, -dLon, dLon };
+        double q[4] = { a.latitude - minLat, maxLat - a.latitude, a.longitude - minLon, maxLon - a.longitude };
+        double t0 = 0, t1 = 1;
+        bool inside = true;
+        for (int i = 0; i < 4 && inside; i++)
+        {
+            if (p[i] == 0) // Parallel to this edge of the box
+                inside = q[i] >= 0;
+            else if (p[i] < 0)
+                t0 = max(t0, q[i] / p[i]);
+            else
+                t1 = min(t1, q[i] / p[i]);
+            if (t0 > t1)
+                inside = false;
+        }
+        if (inside)
+            edges.push_back(e);
+    }
+}
+
+void SpatialGrid::segmentsNear(const StreetGraph& graph, double lat, double lon, double radiusMiles, vector<int>& edges) const
+{
+    if (empty() || radiusMiles < 0)
+        return;
+    // Grid units are degrees of latitude, so pad the radius a little to cover the flat projection's error
+    static const double milesPerDegree = 6371.0 / 1.609344 * deg2rad(1);
+    double radius = radiusMiles / milesPerDegree * 1.01 + 1e-9;
+    double x = lon * m_lonScale;
+    vector<int> candidates;
+    segmentsInCells(graph, column(x - radius), row(lat - radius), column(x + radius), row(lat + radius), candidates);
+    GeoCoord center;
+    center.latitude = lat;
+    center.longitude = lon;
+    for (int e : candidates)
+    {
+        double t;
+        if (segmentDistance2(graph, e, lat, x, t) > radius * radius)
+            continue;
+        // Check the closest point with the real earth distance
+        const NodePoint& a = graph.points[graph.edge(e).from];
+        const NodePoint& b = graph.points[graph.edge(e).to];
+        GeoCoord closest;
+        closest.latitude = a.latitude + t * (b.latitude - a.latitude);
+        closest.longitude = a.longitude + t * (b.longitude - a.longitude);
+        if (distanceEarthMiles(center, closest) <= radiusMiles)
+            edges.push_back(e);
+    }
+}
+
+void SpatialGrid::addSegment(const StreetGraph& graph, int e)
+{
+    int ends[2] = { graph.edge(e).from, graph.edge(e).to };
+    for (int n : ends)
+        if (n >= (int)(m_nodeIds.size() + m_extraNodes.size())) // Node is newer than anything indexed
+            m_extraNodes.push_back(n);
+    m_extraSegs.push_back(e);
+}
+
+int SpatialGrid::cellOf(double lat, double lon) const
+{
+    return m_cols == 0 ? 0 : row(lat) * m_cols + column(lon * m_lonScale);
+}
+
+int SpatialGrid::column(double x) const
+{
+    double c = std::floor((x - m_minX) / m_cellSize); // Clamp as a double so far away points can't overflow an int
+    return c < 0 ? 0 : (c >= m_cols ? m_cols - 1 : (int)c);
+}
+
+int SpatialGrid::row(double lat) const
+{
+    double r = std::floor((lat - m_minLat) / m_cellSize);
+    return r < 0 ? 0 : (r >= m_rows ? m_rows - 1 : (int)r);
+}
+
+void SpatialGrid::segmentsInCells(const StreetGraph& graph, int x0, int y0, int x1, int y1, vector<int>& edges) const
+{
+    for (int e : m_extraSegs) // Not sorted into cells, so always candidates
+        if (graph.edge(e).state != StreetEdge::REMOVED)
+            edges.push_back(e);
+    for (int y = y0; y <= y1 && m_cols > 0; y++)
+        for (int x = x0; x <= x1; x++)
+            for (int i = m_segStart[y * m_cols + x]; i < m_segStart[y * m_cols + x + 1]; i++)
+            {
+                // A segment is listed in every cell its bounding box covers, so only report it from the
+                // first of those cells that is also inside the range
+                int e = m_segIds[i];
+                if (graph.edge(e).state == StreetEdge::REMOVED)
+                    continue;
+                const NodePoint& a = graph.points[graph.edge(e).from];
+                const NodePoint& b = graph.points[graph.edge(e).to];
+                int firstX = max(x0, column(min(a.longitude, b.longitude) * m_lonScale));
+                int firstY = max(y0, row(min(a.latitude, b.latitude)));
+                if (x == firstX && y == firstY)
+                    edges.push_back(e);
+            }
+}
+
+double SpatialGrid::segmentDistance2(const StreetGraph& graph, int e, double lat, double x, double& t) const
+{
+    const NodePoint& a = graph.points[graph.edge(e).from];
+    const NodePoint& b = graph.points[graph.edge(e).to];
+    double ax = a.longitude * m_lonScale, bx = b.longitude * m_lonScale;
+    double dLat = b.latitude - a.latitude, dX = bx - ax;
+    double len2 = dLat * dLat + dX * dX;
+    // Project point onto the segment's line and clamp to its ends
+    t = len2 == 0 ? 0 : ((lat - a.latitude) * dLat + (x - ax) * dX) / len2;
+    t = std::min(std::max(t, 0.0), 1.0);
+    double pLat = a.latitude + t * dLat - lat, pX = ax + t * dX - x;
+    return pLat * pLat + pX * pX;
+}
+
+//******************** Stats functions ****************************************
+
+void StatsHistogram::add(double value)
+{
+    int bucket = 0;
+    for (double bound = 1; bucket < NUM_BUCKETS - 1 && value >= bound; bound *= 2)
+        bucket++;
+    buckets[bucket]++;
+    count++;
+    sum += value;
+    if (value > max)
+        max = value;
+}
+
+string StatsHistogram::toJson() const
+{
+    ostringstream out;
+    out << "{\"count\":" << count << ",\"sum\":" << sum << ",\"max\":" << max << ",\"buckets\":[";
+    bool first = true;
+    double bound = 1; // Values in bucket i are below 2^i
+    for (int i = 0; i < NUM_BUCKETS; i++, bound *= 2)
+    {
+        if (buckets[i] == 0)
+            continue;
+        out << (first ? "" : ",") << "[" << bound << "," << buckets[i] << "]";
+        first = false;
+    }
+    out << "]}";
+    return out.str();
+}
+
+string RouterStats::toJson() const
+{
+    ostringstream out;
+    out << "{\"nodes_expanded\":" << nodesExpanded << ",\"heap_pushes\":" << heapPushes
+        << ",\"relaxations\":" << relaxations << ",\"seconds\":" << seconds
+        << ",\"expanded_per_query\":" << expandedPerQuery.toJson()
+        << ",\"microseconds_per_query\":" << microsecondsPerQuery.toJson() << "}";
+    return out.str();
+}
+
+string OptimizerStats::toJson() const
+{
+    ostringstream out;
+    out << "{\"iterations\":" << iterations << ",\"old_miles\":" << oldMiles << ",\"new_miles\":" << newMiles
+        << ",\"improvement\":" << improvement << ",\"seconds\":" << seconds
+        << ",\"microseconds_per_call\":" << microsecondsPerCall.toJson() << "}";
+    return out.str();
+}
+
+string LoadStats::toJson() const
+{
+    ostringstream out;
+    out << "{\"bytes\":" << bytes << ",\"seconds\":" << seconds << ",\"bytes_per_second\":" << bytesPerSecond
+        << ",\"nodes\":" << nodes << ",\"edges\":" << edges << ",\"streets\":" << streets << ",\"chunks\":" << chunks
+        << ",\"coord_probes\":" << coordProbes.toJson() << ",\"name_probes\":" << nameProbes.toJson() << "}";
+    return out.str();
+}
@@ -9,6 +9,589 @@
 #ifndef support_h
 #define support_h
 
-#include <stdio.h>
+#include "provided.h"
+#include <string>
+#include <vector>
+#include <list>
+#include <algorithm>
+#include <iosfwd>
+#include <type_traits>
+#include <functional>
+
+// Directed edge in the street graph. Every segment in the map file becomes two edges, one in
+// each direction, numbered next to each other so the reverse of edge e is always edge e ^ 1. The
+// graph only stores the forward edge of each segment; StreetGraph::edge derives the reverse.
+struct StreetEdge
+{
+    enum State : unsigned char { OPEN, CLOSED, REMOVED }; // Closed segments still exist but can't be driven on
+
+    int from;       // Node the edge starts at
+    int to;         // Node the edge ends at
+    double weight;  // Cost the router minimizes (straight line length in degrees, times any cost factor)
+    int street;     // Index of the street's name in StreetGraph::streetNames
+    State state;
+
+    bool usable() const { return state == OPEN; }
+    double cost() const; // weight if usable, otherwise DBL_MAX
+};
+
+// Length and directions of a segment, which routes and commands need but searches don't. Normal
+// storage keeps them so nothing has to be worked out again; compact storage works them out from
+// the nodes' points when asked.
+struct SegmentShape
+{
+    double miles;        // Length of the segment in miles
+    double angles[2];    // Direction of travel each way in degrees, as angleOfLine gives it (0 <= angle < 360)
+    unsigned char compass[2]; // PlanCommand::Direction (EAST ... SOUTHEAST) each angle falls in
+};
+
+// Record of one runtime change to a segment's routing cost (opening, closing, adding, removing or
+// reweighting it), so anything precomputed from the graph can patch itself instead of rebuilding
+struct StreetChange
+{
+    int edge;       // Forward edge of the segment; the change applies to edge ^ 1 as well
+    double oldCost; // StreetEdge::cost() before and after the change
+    double newCost;
+};
+
+// Just the numbers of a GeoCoord, which is all the routing and spatial code needs
+struct NodePoint
+{
+    double latitude;
+    double longitude;
+};
+
+// Flat, index based copy of the street network that StreetMap builds at load time, so routing
+// code can work with node and edge ids instead of hashing GeoCoords
+struct StreetGraph
+{
+    bool compact = false;                 // Compact storage mode (StreetMap::setCompactStorage): nodes and shapes are left empty
+    std::vector<GeoCoord> nodes;          // Node id -> coordinate; use coord(n), which works in either mode
+    std::vector<NodePoint> points;        // Node id -> latitude and longitude
+    std::vector<std::string> streetNames; // Street id -> street name
+    std::vector<StreetEdge> segments;     // Segment id -> its forward edge, edge 2 * id; use edge(e), which gives either direction
+    std::vector<SegmentShape> shapes;     // Segment id -> length and directions; use miles(e), angle(e) and compass(e)
+    std::vector<int> adjStart;            // Edges leaving node n are adjEdges[adjStart[n]] up to adjEdges[adjStart[n+1]]
+    std::vector<int> adjEdges;
+    std::vector<StreetChange> changes;    // Every change made since load, oldest first
+
+    int numNodes() const { return (int)points.size(); }
+    int numEdges() const { return 2 * (int)segments.size(); }
+    StreetEdge edge(int e) const
+    {
+        StreetEdge edge = segments[e >> 1];
+        if (e & 1) // Driven the other way
+            std::swap(edge.from, edge.to);
+        return edge;
+    }
+    double miles(int e) const; // Length of edge e's segment
+    double angle(int e) const; // Direction of travel along edge e
+    int compass(int e) const;  // PlanCommand::Direction that angle(e) falls in
+    GeoCoord coord(int n) const; // Coordinate of node n, rebuilt from points in compact mode
+    StreetSegment segment(int e) const; // Rebuilds the StreetSegment an edge came from
+    bool isolated(int n) const; // True if every edge at node n has been removed
+};
+
+// Edge based view of a StreetGraph, for routing with turn costs. Here a route is a chain of edges, and
+// each edge lists the edges a driver can go on to at its end node along with the turn angle, so a
+// router can price every turn without any trig. Only the structure is stored: whether an edge is
+// usable and what it costs are read from the graph when routing, so closures and cost changes need
+// no rebuild, and added segments are patched in (StreetMap::buildTurnGraph keeps its copy up to date).
+
+// Edge weight of a mile over a graph's edges, to put TurnCosts in a router's units. Kept as running
+// sums so added edges are counted without going over the rest again.
+struct WeightPerMile
+{
+    double degrees = 0, miles = 0; // Sums over the first edges edges
+    int edges = 0;
+
+    void count(const StreetGraph& graph, int upTo); // Adds edges up to (not including) upTo to the sums
+    double value() const { return miles > 0 ? degrees / miles : 0; }
+};
+
+struct TurnGraph
+{
+    std::vector<int> turnStart;    // Turns off edge e are turnEdges[turnStart[e]] up to turnEdges[turnStart[e+1]]
+    std::vector<int> turnEdges;    // Edge turned onto
+    std::vector<float> turnAngles; // angleBetween2Lines from e to the edge turned onto, in [0, 360)
+    WeightPerMile weightPerMile;
+
+    void build(const StreetGraph& graph);
+    // Adds the turns onto and off the segment whose edges are e and e + 1, the next two after the
+    // ones here. Gives the same lists build would have.
+    void addSegment(const StreetGraph& graph, int e);
+    int numEdges() const { return turnStart.empty() ? 0 : (int)turnStart.size() - 1; }
+    static double turnAngle(const StreetGraph& graph, int e, int next); // What turnAngles holds for next after e
+    size_t memoryUsage() const;
+};
+
+// The street graph with every chain of degree two nodes (a street split into many short segments
+// between intersections) collapsed into one shortcut, so a search only has to visit the nodes at the
+// ends of chains: intersections and dead ends. Each shortcut lists the edges it stands for, so a route
+// over shortcuts unpacks into exactly the edges the full graph would give. Like TurnGraph only the
+// structure is kept and edge costs are read from the graph, so only added segments change it, and
+// only the chains through their ends.
+// Shortcuts come in pairs like edges do: shortcut s ^ 1 is s driven the other way.
+struct ChainGraph
+{
+    struct Shortcut
+    {
+        int from, to; // End nodes, neither of which is interior
+        int first, count; // Edges it stands for are chainEdges[first] up to chainEdges[first + count], in driving order
+    };
+    std::vector<int> adjStart;      // Shortcuts leaving node n are adjShortcuts[adjStart[n]] up to adjShortcuts[adjStart[n+1]]
+    std::vector<int> adjShortcuts;  // (interior nodes have none)
+    std::vector<Shortcut> shortcuts;
+    std::vector<int> chainEdges;
+    std::vector<int> nodeShortcut;  // For an interior node, the shortcut of the pair going through it that has the lower id; -1 otherwise
+    std::vector<int> nodePosition;  // For an interior node, how many of that shortcut's edges come before it
+
+    void build(const StreetGraph& graph);
+    // Patches in the segment whose edges e and e + 1 were just added, walking again only the chains
+    // through its two ends. Shortcut ids of other chains can change.
+    void addSegment(const StreetGraph& graph, int e);
+    int numEdges() const { return (int)chainEdges.size(); } // Each edge is in exactly one shortcut
+    bool interior(int n) const { return nodeShortcut[n] != -1; }
+    int position(int n, int s) const; // Edges of shortcut s before interior node n, which s must go through
+    size_t memoryUsage() const;
+};
+
+// Penalties for routing with turns, as the miles of driving a turn is worth. All zero (the default)
+// routes on plain distance.
+struct TurnCosts
+{
+    double leftTurn = 0;
+    double rightTurn = 0;
+    double uTurn = -1;        // Going back the way you came on the same segment; negative until set, see uTurnCost
+    double minTurnAngle = 30; // Bends of fewer degrees than this either way are free
+
+    bool enabled() const { return leftTurn > 0 || rightTurn > 0 || uTurn > 0; }
+    // What a U-turn costs. Left unset it's two of the dearer turn, so routes can't dodge a turn with
+    // a U-turn; a U-turn costing less than a turn is allowed only when asked for.
+    double uTurnCost() const { return uTurn >= 0 ? uTurn : 2 * (leftTurn > rightTurn ? leftTurn : rightTurn); }
+};
+
+// Uniform grid over the map's bounding box used to find nodes and segments near an arbitrary point.
+// Like the adjacency lists, the contents of every cell are stored back to back in one flat array so
+// a query only reads a few short runs of ints. Distances are measured on a flat projection of the
+// map (longitude scaled by the cosine of the middle latitude), which is accurate at city scale.
+class SpatialGrid
+{
+public:
+    SpatialGrid();
+    void build(const StreetGraph& graph); // Index every node and every segment (forward edge) of graph
+    bool empty() const { return m_cols == 0 && m_extraNodes.empty(); }
+    // Closest node to (lat, lon), or -1 if the grid is empty
+    int nearestNode(const StreetGraph& graph, double lat, double lon) const;
+    // Forward edge of the closest segment to (lat, lon), or -1 if the grid is empty. Sets t to how far
+    // along the edge (0 at its start, 1 at its end) the closest point is.
+    int nearestSegment(const StreetGraph& graph, double lat, double lon, double& t) const;
+    void addSegment(const StreetGraph& graph, int e); // Index a segment (and any new node) added after build
+    int cellOf(double lat, double lon) const; // Index of the cell containing (lat, lon), for sorting queries by locality
+    // Appends the forward edge of every segment that has a point inside the box (each segment once)
+    void segmentsInBox(const StreetGraph& graph, double minLat, double minLon, double maxLat, double maxLon, std::vector<int>& edges) const;
+    // Appends the forward edge of every segment that passes within radius miles of (lat, lon)
+    void segmentsNear(const StreetGraph& graph, double lat, double lon, double radiusMiles, std::vector<int>& edges) const;
+    size_t memoryUsage() const; // Bytes held by the cell lists
+
+private:
+    double m_minLat, m_minX; // Bottom left corner (x is projected longitude)
+    double m_lonScale; // Projected x = longitude * m_lonScale
+    double m_cellSize; // Width and height of a cell in projected degrees
+    int m_rows, m_cols;
+    std::vector<int> m_nodeStart, m_nodeIds; // Nodes in cell c are m_nodeIds[m_nodeStart[c]] up to m_nodeIds[m_nodeStart[c+1]]
+    std::vector<int> m_segStart, m_segIds; // Same for segments, which are listed in every cell their bounding box covers
+    std::vector<int> m_extraNodes, m_extraSegs; // Nodes and segments added since build, checked by every query
+
+    int column(double x) const; // Cell column/row of a projected point, clamped to the grid
+    // Appends every segment listed in cells [x0, x1] by [y0, y1], each once
+    void segmentsInCells(const StreetGraph& graph, int x0, int y0, int x1, int y1, std::vector<int>& edges) const;
+    int row(double lat) const;
+    // Squared distance from (lat, x) to the segment of edge e, and how far along it the closest point is
+    double segmentDistance2(const StreetGraph& graph, int e, double lat, double x, double& t) const;
+};
+
+// Open addressing hash table of ids, used for lookups in compact storage mode. Keys aren't stored:
+// the caller hashes its key and says whether an id matches it, so each slot costs just one int.
+class IdTable
+{
+public:
+    // Id matching the key with this hash, or -1. matches(id) says whether id has the key.
+    template <typename Matches>
+    int find(size_t hash, Matches matches) const;
+    // Adds id under hash. hashOf(id) gives the hash of any id already in the table, for growing.
+    template <typename HashOf>
+    void insert(size_t hash, int id, HashOf hashOf);
+    template <typename Matches>
+    bool remove(size_t hash, Matches matches); // Returns false if no id matched
+    void clear() { m_slots.clear(); m_used = 0; }
+    size_t memoryUsage() const { return m_slots.capacity() * sizeof(int); }
+
+private:
+    enum { EMPTY = -1, REMOVED = -2 };
+    std::vector<int> m_slots; // Power of two size, at most half used (counting removed slots)
+    size_t m_used = 0;
+};
+
+template <typename Matches>
+int IdTable::find(size_t hash, Matches matches) const
+{
+    if (m_slots.empty())
+        return -1;
+    size_t mask = m_slots.size() - 1;
+    for (size_t i = hash & mask; m_slots[i] != EMPTY; i = (i + 1) & mask) // Linear probing
+        if (m_slots[i] != REMOVED && matches(m_slots[i]))
+            return m_slots[i];
+    return -1;
+}
+
+template <typename HashOf>
+void IdTable::insert(size_t hash, int id, HashOf hashOf)
+{
+    if ((m_used + 1) * 2 > m_slots.size()) // Rehash everything into a table twice as big
+    {
+        std::vector<int> old;
+        old.swap(m_slots);
+        m_slots.assign(std::max<size_t>(16, old.size() * 2), EMPTY);
+        m_used = 0;
+        for (int oldId : old)
+            if (oldId >= 0)
+                insert(hashOf(oldId), oldId, hashOf);
+    }
+    size_t mask = m_slots.size() - 1;
+    size_t i = hash & mask;
+    while (m_slots[i] != EMPTY)
+        i = (i + 1) & mask;
+    m_slots[i] = id;
+    m_used++;
+}
+
+template <typename Matches>
+bool IdTable::remove(size_t hash, Matches matches)
+{
+    if (m_slots.empty())
+        return false;
+    size_t mask = m_slots.size() - 1;
+    for (size_t i = hash & mask; m_slots[i] != EMPTY; i = (i + 1) & mask)
+        if (m_slots[i] != REMOVED && matches(m_slots[i]))
+        {
+            m_slots[i] = REMOVED; // Leave a marker so probes for later ids still get past this slot
+            return true;
+        }
+    return false;
+}
+
+// Bytes held by each part of a StreetMap (StreetMap::memoryUsage)
+struct MapMemoryUsage
+{
+    size_t coords = 0;       // GeoCoords of the nodes, text included (none in compact mode)
+    size_t points = 0;       // Latitude and longitude of the nodes
+    size_t coordIndex = 0;   // Coord -> node id lookup
+    size_t streetNames = 0;
+    size_t nameIndex = 0;    // Street name -> street id lookup
+    size_t edges = 0;
+    size_t adjacency = 0;
+    size_t changes = 0;
+    size_t spatialGrid = 0;
+    size_t turnGraph = 0;    // Only if StreetMap::buildTurnGraph was called
+    size_t chainGraph = 0;
+
+    size_t total() const;
+    std::string toJson() const;
+};
+
+template <typename T>
+size_t vectorBytes(const std::vector<T>& v) // Heap memory of a vector, not counting what its elements own
+{
+    return v.capacity() * sizeof(T);
+}
+size_t stringBytes(const std::string& s); // Heap memory of a string (0 if it fits in the string itself)
+
+// Monotonic allocator for the temporaries of one plan. Memory is handed out from big blocks by bumping
+// a pointer and is never given back piece by piece; it all goes at once when the arena is released or
+// destroyed. Not thread safe, so use one arena per plan.
+class MonotonicArena
+{
+public:
+    MonotonicArena(size_t firstBlock = 64 * 1024);
+    ~MonotonicArena();
+    void* allocate(size_t bytes, size_t align);
+    void release(); // Free everything handed out; the biggest block is kept for reuse
+    size_t bytesUsed() const { return m_used; } // Handed out since the last release
+    size_t blockCount() const { return m_blocks.size(); }
+
+private:
+    MonotonicArena(const MonotonicArena&) = delete;
+    MonotonicArena& operator=(const MonotonicArena&) = delete;
+    struct Block { char* data; size_t size; };
+    std::vector<Block> m_blocks;
+    char* m_next; // Free space in the last block
+    char* m_end;
+    size_t m_nextBlock; // Size of the next block to get
+    size_t m_used;
+};
+
+// Standard allocator over a MonotonicArena, so containers can live in it. Deallocation does nothing.
+// With no arena it falls back to the heap, which lets the same container type be used either way.
+template <typename T>
+class ArenaAllocator
+{
+public:
+    typedef T value_type;
+    // Containers take their allocator along when moved or assigned, so a container can be moved into an arena
+    typedef std::true_type propagate_on_container_copy_assignment;
+    typedef std::true_type propagate_on_container_move_assignment;
+    typedef std::true_type propagate_on_container_swap;
+    ArenaAllocator(MonotonicArena* arena = nullptr) : m_arena(arena) {}
+    template <typename U> ArenaAllocator(const ArenaAllocator<U>& other) : m_arena(other.arena()) {}
+    T* allocate(size_t n)
+    {
+        if (m_arena == nullptr)
+            return static_cast<T*>(::operator new(n * sizeof(T)));
+        return static_cast<T*>(m_arena->allocate(n * sizeof(T), alignof(T)));
+    }
+    void deallocate(T* p, size_t)
+    {
+        if (m_arena == nullptr)
+            ::operator delete(p);
+    }
+    MonotonicArena* arena() const { return m_arena; }
+
+private:
+    MonotonicArena* m_arena;
+};
+
+template <typename T, typename U>
+bool operator==(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b) { return a.arena() == b.arena(); }
+template <typename T, typename U>
+bool operator!=(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b) { return a.arena() != b.arena(); }
+
+template <typename T>
+using ArenaVector = std::vector<T, ArenaAllocator<T>>;
+
+// A route as the ids of the edges it follows, in order, plus the total miles driven after each one.
+// This is what the router produces and the planner consumes; StreetSegments are only built for
+// callers that still want a list of them (appendSegments).
+struct RoutePath
+{
+    std::vector<int> edges;
+    std::vector<double> cumulativeMiles; // cumulativeMiles[i] is the length of edges[0] through edges[i]
+
+    void append(const StreetGraph& graph, int e); // Add one edge to the end
+    void clear() { edges.clear(); cumulativeMiles.clear(); }
+    bool empty() const { return edges.empty(); }
+    size_t size() const { return edges.size(); }
+    double miles() const { return cumulativeMiles.empty() ? 0 : cumulativeMiles.back(); }
+};
+
+// Appends the StreetSegments of path to the end of segs, in the form generatePointToPointRoute returns
+void appendSegments(const StreetGraph& graph, const RoutePath& path, std::list<StreetSegment>& segs);
+
+// Compact record of one delivery command. The planner emits these instead of DeliveryCommands so no
+// strings are built while planning; text is produced afterwards, all at once, by renderCommands.
+struct PlanCommand
+{
+    enum Type : unsigned char { PROCEED, TURN, DELIVER };
+    enum Direction : unsigned char { EAST, NORTHEAST, NORTH, NORTHWEST, WEST, SOUTHWEST, SOUTH, SOUTHEAST, LEFT, RIGHT, AROUND };
+
+    Type type;
+    Direction direction; // Compass direction for PROCEED, LEFT, RIGHT or AROUND (a U-turn) for TURN
+    int id;              // Street id for PROCEED and TURN, index into the plan's deliveries for DELIVER
+    double distance;     // Miles travelled, for PROCEED
+};
+
+const char* directionName(PlanCommand::Direction dir); // "northeast", "left", ...
+double lineAngle(const GeoCoord& start, const GeoCoord& end); // Same as angleOfLine(StreetSegment(start, end, ...))
+double lineAngle(const NodePoint& start, const NodePoint& end); // Same for the GeoCoords they came from
+PlanCommand::Direction compassDirection(double angle); // Which of the eight compass directions angle is in
+// Appends the commands for driving route, which starts and ends at depotNode and passes through
+// stopNodes in order. order[i] is the index in the plan's deliveries of the delivery at stopNodes[i].
+void generateCommands(const StreetGraph& graph, const RoutePath& route, int depotNode,
+                      const std::vector<int>& stopNodes, const std::vector<int>& order, std::vector<PlanCommand>& commands);
+DeliveryCommand toDeliveryCommand(const PlanCommand& cmd, const StreetGraph& graph, const std::vector<DeliveryRequest>& deliveries);
+// Appends the description() of every command, each followed by a newline, to out
+void renderCommands(const std::vector<PlanCommand>& commands, const StreetGraph& graph, const std::vector<DeliveryRequest>& deliveries, std::string& out);
+
+// Where a plan drives, for drawing it on a map: every node the route passes, in order, as fixed point
+// coords, and how the points split into legs. Leg i ends at stop i (the last leg back at the depot)
+// and covers points legEnds[i-1] through legEnds[i] (from point 0 for the first leg), so each leg
+// starts on the point the one before it ended on.
+struct RouteGeometry
+{
+    struct Point { int latitude, longitude; }; // toFixedCoord units (1e-7 degrees), which fit in an int
+
+    std::vector<Point> points;
+    std::vector<int> legEnds;
+    std::vector<double> legMiles; // Miles driven on each leg
+
+    void clear() { points.clear(); legEnds.clear(); legMiles.clear(); }
+};
+
+// Fills in geometry for route, which starts at startNode and whose leg i ends after its first
+// legEdges[i] edges. Only node coords are read; no StreetSegments or strings are made.
+void buildRouteGeometry(const StreetGraph& graph, const RoutePath& route, int startNode,
+                        const std::vector<size_t>& legEdges, RouteGeometry& geometry);
+// Appends the points as an encoded polyline (Google's polyline algorithm), rounded to precision
+// decimal places: 5 is what most map libraries read, and up to 7 keeps the map file's precision
+void encodePolyline(const RouteGeometry& geometry, int precision, std::string& out);
+// Appends a compact binary form of geometry: a version byte (1), the point and leg counts, then per
+// leg its point count past the previous leg's end and its miles as an 8 byte little endian double,
+// then per point the latitude and longitude change from the point before (from 0 for the first).
+// Counts are unsigned LEB128 varints and the changes zigzag encoded varints, mostly 1 or 2 bytes.
+void encodeBinaryGeometry(const RouteGeometry& geometry, std::string& out);
+// Reads back what encodeBinaryGeometry wrote; false if the data isn't in that form
+bool decodeBinaryGeometry(const char* data, size_t size, RouteGeometry& geometry);
+
+double coordDistance(const GeoCoord& start, const GeoCoord& end); // Straight line distance in degrees
+double coordDistance(const NodePoint& start, const NodePoint& end);
+double distanceEarthMiles(const NodePoint& start, const NodePoint& end); // Same as for the GeoCoords they came from
+// Coordinates as whole 1e-7 degree units, the precision of the map file. A coord written with exactly
+// seven decimals (like every coord in mapdata.txt) can be rebuilt from this without keeping its text.
+long long toFixedCoord(double degrees);
+void writeFixedCoord(long long fixed, char* text); // "-118.4794734"; text needs room for 32 chars
+bool isFixedCoordText(const std::string& text, double degrees); // True if writeFixedCoord gives back text exactly
+GeoCoord makeGeoCoord(double lat, double lon); // GeoCoord with text written to 7 decimal places like the map file
+
+// Calls task(0) through task(tasks - 1) spread over up to threads threads, the calling one included,
+// and returns when all of them have finished. Tasks are handed out one at a time in order.
+void runParallel(int tasks, int threads, const std::function<void(int)>& task);
+int hardwareThreads(); // Threads the machine can run at once, at least 1
+
+//******************** Stats ****************************************************
+
+// Counters and timers for the router, optimizer and map loader. They are only collected when the
+// project is built with GOOBEREATS_STATS defined (e.g. -DGOOBEREATS_STATS); otherwise every STATS(...)
+// statement compiles to nothing and the stats structs just stay zero.
+#ifdef GOOBEREATS_STATS
+#define STATS(...) __VA_ARGS__
+const bool STATS_ENABLED = true;
+#else
+#define STATS(...)
+const bool STATS_ENABLED = false;
+#endif
+
+// Counts of values in power of two buckets: bucket 0 holds 0, bucket i holds [2^(i-1), 2^i)
+struct StatsHistogram
+{
+    static const int NUM_BUCKETS = 48;
+    unsigned long long buckets[NUM_BUCKETS] = {};
+    unsigned long long count = 0;
+    double sum = 0;
+    double max = 0;
+
+    void add(double value);
+    std::string toJson() const; // {"count":..,"sum":..,"max":..,"buckets":[[upper bound, count], ...]} with empty buckets left out
+};
+
+// Filled in by each PointToPointRouter query (and registerDepot). The histograms cover every query
+// since the router was made.
+struct RouterStats
+{
+    long long nodesExpanded = 0; // Nodes popped off the open set and expanded
+    long long heapPushes = 0;    // Entries pushed onto the open set
+    long long relaxations = 0;   // Edges that improved a neighbor's distance
+    double seconds = 0;
+    StatsHistogram expandedPerQuery;
+    StatsHistogram microsecondsPerQuery;
+
+    std::string toJson() const;
+};
+
+// Filled in by each DeliveryOptimizer call
+struct OptimizerStats
+{
+    long long iterations = 0; // Candidate deliveries compared while choosing the next stop
+    double oldMiles = 0;      // Crow's distance of the given order and of the optimized one
+    double newMiles = 0;
+    double improvement = 0;   // oldMiles - newMiles
+    double seconds = 0;
+    StatsHistogram microsecondsPerCall;
+
+    std::string toJson() const;
+};
+
+// Filled in by StreetMap::load
+struct LoadStats
+{
+    long long bytes = 0;
+    double seconds = 0;
+    double bytesPerSecond = 0;
+    int nodes = 0;
+    int edges = 0;
+    int streets = 0;
+    int chunks = 0; // Pieces the file was split into to parse in parallel (0 if it was read line by line)
+    StatsHistogram coordProbes; // Buckets looked at per coord lookup in the coord -> node hash map
+    StatsHistogram nameProbes;  // Same for street names
+
+    std::string toJson() const;
+};
+
+// Piece of text inside a buffer something else owns, like C++17's string_view
+struct TextView
+{
+    const char* data = nullptr;
+    size_t size = 0;
+
+    std::string str() const { return std::string(data, size); }
+};
+
+// A deliveries file (the depot's coords on the first line, then "lat lon:item" per delivery) mapped
+// into memory and parsed where it lies, for batch files of millions of lines: no line is copied,
+// the text parts are views into the file and each coord is read with strtod once. Lines are
+// accepted and turned down exactly as parseDelivery does, with the same messages on cout, except
+// that a coord that isn't a number is turned down too (GeoCoord's constructor would throw).
+// Views are only good until the file is closed (DeliveryFile.cpp).
+class DeliveryFile
+{
+public:
+    struct Delivery
+    {
+        TextView latitudeText;
+        TextView longitudeText;
+        TextView item;
+        double latitude;
+        double longitude;
+    };
+
+    DeliveryFile();
+    ~DeliveryFile();
+    bool open(const std::string& path); // False if the file can't be read or has no depot coords
+    void close();
+    const GeoCoord& depot() const { return m_depot; }
+    const std::vector<Delivery>& deliveries() const { return m_deliveries; }
+    // Node id in map of each delivery's coord, or -1 if it isn't a map node, looked up on threads
+    // threads (0 means one per core). Returns how many aren't on the map.
+    int findNodes(const StreetMap& map, std::vector<int>& nodes, int threads = 0) const;
+    // The deliveries as DeliveryRequests, for DeliveryPlanner; appended to requests
+    void toRequests(std::vector<DeliveryRequest>& requests) const;
+
+    DeliveryFile(const DeliveryFile&) = delete;
+    DeliveryFile& operator=(const DeliveryFile&) = delete;
+
+private:
+    const char* m_data;  // The whole file
+    size_t m_size;
+    bool m_mapped;       // Whether m_data is mapped (otherwise it's m_copy's)
+    std::string m_copy;  // The file read normally, if it couldn't be mapped
+    GeoCoord m_depot;
+    std::vector<Delivery> m_deliveries;
+
+    void parse(const char* p); // Fills in m_deliveries from the lines starting at p
+};
+
+// Runs the named benchmarks (all of them if names is empty) against a map file (Benchmark.cpp)
+int runBenchmarks(const std::string& mapFile, const std::vector<std::string>& names);
+
+// Runs the named correctness checks (all of them if names is empty) against a map file (Check.cpp);
+// returns 1 if any failed
+int runChecks(const std::string& mapFile, const std::vector<std::string>& names);
+
+// Splits one line of a deliveries file, "lat lon:item", into its parts; false if the line is
+// malformed, after saying why on cout (main.cpp)
+bool parseDelivery(std::string line, std::string& lat, std::string& lon, std::string& item);
+
+// Answers newline-delimited JSON plan requests from in on out until in ends (see Server.cpp);
+// planThreads plans run at once
+int runServer(const StreetMap& sm, std::istream& in, std::ostream& out, int planThreads);
 
 #endif /* support_h */